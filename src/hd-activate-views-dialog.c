@@ -38,6 +38,7 @@
 #include "hd-activate-views-dialog.h"
 #include "hd-backgrounds.h"
 #include "hd-change-background-dialog.h"
+#include "hd-pixbuf-utils.h"
 
 #define HD_GCONF_KEY_ACTIVE_VIEWS "/apps/osso/hildon-desktop/views/active"
 #define HD_DESKTOP_VIEWS_MAX 9
@@ -262,15 +263,26 @@ hd_activate_views_dialog_init (HDActivateViewsDialog *dialog)
 
       if (hd_change_background_dialog_is_portrait () 
             && hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
-        bg_image = g_strdup_printf ("%s/.backgrounds/background_portrait-%u.png",
-                                    g_get_home_dir (),
-                                    i);
+        bg_image = hd_backgrounds_get_cached_image_filename (hd_backgrounds_get (),
+                                                             HD_DESKTOP_VIEWS + i - 1);
       else
-        bg_image = g_strdup_printf ("%s/.backgrounds/background-%u.png",
-                                    g_get_home_dir (),
-                                    i);        
+        bg_image = hd_backgrounds_get_cached_image_filename (hd_backgrounds_get (),
+                                                             i - 1);
 
-      pixbuf = gdk_pixbuf_new_from_file_at_scale (bg_image, 125, 75, TRUE, &error);
+      if (g_str_has_suffix (bg_image, ".raw"))
+        {
+          GdkPixbuf *raw = hd_pixbuf_utils_load_raw (bg_image, &error);
+
+          pixbuf = NULL;
+          if (raw)
+            {
+              pixbuf = gdk_pixbuf_scale_simple (raw, 125, 75,
+                                                GDK_INTERP_BILINEAR);
+              g_object_unref (raw);
+            }
+        }
+      else
+        pixbuf = gdk_pixbuf_new_from_file_at_scale (bg_image, 125, 75, TRUE, &error);
 
       if (error)
         {
@@ -24,6 +24,7 @@
 #include <config.h>
 #endif
 
+#include "hd-command-thread-pool.h"
 #include "hd-desktop.h"
 #include "hd-object-vector.h"
 
@@ -36,12 +37,38 @@
 #define BACKGROUND_INFO_KEY_FILE_FMT "File-%u"
 #define BACKGROUND_INFO_KEY_ETAG_FMT "Etag-%u"
 
+/* Changes are written this many milliseconds after the first one, so
+ * that all the views updated by a theme change are written at once. */
+#define BACKGROUND_INFO_SAVE_DELAY 500
+
 struct _HDBackgroundInfoPrivate
 {
   GPtrArray *etags;
   HDObjectVector *files;
+
+  /* The file is written by @writer from a snapshot of the contents
+   * taken by the main thread when @save_id fires.  @dirty is set
+   * while there are changes no snapshot has been taken of. */
+  HDCommandThreadPool *writer;
+  guint save_id;
+  gboolean dirty;
 };
 
+/* A snapshot of the file contents for the writer thread. */
+typedef struct
+{
+  gchar *contents;
+  gsize length;
+} SaveRequest;
+
+/* Lets the main thread wait until the writer has got this far. */
+typedef struct
+{
+  GMutex mutex;
+  GCond cond;
+  gboolean reached;
+} SaveBarrier;
+
 static void hd_background_info_dispose (GObject *object);
 
 static inline GFile *get_background_info_file (void);
@@ -66,7 +93,11 @@ static char *get_etag_from_key_file (GKeyFile *key_file,
 static void load_background_info_legacy (HDBackgroundInfo *info,
                                          char             *file_contents,
                                          gsize             file_size);
-static void save_background_info_file (HDBackgroundInfo *info);
+static void schedule_save (HDBackgroundInfo *info);
+static gboolean save_timeout (HDBackgroundInfo *info);
+static void push_save (HDBackgroundInfo *info);
+static void save_background_info_file (SaveRequest *request);
+static void save_barrier_reached (SaveBarrier *barrier);
 
 G_DEFINE_TYPE_WITH_CODE (HDBackgroundInfo, hd_background_info, G_TYPE_OBJECT, G_ADD_PRIVATE(HDBackgroundInfo));
 
@@ -378,11 +409,23 @@ hd_background_info_init_finish (HDBackgroundInfo  *info,
 static void
 hd_background_info_dispose (GObject *object)
 {
-  HDBackgroundInfoPrivate *priv = HD_BACKGROUND_INFO (object)->priv;
+  HDBackgroundInfo *info = HD_BACKGROUND_INFO (object);
+  HDBackgroundInfoPrivate *priv = info->priv;
+
+  /* Don't lose the changes not written yet */
+  if (priv->save_id)
+    priv->save_id = (g_source_remove (priv->save_id), 0);
+  if (priv->dirty)
+    push_save (info);
+
+  /* Waits for the queued writes */
+  if (priv->writer)
+    priv->writer = (g_object_unref (priv->writer), NULL);
 
   if (priv->etags)
     {
-      g_ptr_array_free (priv->etags, FALSE);
+      g_ptr_array_foreach (priv->etags, (GFunc) g_free, NULL);
+      g_ptr_array_free (priv->etags, TRUE);
       priv->etags = NULL;
     }
 
@@ -427,30 +470,111 @@ hd_background_info_set (HDBackgroundInfo *info,
                         const char       *etag)
 {
   HDBackgroundInfoPrivate *priv;
+  GFile *current_file;
 
   g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
 
   priv = HD_BACKGROUND_INFO (info)->priv;
 
+  current_file = hd_object_vector_at (priv->files,
+                                      desktop);
+  if (((!current_file && !file) ||
+       (current_file && file && g_file_equal (current_file, file))) &&
+      !g_strcmp0 (g_ptr_array_index (priv->etags, desktop), etag))
+    return;
+
   hd_object_vector_set_at (priv->files,
                            desktop,
                            file);
+  g_free (g_ptr_array_index (priv->etags,
+                             desktop));
   g_ptr_array_index (priv->etags,
                      desktop) = g_strdup (etag);
 
-  save_background_info_file (info);
+  priv->dirty = TRUE;
+  schedule_save (info);
+}
+
+/**
+ * hd_background_info_flush:
+ * @info: a #HDBackgroundInfo
+ *
+ * Writes the changes not written yet and waits until they are on
+ * disk.  Called before hildon-home exits.
+ */
+void
+hd_background_info_flush (HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv;
+  SaveBarrier barrier;
+
+  g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
+
+  priv = info->priv;
+
+  if (priv->save_id)
+    priv->save_id = (g_source_remove (priv->save_id), 0);
+  if (priv->dirty)
+    push_save (info);
+
+  if (!priv->writer)
+    return;
+
+  g_mutex_init (&barrier.mutex);
+  g_cond_init (&barrier.cond);
+  barrier.reached = FALSE;
+
+  hd_command_thread_pool_push (priv->writer,
+                               (HDCommandCallback) save_barrier_reached,
+                               &barrier,
+                               NULL);
+
+  g_mutex_lock (&barrier.mutex);
+  while (!barrier.reached)
+    g_cond_wait (&barrier.cond, &barrier.mutex);
+  g_mutex_unlock (&barrier.mutex);
+
+  g_mutex_clear (&barrier.mutex);
+  g_cond_clear (&barrier.cond);
+}
+
+static void
+schedule_save (HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv = info->priv;
+
+  if (!priv->save_id)
+    priv->save_id = g_timeout_add (BACKGROUND_INFO_SAVE_DELAY,
+                                   (GSourceFunc) save_timeout,
+                                   info);
+}
+
+static gboolean
+save_timeout (HDBackgroundInfo *info)
+{
+  info->priv->save_id = 0;
+
+  push_save (info);
+
+  return FALSE;
+}
+
+static void
+save_request_free (SaveRequest *request)
+{
+  g_free (request->contents);
+  g_slice_free (SaveRequest, request);
 }
 
+/* Takes a snapshot of the file contents and hands it over to the
+ * writer.  A snapshot still waiting there is superseded. */
 static void
-save_background_info_file (HDBackgroundInfo *info)
+push_save (HDBackgroundInfo *info)
 {
   HDBackgroundInfoPrivate *priv = info->priv;
   GKeyFile *key_file = g_key_file_new ();
-  GFile *background_info_file;
+  SaveRequest *request;
   guint desktop;
-  gchar *contents;
-  gsize length;
-  GError *error = NULL;
 
   g_key_file_set_integer (key_file,
                           BACKGROUND_INFO_GROUP,
@@ -500,15 +624,48 @@ save_background_info_file (HDBackgroundInfo *info)
         }
     }
 
-  contents = g_key_file_to_data (key_file,
-                                 &length,
-                                 NULL);
+  request = g_slice_new (SaveRequest);
+  request->contents = g_key_file_to_data (key_file,
+                                          &request->length,
+                                          NULL);
+  g_key_file_free (key_file);
+
+  priv->dirty = FALSE;
+
+  if (!priv->writer)
+    priv->writer = hd_command_thread_pool_new ();
+
+  hd_command_thread_pool_push_full (priv->writer,
+                                    G_PRIORITY_DEFAULT,
+                                    "save",
+                                    (HDCommandCallback) save_background_info_file,
+                                    request,
+                                    (GDestroyNotify) save_request_free);
+}
+
+/* #HDCommandCallback of the writer thread. */
+static void
+save_barrier_reached (SaveBarrier *barrier)
+{
+  g_mutex_lock (&barrier->mutex);
+  barrier->reached = TRUE;
+  g_cond_signal (&barrier->cond);
+  g_mutex_unlock (&barrier->mutex);
+}
+
+/* #HDCommandCallback of the writer thread.  The file is replaced
+ * atomically, so it's never seen half written. */
+static void
+save_background_info_file (SaveRequest *request)
+{
+  GFile *background_info_file;
+  GError *error = NULL;
 
   background_info_file = get_background_info_file ();
 
   g_file_replace_contents (background_info_file,
-                           contents,
-                           length,
+                           request->contents,
+                           request->length,
                            NULL,
                            FALSE,
                            G_FILE_CREATE_NONE,
@@ -524,7 +681,5 @@ save_background_info_file (HDBackgroundInfo *info)
       g_error_free (error);
     }
 
-  g_key_file_free (key_file);
-  g_free (contents);
   g_object_unref (background_info_file);
 }
@@ -71,7 +71,7 @@ void              hd_background_info_set      (HDBackgroundInfo *info,
                                                guint             desktop,
                                                GFile            *file,
                                                const char       *etag);
-
+void              hd_background_info_flush    (HDBackgroundInfo *info);
 
 
 G_END_DECLS
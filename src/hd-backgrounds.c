@@ -37,6 +37,7 @@
 #include <gconf/gconf-client.h>
 
 #include <unistd.h>
+#include <utime.h>
 #include <errno.h>
 
 #include "hd-background-info.h"
@@ -50,6 +51,24 @@
 #define CACHED_DIR        ".backgrounds"
 #define BACKGROUND_CACHED_PNG CACHED_DIR "/background-%u.png"
 #define BACKGROUND_CACHED_PNG_PORTRAIT CACHED_DIR "/background_portrait-%u.png"
+#define BACKGROUND_CACHED_RAW CACHED_DIR "/background-%u.raw"
+#define BACKGROUND_CACHED_RAW_PORTRAIT CACHED_DIR "/background_portrait-%u.raw"
+#define CACHED_STORE_DIR  "store"
+
+/* [Backgrounds] section of home.conf */
+#define HD_BACKGROUNDS_CONF               HD_DESKTOP_CONFIG_PATH "/home.conf"
+#define HD_BACKGROUNDS_CONF_GROUP         "Backgrounds"
+#define HD_BACKGROUNDS_DEFAULT_FORMAT     "png"
+#define HD_BACKGROUNDS_DEFAULT_COMPRESSION 1
+#define HD_BACKGROUNDS_DEFAULT_CACHE_SIZE 16384
+#define HD_BACKGROUNDS_DEFAULT_THEME_NEIGHBOURS 1
+
+/* Etags of source images which can't be monitored are trusted for this
+ * many microseconds */
+#define SOURCE_INFO_TTL (2 * G_USEC_PER_SEC)
+
+/* Forget all source image etags beyond this many */
+#define SOURCE_INFO_MAX 64
 
 #define GCONF_KEY_PORTRAIT_WALLPAPER "/apps/osso/hildon-desktop/portrait_wallpaper"
 
@@ -74,18 +93,62 @@ typedef struct
   GCancellable *cancellable;
 } CacheImageRequestData;
 
+/* What is known about a source image */
+typedef struct
+{
+  gchar *etag;
+  GFileMonitor *monitor;
+
+  /* Only when there is no monitor */
+  gint64 expires;
+
+  /* While set, the etag is being queried and @etag is not valid yet */
+  gboolean querying;
+} SourceInfo;
+
+/* A create_cached_background() waiting for the etag of its file.
+ * @generation is the one of @view when it was requested. */
+typedef struct
+{
+  GFile *file;
+  guint view;
+  guint generation;
+  gboolean error_dialogs;
+  gboolean update_gconf;
+  gboolean low_priority;
+} PendingBackground;
+
 struct _HDBackgroundsPrivate
 {
   GConfClient *gconf_client;
 
   /* GConf notify handlers */
   guint bg_image_notify[HD_DESKTOP_VIEWS*2];
+  guint current_view_notify;
 
   /* Data used for the thread which creates the cached images */
   HDCommandThreadPool *thread_pool;
 
   GPtrArray *requests;
 
+  /* While set, the cached images are created in parallel, see
+   * hd_backgrounds_begin_batch() */
+  HDCommandBatch *batch;
+  GPtrArray *batch_requests;
+
+  /* While set, the cached images are created when there is nothing
+   * else to do */
+  gboolean low_priority;
+
+  /* While set, the cached images are requested without waiting for the
+   * etags of their files, so they are created in the order and at the
+   * priority they are requested */
+  gboolean loading;
+
+  /* Set when hildon-home is about to be restarted after a theme change,
+   * the restarted one takes care of the backgrounds from then on */
+  gboolean restarting;
+
   /* background info */
   HDBackgroundInfo *info;
 
@@ -98,82 +161,449 @@ struct _HDBackgroundsPrivate
   GnomeVFSVolumeMonitor *volume_monitor2;
 #endif
   gboolean portrait_wallpaper;
+
+  /* How the cached images are saved */
+  gchar *cache_format;
+  gchar *png_compression;
+
+  /* Bytes the images in the store may take, see
+   * evict_cached_images() */
+  goffset cache_size;
+
+  /* Views on each side of the current one to prepare on theme changes
+   * before restarting, or -1 for all of them */
+  gint theme_neighbours;
+
+  /* URI -> SourceInfo, protected by source_info_mutex */
+  GHashTable *source_info;
+
+  /* URI -> GSList of PendingBackground, for the etags queried
+   * asynchronously */
+  GHashTable *pending_backgrounds;
+
+  /* Bumped by each create_cached_background() for the view, so that a
+   * pending request overtaken by a newer one is dropped */
+  guint view_generation[HD_DESKTOP_VIEWS*2];
 };
 
 static CacheImageRequestData *cache_image_request_data_new (GFile        *file,
                                                             gboolean      error_dialogs,
                                                             GCancellable *cancellable);
 static void cache_image_request_data_free (CacheImageRequestData *data);
+static void set_background_in_gconf (HDBackgrounds *backgrounds,
+                                     guint          view,
+                                     GFile         *source_file);
 
 static gboolean remove_request (CacheImageRequestData *request);
 
 G_DEFINE_TYPE_WITH_CODE (HDBackgrounds, hd_backgrounds, G_TYPE_OBJECT, G_ADD_PRIVATE(HDBackgrounds));
 
+/* The worker threads of a batch may update GConf at the same time */
+G_LOCK_DEFINE_STATIC (gconf_client);
+
+/* Held while the store of cached images or the links of the views into
+ * it are changed */
+G_LOCK_DEFINE_STATIC (cache_store);
+
+static GMutex source_info_mutex;
+static GCond  source_info_cond;
+
+/* Collect the cached images created from now on into a batch, so they
+ * can be created in parallel */
 static void
-create_cached_background (HDBackgrounds *backgrounds,
-                          GFile         *image_file,
-                          guint          view,
-                          gboolean       error_dialogs,
-                          gboolean       update_gconf)
+hd_backgrounds_begin_batch (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  g_return_if_fail (priv->batch == NULL);
+
+  priv->batch = hd_command_batch_new ();
+  priv->batch_requests = g_ptr_array_new ();
+}
+
+/* Create the cached images collected since hd_backgrounds_begin_batch().
+ * Commands added to the thread pool afterwards are executed when all
+ * of them are done. */
+static void
+hd_backgrounds_end_batch (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  guint i;
+
+  g_return_if_fail (priv->batch != NULL);
+
+  hd_command_thread_pool_push_batch (priv->thread_pool,
+                                     priv->batch);
+  priv->batch = NULL;
+
+  for (i = 0; i < priv->batch_requests->len; i++)
+    hd_command_thread_pool_push_idle (priv->thread_pool,
+                                      G_PRIORITY_HIGH_IDLE,
+                                      (GSourceFunc) remove_request,
+                                      g_ptr_array_index (priv->batch_requests, i),
+                                      (GDestroyNotify) cache_image_request_data_free);
+
+  g_ptr_array_free (priv->batch_requests, TRUE);
+  priv->batch_requests = NULL;
+}
+
+static void
+source_info_free (SourceInfo *info)
+{
+  if (info->monitor)
+    {
+      g_file_monitor_cancel (info->monitor);
+      g_object_unref (info->monitor);
+    }
+  g_free (info->etag);
+  g_slice_free (SourceInfo, info);
+}
+
+static gboolean
+source_info_is_valid (SourceInfo *info)
+{
+  return !info->querying &&
+         (info->monitor || g_get_monotonic_time () < info->expires);
+}
+
+static gboolean
+source_info_is_idle (gpointer    key,
+                     SourceInfo *info,
+                     gpointer    user_data)
+{
+  return !info->querying;
+}
+
+static void
+source_file_changed_cb (GFileMonitor      *monitor,
+                        GFile             *file,
+                        GFile             *other_file,
+                        GFileMonitorEvent  event_type,
+                        HDBackgrounds     *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  SourceInfo *info;
+  gchar *uri;
+
+  if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+    return;
+
+  uri = g_file_get_uri (file);
+
+  g_mutex_lock (&source_info_mutex);
+  info = g_hash_table_lookup (priv->source_info, uri);
+  if (info && info->monitor == monitor)
+    g_hash_table_remove (priv->source_info, uri);
+  g_mutex_unlock (&source_info_mutex);
+
+  g_free (uri);
+}
+
+/* Remembers @etag of @file until it changes.  Call with
+ * source_info_mutex held */
+static void
+source_info_set_etag (HDBackgrounds *backgrounds,
+                      GFile         *file,
+                      const gchar   *uri,
+                      const gchar   *etag)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  SourceInfo *info;
+
+  if (!etag)
+    {
+      g_hash_table_remove (priv->source_info, uri);
+      return;
+    }
+
+  info = g_hash_table_lookup (priv->source_info, uri);
+  if (!info)
+    {
+      if (g_hash_table_size (priv->source_info) >= SOURCE_INFO_MAX)
+        g_hash_table_foreach_remove (priv->source_info,
+                                     (GHRFunc) source_info_is_idle,
+                                     NULL);
+
+      info = g_slice_new0 (SourceInfo);
+      g_hash_table_insert (priv->source_info, g_strdup (uri), info);
+    }
+
+  g_free (info->etag);
+  info->etag = g_strdup (etag);
+  info->querying = FALSE;
+
+  if (!info->monitor)
+    {
+      info->monitor = g_file_monitor_file (file,
+                                           G_FILE_MONITOR_NONE,
+                                           NULL,
+                                           NULL);
+      if (info->monitor)
+        g_signal_connect (info->monitor, "changed",
+                          G_CALLBACK (source_file_changed_cb), backgrounds);
+      else
+        info->expires = g_get_monotonic_time () + SOURCE_INFO_TTL;
+    }
+}
+
+/* Returns the etag of @file if it's known, without any I/O */
+static gchar *
+source_info_lookup_etag (HDBackgrounds *backgrounds,
+                         GFile         *file)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  SourceInfo *info;
+  gchar *uri, *etag = NULL;
+
+  uri = g_file_get_uri (file);
+
+  g_mutex_lock (&source_info_mutex);
+  info = g_hash_table_lookup (priv->source_info, uri);
+  if (info && source_info_is_valid (info))
+    etag = g_strdup (info->etag);
+  g_mutex_unlock (&source_info_mutex);
+
+  g_free (uri);
+
+  return etag;
+}
+
+/*
+ * Returns the etag of @file, querying it if it's not known.  Threads
+ * asking for the same file at once wait for a single query.  Can be
+ * called from the command callbacks.
+ */
+static gchar *
+source_info_get_etag (HDBackgrounds *backgrounds,
+                      GFile         *file,
+                      GCancellable  *cancellable)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  SourceInfo *info;
+  GFileInfo *file_info;
+  gchar *uri, *etag = NULL;
+
+  uri = g_file_get_uri (file);
+
+  g_mutex_lock (&source_info_mutex);
+  while ((info = g_hash_table_lookup (priv->source_info, uri)) &&
+         info->querying)
+    g_cond_wait (&source_info_cond, &source_info_mutex);
+
+  if (info && source_info_is_valid (info))
+    {
+      etag = g_strdup (info->etag);
+      g_mutex_unlock (&source_info_mutex);
+      g_free (uri);
+      return etag;
+    }
+
+  if (!info)
+    {
+      info = g_slice_new0 (SourceInfo);
+      g_hash_table_insert (priv->source_info, g_strdup (uri), info);
+    }
+  info->querying = TRUE;
+  g_mutex_unlock (&source_info_mutex);
+
+  file_info = g_file_query_info (file,
+                                 G_FILE_ATTRIBUTE_ETAG_VALUE,
+                                 G_FILE_QUERY_INFO_NONE,
+                                 cancellable,
+                                 NULL);
+  if (file_info)
+    {
+      etag = g_strdup (g_file_info_get_etag (file_info));
+      g_object_unref (file_info);
+    }
+
+  g_mutex_lock (&source_info_mutex);
+  source_info_set_etag (backgrounds, file, uri, etag);
+  g_cond_broadcast (&source_info_cond);
+  g_mutex_unlock (&source_info_mutex);
+
+  g_free (uri);
+
+  return etag;
+}
+
+/* Creates the cached image of @view from @image_file, unless it has
+ * been made from the same file with @etag already */
+static void
+create_cached_background_for_etag (HDBackgrounds *backgrounds,
+                                   GFile         *image_file,
+                                   const gchar   *etag,
+                                   guint          view,
+                                   gboolean       error_dialogs,
+                                   gboolean       update_gconf)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
   GFile *current_file;
   const char *current_etag;
-  gboolean create_cached_background = TRUE;
+  HDBackground *background;
+  GCancellable *cancellable;
 
   current_file = hd_background_info_get_file (priv->info,
                                               view);
   current_etag = hd_background_info_get_etag (priv->info,
                                               view);
 
-  if (current_file &&
-      current_etag &&
+  if (etag &&
+      current_file &&
       g_file_equal (current_file,
-                    image_file))
+                    image_file) &&
+      g_strcmp0 (current_etag, etag) == 0)
+    return;
+
+  cancellable = g_cancellable_new ();
+
+  background = hd_file_background_new (image_file);
+
+  hd_file_background_set_for_view_full (HD_FILE_BACKGROUND (background),
+                                        view,
+                                        cancellable,
+                                        error_dialogs,
+                                        update_gconf);
+
+  g_object_unref (cancellable);
+}
+
+static void
+pending_background_free (PendingBackground *pending)
+{
+  g_object_unref (pending->file);
+  g_slice_free (PendingBackground, pending);
+}
+
+static void
+query_etag_cb (GFile         *file,
+               GAsyncResult  *result,
+               HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GFileInfo *info;
+  GSList *pending, *p;
+  gchar *uri, *etag = NULL;
+  GError *error = NULL;
+
+  info = g_file_query_info_finish (file, result, &error);
+  if (info)
     {
-      GFileInfo *info;
-      const char *etag;
-      GError *error = NULL;
+      etag = g_strdup (g_file_info_get_etag (info));
+      g_object_unref (info);
+    }
+  else
+    {
+      g_debug ("%s. Could not get etag value. %s",
+               __FUNCTION__,
+               error->message);
+      g_error_free (error);
+    }
 
-      info = g_file_query_info (image_file,
-                                G_FILE_ATTRIBUTE_ETAG_VALUE,
-                                G_FILE_QUERY_INFO_NONE,
-                                NULL,
-                                &error);
+  uri = g_file_get_uri (file);
 
-      if (error)
-        {
-          g_debug ("%s. Could not get etag value. %s",
-                   __FUNCTION__,
-                   error->message);
-          g_error_free (error);
-        }
+  g_mutex_lock (&source_info_mutex);
+  source_info_set_etag (backgrounds, file, uri, etag);
+  g_cond_broadcast (&source_info_cond);
+  g_mutex_unlock (&source_info_mutex);
 
-      if (info)
-        {
-          etag = g_file_info_get_etag (info);
+  pending = g_hash_table_lookup (priv->pending_backgrounds, uri);
+  g_hash_table_remove (priv->pending_backgrounds, uri);
 
-          create_cached_background = g_strcmp0 (current_etag, etag) != 0;
+  pending = g_slist_reverse (pending);
+  for (p = pending; p; p = p->next)
+    {
+      PendingBackground *pb = p->data;
 
-          g_object_unref (info);
+      /* Otherwise the older image would replace the newer one */
+      if (pb->generation == priv->view_generation[pb->view])
+        {
+          priv->low_priority = pb->low_priority;
+          create_cached_background_for_etag (backgrounds,
+                                             pb->file,
+                                             etag,
+                                             pb->view,
+                                             pb->error_dialogs,
+                                             pb->update_gconf);
+          priv->low_priority = FALSE;
         }
+      pending_background_free (pb);
     }
 
-  if (create_cached_background)
-    {
-      HDBackground *background;
-      GCancellable *cancellable = g_cancellable_new ();
+  g_slist_free (pending);
+  g_free (uri);
+  g_free (etag);
+}
 
-      background = hd_file_background_new (image_file);
+/*
+ * Creates the cached image of @view from @image_file, unless it is
+ * already.  That's decided without blocking: the etag of @image_file is
+ * taken from the source info if it's known.  Otherwise it's queried
+ * asynchronously, once for all the views which wait for the same file.
+ * A request still waiting for its etag is dropped when a newer one for
+ * the same view comes.  In batches and while the backgrounds are first
+ * loaded the decision is left to the commands, which reuse the image
+ * from the store if it's there.
+ */
+static void
+create_cached_background (HDBackgrounds *backgrounds,
+                          GFile         *image_file,
+                          guint          view,
+                          gboolean       error_dialogs,
+                          gboolean       update_gconf)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  PendingBackground *pb;
+  GSList *pending;
+  gchar *uri, *etag;
 
-      hd_file_background_set_for_view_full (HD_FILE_BACKGROUND (background),
-                                            view,
-                                            cancellable,
-                                            error_dialogs,
-                                            update_gconf);
+  g_return_if_fail (view < G_N_ELEMENTS (priv->view_generation));
 
-      g_object_unref (cancellable);
+  priv->view_generation[view]++;
+
+  etag = source_info_lookup_etag (backgrounds, image_file);
+  if (etag || priv->batch || priv->loading)
+    {
+      create_cached_background_for_etag (backgrounds,
+                                         image_file,
+                                         etag,
+                                         view,
+                                         error_dialogs,
+                                         update_gconf);
+      g_free (etag);
+      return;
+    }
+
+  pb = g_slice_new (PendingBackground);
+  pb->file = g_object_ref (image_file);
+  pb->view = view;
+  pb->generation = priv->view_generation[view];
+  pb->error_dialogs = error_dialogs;
+  pb->update_gconf = update_gconf;
+  pb->low_priority = priv->low_priority;
+
+  uri = g_file_get_uri (image_file);
+  pending = g_hash_table_lookup (priv->pending_backgrounds, uri);
+  if (pending)
+    {
+      /* The query is under way already */
+      g_hash_table_replace (priv->pending_backgrounds,
+                            uri,
+                            g_slist_prepend (pending, pb));
+      return;
     }
+
+  g_hash_table_insert (priv->pending_backgrounds,
+                       uri,
+                       g_slist_prepend (NULL, pb));
+
+  g_file_query_info_async (image_file,
+                           G_FILE_ATTRIBUTE_ETAG_VALUE,
+                           G_FILE_QUERY_INFO_NONE,
+                           G_PRIORITY_DEFAULT,
+                           NULL,
+                           (GAsyncReadyCallback) query_etag_cb,
+                           backgrounds);
 }
 
 static gboolean
@@ -325,6 +755,9 @@ gconf_bgimage_notify (GConfClient *client,
   HDBackgrounds *backgrounds = hd_backgrounds_get ();
   GFile *bg_image;
 
+  if (backgrounds->priv->restarting)
+    return;
+
   bg_image = get_background_for_view (backgrounds,
                                       GPOINTER_TO_UINT (user_data));
   if (bg_image)
@@ -381,6 +814,9 @@ background_info_loaded (HDBackgroundInfo *info,
 
   current_view = CLAMP (current_view, 0, max - 1);
 
+  /* No etag is known yet, don't let the queries decide the order */
+  priv->loading = TRUE;
+
   /* Update cache for current view */
   bg_image = get_background_for_view (backgrounds,
                                       current_view);
@@ -394,7 +830,10 @@ background_info_loaded (HDBackgroundInfo *info,
       g_object_unref (bg_image);
     }
 
-  /* Update cache for other views */
+  /* Update cache for other views, when there is nothing else to do.
+   * They are moved up when they are switched to, see
+   * gconf_current_view_notify() */
+  priv->low_priority = TRUE;
   for (i = 0; i < max; i++)
     {
       if (i != current_view)
@@ -412,6 +851,47 @@ background_info_loaded (HDBackgroundInfo *info,
             }
         }
     }
+  priv->low_priority = FALSE;
+  priv->loading = FALSE;
+}
+
+/* Prepares the background of the view switched to right away, if it's
+ * still waiting to be prepared at low priority */
+static void
+gconf_current_view_notify (GConfClient *client,
+                           guint        cnxn_id,
+                           GConfEntry  *entry,
+                           gpointer     user_data)
+{
+  HDBackgrounds *backgrounds = user_data;
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GFile *bg_image;
+  gint view;
+
+  if (priv->restarting ||
+      !entry->value ||
+      entry->value->type != GCONF_VALUE_INT)
+    return;
+
+  view = gconf_value_get_int (entry->value) - 1;
+  if (view < 0 || view >= HD_DESKTOP_VIEWS)
+    return;
+
+  if (hd_backgrounds_is_portrait_wallpaper_enabled (backgrounds))
+    view += HD_DESKTOP_VIEWS;
+
+  /* Supersedes the command waiting for the view, if any */
+  bg_image = get_background_for_view (backgrounds,
+                                      view);
+  if (bg_image)
+    {
+      create_cached_background (backgrounds,
+                                bg_image,
+                                view,
+                                FALSE,
+                                FALSE);
+      g_object_unref (bg_image);
+    }
 }
 
 static gboolean
@@ -440,6 +920,30 @@ get_current_theme (void)
   return current_theme;
 }
 
+/* Whether @view is to be prepared before restarting on a theme change */
+static gboolean
+is_near_view (HDBackgrounds *backgrounds,
+              guint          view,
+              gint           current_view)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gint distance;
+
+  if (priv->theme_neighbours < 0 || current_view < 0)
+    return TRUE;
+
+  /* Portrait views are only next to portrait ones */
+  if (view / HD_DESKTOP_VIEWS != current_view / HD_DESKTOP_VIEWS)
+    return FALSE;
+
+  /* Views wrap around */
+  distance = ABS ((gint) (view % HD_DESKTOP_VIEWS) -
+                  current_view % HD_DESKTOP_VIEWS);
+  distance = MIN (distance, HD_DESKTOP_VIEWS - distance);
+
+  return distance <= priv->theme_neighbours;
+}
+
 static void
 update_backgrounds_from_theme (HDBackgrounds *backgrounds,
                                const gchar   *backgrounds_desktop)
@@ -570,6 +1074,13 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
   /* Set to 0..HD_DESKTOP_VIEWS */
   current_view--;
 
+  /* Decode, scale and save the views in parallel, starting with the
+   * current one, and restart only when all of them are done.  Only the
+   * views next to the current one are prepared now unless configured
+   * otherwise, the restarted hildon-home prepares the others, see
+   * background_info_loaded() */
+  hd_backgrounds_begin_batch (backgrounds);
+
   if (current_view >= 0 && current_view < max_value)
     create_cached_background (backgrounds,
                               bg_image[current_view],
@@ -584,17 +1095,26 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
     {
       if (i != current_view)
         {
-          create_cached_background (backgrounds,
-                                    bg_image[i],
-                                    i,
-                                    FALSE,
-                                    TRUE);
+          if (is_near_view (backgrounds, i, current_view))
+            create_cached_background (backgrounds,
+                                      bg_image[i],
+                                      i,
+                                      FALSE,
+                                      TRUE);
+          else
+            set_background_in_gconf (backgrounds,
+                                     i,
+                                     bg_image[i]);
         }
     }
 
   for (i = 0; i < max_value; i++)
     g_object_unref (bg_image[i]);
 
+  hd_backgrounds_end_batch (backgrounds);
+
+  priv->restarting = TRUE;
+
   hd_command_thread_pool_push_idle (priv->thread_pool,
                                     G_PRIORITY_HIGH_IDLE,
                                     restart_hildon_home,
@@ -661,7 +1181,7 @@ hd_backgrounds_startup (HDBackgrounds *backgrounds)
                          backgrounds);
 
 
-  cached_dir = g_strdup_printf ("%s/" CACHED_DIR,
+  cached_dir = g_strdup_printf ("%s/" CACHED_DIR "/" CACHED_STORE_DIR,
                                 g_get_home_dir ());
   if (g_mkdir_with_parents (cached_dir,
                             S_IRUSR | S_IWUSR | S_IXUSR |
@@ -711,6 +1231,21 @@ hd_backgrounds_startup (HDBackgrounds *backgrounds)
       g_free (gconf_key);
     }
 
+  priv->current_view_notify = gconf_client_notify_add (priv->gconf_client,
+                                                       GCONF_CURRENT_DESKTOP_KEY,
+                                                       (GConfClientNotifyFunc) gconf_current_view_notify,
+                                                       backgrounds,
+                                                       NULL,
+                                                       &error);
+  if (error)
+    {
+      g_warning ("%s. Could not add notification to GConf %s. %s",
+                 __FUNCTION__,
+                 GCONF_CURRENT_DESKTOP_KEY,
+                 error->message);
+      g_clear_error (&error);
+    }
+
   /* When separate wallpapers for portrait mode are enabled */
   /* HD_DESKTOP_VIEWS..HD_DESKTOP_VIEWS * 2 are fake views, used to store informations */
   /* about wallpapers (for portrait mode). For example: */
@@ -833,6 +1368,62 @@ volume_pre_unmount_cb (GnomeVFSVolumeMonitor *monitor,
     }
 }
 #endif
+
+/* Reads the [Backgrounds] section of home.conf. */
+static void
+hd_backgrounds_configure (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GKeyFile *conf;
+  gchar *format;
+  gint compression, cache_size;
+  GError *error = NULL;
+
+  conf = g_key_file_new ();
+  g_key_file_load_from_file (conf, HD_BACKGROUNDS_CONF, G_KEY_FILE_NONE, NULL);
+
+  format = g_key_file_get_string (conf, HD_BACKGROUNDS_CONF_GROUP,
+                                  "format", NULL);
+  if (format)
+    g_strstrip (format);
+  if (!g_strcmp0 (format, "png") ||
+      !g_strcmp0 (format, "argb32") ||
+      !g_strcmp0 (format, "rgb565"))
+    priv->cache_format = format;
+  else
+    {
+      if (format)
+        g_warning ("%s. Unknown cached image format %s",
+                   __FUNCTION__, format);
+      g_free (format);
+      priv->cache_format = g_strdup (HD_BACKGROUNDS_DEFAULT_FORMAT);
+    }
+
+  compression = g_key_file_get_integer (conf, HD_BACKGROUNDS_CONF_GROUP,
+                                        "png-compression", &error);
+  if (error || compression < 0 || compression > 9)
+    compression = HD_BACKGROUNDS_DEFAULT_COMPRESSION;
+  g_clear_error (&error);
+  priv->png_compression = g_strdup_printf ("%d", compression);
+
+  cache_size = g_key_file_get_integer (conf, HD_BACKGROUNDS_CONF_GROUP,
+                                       "cache-size", &error);
+  if (error || cache_size < 0)
+    cache_size = HD_BACKGROUNDS_DEFAULT_CACHE_SIZE;
+  g_clear_error (&error);
+  priv->cache_size = (goffset) cache_size * 1024;
+
+  priv->theme_neighbours = g_key_file_get_integer (conf,
+                                                   HD_BACKGROUNDS_CONF_GROUP,
+                                                   "theme-neighbours",
+                                                   &error);
+  if (error || priv->theme_neighbours < -1)
+    priv->theme_neighbours = HD_BACKGROUNDS_DEFAULT_THEME_NEIGHBOURS;
+  g_clear_error (&error);
+
+  g_key_file_free (conf);
+}
+
 static void
 hd_backgrounds_init (HDBackgrounds *backgrounds)
 {
@@ -845,6 +1436,15 @@ hd_backgrounds_init (HDBackgrounds *backgrounds)
 
   priv->requests = g_ptr_array_new ();
 
+  priv->source_info = g_hash_table_new_full (g_str_hash,
+                                             g_str_equal,
+                                             g_free,
+                                             (GDestroyNotify) source_info_free);
+  priv->pending_backgrounds = g_hash_table_new_full (g_str_hash,
+                                                     g_str_equal,
+                                                     g_free,
+                                                     NULL);
+
   priv->thread_pool = hd_command_thread_pool_new ();
 
   priv->volume_monitor = g_volume_monitor_get ();
@@ -858,6 +1458,7 @@ hd_backgrounds_init (HDBackgrounds *backgrounds)
 #endif
   priv->portrait_wallpaper = gconf_client_get_bool (priv->gconf_client, GCONF_KEY_PORTRAIT_WALLPAPER, NULL);
 
+  hd_backgrounds_configure (backgrounds);
 }
 
 static void
@@ -880,6 +1481,9 @@ hd_backgrounds_dipose (GObject *object)
             priv->bg_image_notify[i] = (gconf_client_notify_remove (priv->gconf_client,
                                                                     priv->bg_image_notify[i]), 0);
         }
+      if (priv->current_view_notify)
+        priv->current_view_notify = (gconf_client_notify_remove (priv->gconf_client,
+                                                                 priv->current_view_notify), 0);
       priv->gconf_client = (g_object_unref (priv->gconf_client), NULL);
     }
 
@@ -893,6 +1497,8 @@ hd_backgrounds_dipose (GObject *object)
     priv->set_theme_idle_id = (g_source_remove (priv->set_theme_idle_id), 0);
 
   priv->current_theme = (g_free (priv->current_theme), NULL);
+  priv->cache_format = (g_free (priv->cache_format), NULL);
+  priv->png_compression = (g_free (priv->png_compression), NULL);
 
   G_OBJECT_CLASS (hd_backgrounds_parent_class)->dispose (object);
 }
@@ -954,6 +1560,56 @@ hd_backgrounds_get_background (HDBackgrounds *backgrounds,
                                       view);
 }
 
+static void
+add_create_cached_image (HDBackgrounds     *backgrounds,
+                         const gchar       *key,
+                         GFile             *source_file,
+                         gboolean           error_dialogs,
+                         GCancellable      *cancellable,
+                         HDCommandCallback  command,
+                         gpointer           data,
+                         GDestroyNotify     destroy_data)
+{
+  HDBackgroundsPrivate *priv;
+  CacheImageRequestData *request;
+  gint priority;
+
+  priv = backgrounds->priv;
+
+  request = cache_image_request_data_new (source_file,
+                                          error_dialogs,
+                                          cancellable);
+  g_ptr_array_add (priv->requests,
+                   request);
+
+  if (priv->batch)
+    {
+      hd_command_batch_add (priv->batch,
+                            command,
+                            data,
+                            destroy_data);
+      g_ptr_array_add (priv->batch_requests,
+                       request);
+      return;
+    }
+
+  priority = priv->low_priority ? G_PRIORITY_LOW : G_PRIORITY_DEFAULT;
+
+  hd_command_thread_pool_push_full (priv->thread_pool,
+                                    priority,
+                                    key,
+                                    command,
+                                    data,
+                                    destroy_data);
+
+  hd_command_thread_pool_push_idle_full (priv->thread_pool,
+                                         priority,
+                                         G_PRIORITY_HIGH_IDLE,
+                                         (GSourceFunc) remove_request,
+                                         request,
+                                         (GDestroyNotify) cache_image_request_data_free);
+}
+
 void
 hd_backgrounds_add_create_cached_image (HDBackgrounds     *backgrounds,
                                         GFile             *source_file,
@@ -963,29 +1619,45 @@ hd_backgrounds_add_create_cached_image (HDBackgrounds     *backgrounds,
                                         gpointer           data,
                                         GDestroyNotify     destroy_data)
 {
-  HDBackgroundsPrivate *priv;
-  CacheImageRequestData *request;
-
   g_return_if_fail (HD_IS_BACKGROUNDS (backgrounds));
 
-  priv = backgrounds->priv;
+  add_create_cached_image (backgrounds,
+                           NULL,
+                           source_file,
+                           error_dialogs,
+                           cancellable,
+                           command,
+                           data,
+                           destroy_data);
+}
 
-  request = cache_image_request_data_new (source_file,
-                                          error_dialogs,
-                                          cancellable);
-  g_ptr_array_add (priv->requests,
-                   request);
+/* Like hd_backgrounds_add_create_cached_image() for the cached image of
+ * @view only.  A request for the same view which hasn't been started
+ * yet is dropped, as this one would overwrite its result anyway. */
+void
+hd_backgrounds_add_create_cached_image_for_view (HDBackgrounds     *backgrounds,
+                                                 guint              view,
+                                                 GFile             *source_file,
+                                                 gboolean           error_dialogs,
+                                                 GCancellable      *cancellable,
+                                                 HDCommandCallback  command,
+                                                 gpointer           data,
+                                                 GDestroyNotify     destroy_data)
+{
+  gchar *key;
 
-  hd_command_thread_pool_push (priv->thread_pool,
-                               command,
-                               data,
-                               destroy_data);
+  g_return_if_fail (HD_IS_BACKGROUNDS (backgrounds));
 
-  hd_command_thread_pool_push_idle (priv->thread_pool,
-                                    G_PRIORITY_HIGH_IDLE,
-                                    (GSourceFunc) remove_request,
-                                    request,
-                                    (GDestroyNotify) cache_image_request_data_free);
+  key = g_strdup_printf ("view-%u", view);
+  add_create_cached_image (backgrounds,
+                           key,
+                           source_file,
+                           error_dialogs,
+                           cancellable,
+                           command,
+                           data,
+                           destroy_data);
+  g_free (key);
 }
 
 static gboolean
@@ -1046,10 +1718,360 @@ update_cache_info_file (HDBackgrounds *backgrounds,
                              NULL);
 }
 
+static gchar *
+get_cached_image_filename (guint    view,
+                           gboolean raw)
+{
+  if (view >= HD_DESKTOP_VIEWS)
+    return g_strdup_printf (raw
+                            ? "%s/" BACKGROUND_CACHED_RAW_PORTRAIT
+                            : "%s/" BACKGROUND_CACHED_PNG_PORTRAIT,
+                            g_get_home_dir (),
+                            (view - HD_DESKTOP_VIEWS) + 1);
+  else
+    return g_strdup_printf (raw
+                            ? "%s/" BACKGROUND_CACHED_RAW
+                            : "%s/" BACKGROUND_CACHED_PNG,
+                            g_get_home_dir (),
+                            view + 1);
+}
+
+/* Returns the file name of the cached image of @view, views from
+ * HD_DESKTOP_VIEWS on are the portrait ones.  It ends in .raw if the
+ * image is saved in one of the raw formats, see hd_pixbuf_utils_load_raw() */
+gchar *
+hd_backgrounds_get_cached_image_filename (HDBackgrounds *backgrounds,
+                                          guint          view)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  return get_cached_image_filename (view,
+                                    g_strcmp0 (priv->cache_format, "png") != 0);
+}
+
+/*
+ * The cached images are kept in a store, named after a checksum of what
+ * they were made from, and the file of each view is a symbolic link into
+ * it.  So the image of a file which is used on several views or again
+ * later, like when going back to a theme, is only made once.  Without
+ * an etag the image can't be told from a later one of the same file,
+ * so it's written to the file of the view instead.
+ */
+static gchar *
+get_store_filename (HDBackgrounds *backgrounds,
+                    GFile         *source_file,
+                    const char    *source_etag,
+                    gint           width,
+                    gint           height,
+                    guint          part)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gchar *uri, *key, *checksum, *filename;
+
+  uri = g_file_get_uri (source_file);
+  key = g_strdup_printf ("%s\n%s\n%dx%d\n%u\n%s",
+                         uri, source_etag, width, height, part,
+                         priv->cache_format);
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+  filename = g_strdup_printf ("%s/" CACHED_DIR "/" CACHED_STORE_DIR "/%s.%s",
+                              g_get_home_dir (),
+                              checksum,
+                              g_strcmp0 (priv->cache_format, "png") ? "raw" : "png");
+
+  g_free (checksum);
+  g_free (key);
+  g_free (uri);
+
+  return filename;
+}
+
+/* Points the file of @view to @store_filename.  Call with the
+ * cache_store lock held */
+static gboolean
+link_cached_image (HDBackgrounds  *backgrounds,
+                   guint           view,
+                   const gchar    *store_filename,
+                   GError        **error)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gchar *filename, *tmp_filename, *basename, *target;
+  gboolean result = TRUE;
+
+  filename = get_cached_image_filename (view,
+                                        g_strcmp0 (priv->cache_format, "png") != 0);
+  tmp_filename = g_strconcat (filename, ".tmp", NULL);
+  basename = g_path_get_basename (store_filename);
+  target = g_build_filename (CACHED_STORE_DIR, basename, NULL);
+  g_free (basename);
+
+  g_unlink (tmp_filename);
+  if (symlink (target, tmp_filename) ||
+      g_rename (tmp_filename, filename))
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (saved_errno),
+                   "Could not link %s to %s. %s",
+                   filename,
+                   target,
+                   g_strerror (saved_errno));
+      g_unlink (tmp_filename);
+      result = FALSE;
+    }
+
+  g_free (target);
+  g_free (tmp_filename);
+  g_free (filename);
+
+  return result;
+}
+
+typedef struct
+{
+  gchar  *filename;
+  goffset size;
+  time_t  mtime;
+} StoreEntry;
+
+static gint
+store_entry_cmp (const StoreEntry *a,
+                 const StoreEntry *b)
+{
+  return a->mtime < b->mtime ? -1 : a->mtime > b->mtime;
+}
+
+/* Removes the least recently used images from the store, which aren't
+ * linked from any view, until it's not bigger than the cache-size.
+ * The #HDCommandCallback of schedule_evict_cached_images() */
+static void
+evict_cached_images (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GHashTable *linked;
+  GPtrArray *entries;
+  GDir *dir;
+  gchar *store_dir;
+  const gchar *name;
+  goffset total = 0;
+  guint view, i;
+
+  store_dir = g_strdup_printf ("%s/" CACHED_DIR "/" CACHED_STORE_DIR,
+                               g_get_home_dir ());
+  dir = g_dir_open (store_dir, 0, NULL);
+  if (!dir)
+    {
+      g_free (store_dir);
+      return;
+    }
+
+  /* Nothing may be linked or stored meanwhile */
+  G_LOCK (cache_store);
+
+  /* The images shown now */
+  linked = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (view = 0; view < HD_DESKTOP_VIEWS * 2; view++)
+    for (i = 0; i < 2; i++)
+      {
+        gchar *filename = get_cached_image_filename (view, i);
+        gchar *target = g_file_read_link (filename, NULL);
+
+        if (target)
+          g_hash_table_replace (linked, g_path_get_basename (target), NULL);
+
+        g_free (target);
+        g_free (filename);
+      }
+
+  entries = g_ptr_array_new ();
+  while ((name = g_dir_read_name (dir)))
+    {
+      StoreEntry *entry;
+      struct stat buf;
+      gchar *filename;
+
+      /* Images being written */
+      if (g_str_has_suffix (name, ".tmp"))
+        continue;
+
+      filename = g_build_filename (store_dir, name, NULL);
+      if (g_stat (filename, &buf))
+        {
+          g_free (filename);
+          continue;
+        }
+
+      total += buf.st_size;
+      if (g_hash_table_lookup_extended (linked, name, NULL, NULL))
+        {
+          g_free (filename);
+          continue;
+        }
+
+      entry = g_slice_new (StoreEntry);
+      entry->filename = filename;
+      entry->size = buf.st_size;
+      entry->mtime = buf.st_mtime;
+      g_ptr_array_add (entries, entry);
+    }
+  g_dir_close (dir);
+
+  g_ptr_array_sort (entries, (GCompareFunc) store_entry_cmp);
+  for (i = 0; i < entries->len; i++)
+    {
+      StoreEntry *entry = g_ptr_array_index (entries, i);
+
+      if (total > priv->cache_size && !g_unlink (entry->filename))
+        total -= entry->size;
+
+      g_free (entry->filename);
+      g_slice_free (StoreEntry, entry);
+    }
+
+  G_UNLOCK (cache_store);
+
+  g_ptr_array_free (entries, TRUE);
+  g_hash_table_destroy (linked);
+  g_free (store_dir);
+}
+
+/* Has the store checked once the images being made now are done,
+ * rather than after each of them: the command waits at low priority
+ * and the later requests supersede it. */
+static void
+schedule_evict_cached_images (HDBackgrounds *backgrounds)
+{
+  hd_command_thread_pool_push_full (backgrounds->priv->thread_pool,
+                                    G_PRIORITY_LOW,
+                                    "evict-cached-images",
+                                    (HDCommandCallback) evict_cached_images,
+                                    backgrounds,
+                                    NULL);
+}
+
+static void
+set_background_in_gconf (HDBackgrounds *backgrounds,
+                         guint          view,
+                         GFile         *source_file)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gchar *gconf_key, *path;
+  GError *error = NULL;
+
+  path = g_file_get_path (source_file);
+
+  /* Store background to GConf */
+  gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, view + 1);
+  G_LOCK (gconf_client);
+  gconf_client_set_string (priv->gconf_client,
+                           gconf_key,
+                           path,
+                           &error);
+  G_UNLOCK (gconf_client);
+
+  if (error)
+    {
+      g_debug ("%s. Could not set background in GConf for view %u. %s",
+               __FUNCTION__,
+               view,
+               error->message);
+      g_clear_error (&error);
+    }
+
+  g_free (gconf_key);
+  g_free (path);
+}
+
+/* What is left to do once the file of @view shows the image of
+ * @source_file */
+static void
+cached_image_changed (HDBackgrounds *backgrounds,
+                      guint          view,
+                      GFile         *source_file,
+                      const char    *source_etag,
+                      gboolean       update_gconf)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gchar *stale_filename;
+
+  /* Don't leave an image in the other format behind for the desktop */
+  stale_filename = get_cached_image_filename (view,
+                                              !g_strcmp0 (priv->cache_format, "png"));
+  g_unlink (stale_filename);
+  g_free (stale_filename);
+
+  update_cache_info_file (backgrounds,
+                          view,
+                          source_file,
+                          source_etag);
+
+  /* Update GConf if requested */
+  if (update_gconf)
+    set_background_in_gconf (backgrounds,
+                             view,
+                             source_file);
+}
+
+/*
+ * Shows the image of @source_file scaled to @size on @view if it's
+ * still in the store, so it doesn't have to be made again.  @part tells
+ * apart different images made from the same file, it's 0 when the
+ * whole file is used.  Returns FALSE if the image has to be made and
+ * saved with hd_backgrounds_save_cached_image().
+ */
+gboolean
+hd_backgrounds_reuse_cached_image (HDBackgrounds  *backgrounds,
+                                   guint           view,
+                                   guint           part,
+                                   GFile          *source_file,
+                                   HDImageSize    *size,
+                                   gboolean        update_gconf,
+                                   GCancellable   *cancellable)
+{
+  gchar *etag, *store_filename;
+  gboolean reused = FALSE;
+
+  etag = source_info_get_etag (backgrounds, source_file, cancellable);
+  if (!etag)
+    return FALSE;
+
+  store_filename = get_store_filename (backgrounds,
+                                       source_file,
+                                       etag,
+                                       size->width,
+                                       size->height,
+                                       part);
+
+  G_LOCK (cache_store);
+  if (g_file_test (store_filename, G_FILE_TEST_IS_REGULAR) &&
+      link_cached_image (backgrounds, view, store_filename, NULL))
+    {
+      /* Most recently used */
+      utime (store_filename, NULL);
+      reused = TRUE;
+    }
+  G_UNLOCK (cache_store);
+
+  if (reused)
+    cached_image_changed (backgrounds,
+                          view,
+                          source_file,
+                          etag,
+                          update_gconf);
+
+  g_free (store_filename);
+  g_free (etag);
+
+  return reused;
+}
+
 gboolean
 hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                   GdkPixbuf      *pixbuf,
                                   guint           view,
+                                  guint           part,
                                   GFile          *source_file,
                                   const char     *source_etag,
                                   gboolean        error_dialogs,
@@ -1058,25 +2080,36 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                   GError        **error)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
-  char *dest_filename;
-  GFile *dest_file;
+  char *filename, *tmp_filename;
+  GFile *tmp_file;
+  gboolean raw, linked;
+  gchar *option_keys[] = { "compression", NULL };
+  gchar *option_values[] = { priv->png_compression, NULL };
   GError *local_error = NULL;
 
-  /* Create the file objects for the cached background image */
-  if(view >= HD_DESKTOP_VIEWS)
-    dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG_PORTRAIT,
-                                     g_get_home_dir (),
-                                     (view - HD_DESKTOP_VIEWS) + 1);
+  /* Create the file objects for the cached background image.  It's
+   * written next to its place in the store, or the file of the view if
+   * it can't be reused, and moved there when complete, so neither ever
+   * has a partial image. */
+  raw = g_strcmp0 (priv->cache_format, "png") != 0;
+  if (source_etag)
+    filename = get_store_filename (backgrounds,
+                                   source_file,
+                                   source_etag,
+                                   gdk_pixbuf_get_width (pixbuf),
+                                   gdk_pixbuf_get_height (pixbuf),
+                                   part);
   else
-    dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG,
-                                     g_get_home_dir (),
-                                     view + 1);
-  dest_file = g_file_new_for_path (dest_filename);
+    filename = get_cached_image_filename (view, raw);
+  tmp_filename = g_strdup_printf ("%s.%u.tmp", filename, view);
+  tmp_file = g_file_new_for_path (tmp_filename);
 
   /* Create the cached background image */
-  if (!hd_pixbuf_utils_save (dest_file,
+  if (!hd_pixbuf_utils_save (tmp_file,
                              pixbuf,
-                             "png",
+                             priv->cache_format,
+                             raw ? NULL : option_keys,
+                             raw ? NULL : option_values,
                              cancellable,
                              &local_error))
     {
@@ -1095,43 +2128,61 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
       g_propagate_error (error,
                          local_error);
 
+      g_unlink (tmp_filename);
+      g_free (tmp_filename);
+      g_free (filename);
+      g_object_unref (tmp_file);
+
       return FALSE;
     }
 
-  g_free (dest_filename);
-  g_object_unref (dest_file);
+  G_LOCK (cache_store);
+  if (g_rename (tmp_filename, filename))
+    {
+      gint saved_errno = errno;
+
+      g_set_error (&local_error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (saved_errno),
+                   "Could not move %s. %s",
+                   tmp_filename,
+                   g_strerror (saved_errno));
+      linked = FALSE;
+    }
+  else if (source_etag)
+    linked = link_cached_image (backgrounds, view, filename,
+                                &local_error);
+  else
+    linked = TRUE;
+  G_UNLOCK (cache_store);
 
-  update_cache_info_file (backgrounds,
-                          view,
-                          source_file,
-                          source_etag);
+  if (linked && source_etag)
+    schedule_evict_cached_images (backgrounds);
 
-  /* Update GConf if requested */
-  if (update_gconf)
+  if (!linked)
     {
-      gchar *gconf_key, *path;
+      g_warning ("%s. Could not save cached image. %s",
+                 __FUNCTION__,
+                 local_error->message);
 
-      path = g_file_get_path (source_file);
+      g_propagate_error (error,
+                         local_error);
 
-      /* Store background to GConf */
-      gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, view + 1);
-      gconf_client_set_string (priv->gconf_client,
-                               gconf_key,
-                               path,
-                               &local_error);
+      g_unlink (tmp_filename);
+    }
 
-      if (local_error)
-        {
-          g_debug ("%s. Could not set background in GConf for view %u. %s",
-                   __FUNCTION__,
-                   view,
-                   local_error->message);
-          g_clear_error (&local_error);
-        }
+  g_free (tmp_filename);
+  g_free (filename);
+  g_object_unref (tmp_file);
 
-      g_free (gconf_key);
-      g_free (path);
-    }
+  if (!linked)
+    return FALSE;
+
+  cached_image_changed (backgrounds,
+                        view,
+                        source_file,
+                        source_etag,
+                        update_gconf);
 
   return TRUE;
 }
@@ -1219,6 +2270,16 @@ hd_backgrounds_set_current_background (HDBackgrounds *backgrounds,
   g_object_unref (image_file);
 }
 
+/* Writes the cache info not written yet, before hildon-home exits. */
+void
+hd_backgrounds_flush (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  if (priv->info)
+    hd_background_info_flush (priv->info);
+}
+
 gboolean
 hd_backgrounds_is_portrait_wallpaper_enabled (HDBackgrounds *backgrounds)
 {
@@ -26,6 +26,7 @@
 #include <gio/gio.h>
 
 #include "hd-command-thread-pool.h"
+#include "hd-pixbuf-utils.h"
 
 G_BEGIN_DECLS
 
@@ -70,6 +71,14 @@ void           hd_backgrounds_add_create_cached_image (HDBackgrounds      *backg
                                                        HDCommandCallback   command,
                                                        gpointer            data,
                                                        GDestroyNotify      destroy_data);
+void           hd_backgrounds_add_create_cached_image_for_view (HDBackgrounds      *backgrounds,
+                                                                guint               view,
+                                                                GFile              *source_file,
+                                                                gboolean            error_dialogs,
+                                                                GCancellable       *cancellable,
+                                                                HDCommandCallback   command,
+                                                                gpointer            data,
+                                                                GDestroyNotify      destroy_data);
 
 void           hd_backgrounds_add_update_current_files (HDBackgrounds  *backgrounds,
                                                         GFile         **files,
@@ -79,11 +88,20 @@ GFile         *hd_backgrounds_get_background  (HDBackgrounds  *backgrounds,
                                                guint           view);
 void           hd_backgrounds_set_current_background (HDBackgrounds *backgrounds,
                                                       const char    *uri);
+void           hd_backgrounds_flush           (HDBackgrounds  *backgrounds);
 
 /* The following functions can be called from the command callback */
+gboolean       hd_backgrounds_reuse_cached_image (HDBackgrounds  *backgrounds,
+                                                  guint           view,
+                                                  guint           part,
+                                                  GFile          *source_file,
+                                                  HDImageSize    *size,
+                                                  gboolean        update_gconf,
+                                                  GCancellable   *cancellable);
 gboolean       hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                                  GdkPixbuf      *pixbuf,
                                                  guint           view,
+                                                 guint           part,
                                                  GFile          *source_file,
                                                  const char     *source_etag,
                                                  gboolean        error_dialogs,
@@ -94,6 +112,9 @@ void hd_backgrounds_report_corrupt_image        (const GError   *error);
 
 gboolean hd_backgrounds_is_portrait_wallpaper_enabled (HDBackgrounds *backgrounds);
 
+gchar   *hd_backgrounds_get_cached_image_filename (HDBackgrounds *backgrounds,
+                                                   guint          view);
+
 G_END_DECLS
 
 #endif /* __HD_BACKGROUNDS_H__ */
@@ -25,14 +25,42 @@
 #endif
 
 #include "hd-cairo-surface-cache.h"
+#include "hd-pixbuf-utils.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#define HD_SURFACE_CACHE_CONF         HD_DESKTOP_CONFIG_PATH "/home.conf"
+#define HD_SURFACE_CACHE_CONF_GROUP   "SurfaceCache"
+
+/*
+ * The images are also kept decoded on disk, in the ARGB32 raw format
+ * of hd-pixbuf-utils.h, in a file named after the SHA1 of their path.
+ * The header is followed by a SurfaceKey, which tells whether the file
+ * is still up to date, then the pixels.  The files are mapped and used
+ * as they are, so the processes showing the same image share it
+ * through the page cache and no PNG is decoded more than once.
+ */
+typedef struct
+{
+  gint64 mtime;
+  gint64 size;
+} SurfaceKey;
 
 struct _HDCairoSurfaceCachePrivate
 {
   GHashTable *table;
+
+  /* Where the decoded images are stored, NULL if they aren't */
+  gchar *directory;
 };
 
+static const cairo_user_data_key_t mapped_file_key;
+
 G_DEFINE_TYPE_WITH_CODE (HDCairoSurfaceCache, hd_cairo_surface_cache, G_TYPE_OBJECT, G_ADD_PRIVATE(HDCairoSurfaceCache));
 
 static void
@@ -43,6 +71,8 @@ hd_cairo_surface_cache_dispose (GObject *object)
   if (priv->table)
     priv->table = (g_hash_table_destroy (priv->table), NULL);
 
+  priv->directory = (g_free (priv->directory), NULL);
+
   G_OBJECT_CLASS (hd_cairo_surface_cache_parent_class)->dispose (object);
 }
 
@@ -59,12 +89,40 @@ static void
 hd_cairo_surface_cache_init (HDCairoSurfaceCache *cache)
 {
   HDCairoSurfaceCachePrivate *priv = (HDCairoSurfaceCachePrivate*)hd_cairo_surface_cache_get_instance_private(cache);
+  GKeyFile *conf;
+  GError *error = NULL;
+  gboolean enabled;
 
   cache->priv = priv;
 
   priv->table = g_hash_table_new_full (g_str_hash, g_str_equal,
                                        g_free,
                                        (GDestroyNotify) cairo_surface_destroy);
+
+  conf = g_key_file_new ();
+  g_key_file_load_from_file (conf, HD_SURFACE_CACHE_CONF, G_KEY_FILE_NONE, NULL);
+  enabled = g_key_file_get_boolean (conf, HD_SURFACE_CACHE_CONF_GROUP,
+                                    "enabled", &error);
+  if (error)
+    {
+      enabled = TRUE;
+      g_error_free (error);
+    }
+  g_key_file_free (conf);
+
+  if (enabled)
+    {
+      priv->directory = g_build_filename (g_get_user_cache_dir (),
+                                          "hildon-home",
+                                          "surfaces",
+                                          NULL);
+      if (g_mkdir_with_parents (priv->directory, 0700))
+        {
+          g_debug ("%s. Could not create %s. %s",
+                   __FUNCTION__, priv->directory, g_strerror (errno));
+          priv->directory = (g_free (priv->directory), NULL);
+        }
+    }
 }
 
 HDCairoSurfaceCache *
@@ -79,6 +137,177 @@ hd_cairo_surface_cache_get (void)
   return cache;
 }
 
+static gchar *
+get_cached_filename (HDCairoSurfaceCache *cache,
+                     const gchar         *filename)
+{
+  gchar *checksum, *basename, *path;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, filename, -1);
+  basename = g_strconcat (checksum, ".argb32", NULL);
+  path = g_build_filename (cache->priv->directory, basename, NULL);
+
+  g_free (checksum);
+  g_free (basename);
+
+  return path;
+}
+
+/* Maps @cached_filename if it holds the image described by @key.  The
+ * surface uses the mapped pixels, so it must not be drawn on. */
+static cairo_surface_t *
+load_cached_surface (const gchar      *cached_filename,
+                     const SurfaceKey *key)
+{
+  const HDPixbufUtilsRawHeader *header;
+  cairo_surface_t *surface;
+  GMappedFile *mapped;
+  const gchar *contents;
+  gsize length;
+  SurfaceKey cached_key;
+
+  mapped = g_mapped_file_new (cached_filename, FALSE, NULL);
+  if (!mapped)
+    return NULL;
+
+  contents = g_mapped_file_get_contents (mapped);
+  length = g_mapped_file_get_length (mapped);
+  header = (const HDPixbufUtilsRawHeader *) contents;
+
+  if (length < sizeof (*header) + sizeof (cached_key) ||
+      header->magic != HD_PIXBUF_UTILS_RAW_MAGIC ||
+      header->version != HD_PIXBUF_UTILS_RAW_VERSION ||
+      header->format != HD_PIXBUF_UTILS_RAW_ARGB32 ||
+      header->width == 0 || header->height == 0 ||
+      header->width > G_MAXINT / 4 || header->height > G_MAXINT ||
+      header->stride != (guint32) cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32,
+                                                                 header->width) ||
+      header->offset != sizeof (*header) + sizeof (cached_key) ||
+      (length - header->offset) / header->stride < header->height)
+    goto invalid;
+
+  memcpy (&cached_key, contents + sizeof (*header), sizeof (cached_key));
+  if (cached_key.mtime != key->mtime || cached_key.size != key->size)
+    goto invalid;
+
+  surface = cairo_image_surface_create_for_data ((guchar *) contents + header->offset,
+                                                 CAIRO_FORMAT_ARGB32,
+                                                 header->width,
+                                                 header->height,
+                                                 header->stride);
+  if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS ||
+      cairo_surface_set_user_data (surface,
+                                   &mapped_file_key,
+                                   mapped,
+                                   (cairo_destroy_func_t) g_mapped_file_unref))
+    {
+      cairo_surface_destroy (surface);
+      goto invalid;
+    }
+
+  return surface;
+
+invalid:
+  g_mapped_file_unref (mapped);
+
+  return NULL;
+}
+
+/* Stores @surface, an image surface decoded from the file described by
+ * @key, in @cached_filename.  The file is replaced atomically, so the
+ * other processes mapping the old one are not disturbed. */
+static void
+save_cached_surface (const gchar      *cached_filename,
+                     const SurfaceKey *key,
+                     cairo_surface_t  *surface)
+{
+  HDPixbufUtilsRawHeader header;
+  cairo_format_t format;
+  const guchar *pixels;
+  gchar *contents;
+  gint width, height, stride, y;
+  gsize length;
+  GError *error = NULL;
+
+  format = cairo_image_surface_get_format (surface);
+  if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+    return;
+
+  cairo_surface_flush (surface);
+
+  width = cairo_image_surface_get_width (surface);
+  height = cairo_image_surface_get_height (surface);
+  stride = cairo_image_surface_get_stride (surface);
+  pixels = cairo_image_surface_get_data (surface);
+
+  memset (&header, 0, sizeof (header));
+  header.magic = HD_PIXBUF_UTILS_RAW_MAGIC;
+  header.version = HD_PIXBUF_UTILS_RAW_VERSION;
+  header.format = HD_PIXBUF_UTILS_RAW_ARGB32;
+  header.width = width;
+  header.height = height;
+  header.stride = cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32, width);
+  header.offset = sizeof (header) + sizeof (*key);
+
+  length = header.offset + (gsize) header.stride * height;
+  contents = g_malloc (length);
+  memcpy (contents, &header, sizeof (header));
+  memcpy (contents + sizeof (header), key, sizeof (*key));
+
+  for (y = 0; y < height; y++)
+    {
+      guint32 *row = (guint32 *) (contents + header.offset + y * header.stride);
+
+      memcpy (row, pixels + y * stride, width * 4);
+
+      /* The unused byte of RGB24 is undefined */
+      if (format == CAIRO_FORMAT_RGB24)
+        {
+          gint x;
+
+          for (x = 0; x < width; x++)
+            row[x] |= 0xff000000;
+        }
+    }
+
+  if (!g_file_set_contents (cached_filename, contents, length, &error))
+    {
+      g_debug ("%s. Could not write %s. %s",
+               __FUNCTION__, cached_filename, error->message);
+      g_error_free (error);
+    }
+
+  g_free (contents);
+}
+
+/* Copies @image_surface into a surface of its own. */
+static cairo_surface_t *
+copy_surface (cairo_surface_t *image_surface)
+{
+  cairo_surface_t *surface;
+  cairo_t *cr;
+
+  surface = cairo_surface_create_similar (image_surface,
+                                          cairo_surface_get_content (image_surface),
+                                          cairo_image_surface_get_width (image_surface),
+                                          cairo_image_surface_get_height (image_surface));
+  cr = cairo_create (surface);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface (cr,
+                            image_surface,
+                            0,
+                            0);
+
+  cairo_paint (cr);
+  cairo_destroy (cr);
+
+  return surface;
+}
+
+/*
+ * Returns a new reference to the surface showing the PNG image
+ * @filename.  The surfaces are shared and must not be drawn on.
+ */
 cairo_surface_t *
 hd_cairo_surface_cache_get_surface (HDCairoSurfaceCache *cache,
                                     const gchar         *filename)
@@ -92,23 +321,37 @@ hd_cairo_surface_cache_get_surface (HDCairoSurfaceCache *cache,
   if (!surface)
     {
       cairo_surface_t *image_surface;
-      cairo_t *cr;
-
-      image_surface = cairo_image_surface_create_from_png (filename);
-      surface = cairo_surface_create_similar (image_surface,
-                                              cairo_surface_get_content (image_surface),
-                                              cairo_image_surface_get_width (image_surface),
-                                              cairo_image_surface_get_height (image_surface));
-      cr = cairo_create (surface);
-      cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-      cairo_set_source_surface (cr,
-                                image_surface,
-                                0,
-                                0);
-
-      cairo_paint (cr);
-      cairo_destroy (cr);
-      cairo_surface_destroy (image_surface);
+      gchar *cached_filename = NULL;
+      SurfaceKey key = { 0, 0 };
+      struct stat st;
+
+      if (priv->directory && !g_stat (filename, &st))
+        {
+          key.mtime = st.st_mtime;
+          key.size = st.st_size;
+
+          cached_filename = get_cached_filename (cache, filename);
+          surface = load_cached_surface (cached_filename, &key);
+        }
+
+      if (!surface)
+        {
+          image_surface = cairo_image_surface_create_from_png (filename);
+
+          if (cached_filename &&
+              cairo_surface_status (image_surface) == CAIRO_STATUS_SUCCESS)
+            {
+              save_cached_surface (cached_filename, &key, image_surface);
+              surface = load_cached_surface (cached_filename, &key);
+            }
+
+          if (!surface)
+            surface = copy_surface (image_surface);
+
+          cairo_surface_destroy (image_surface);
+        }
+
+      g_free (cached_filename);
 
       g_hash_table_insert (priv->table,
                            g_strdup (filename),
@@ -27,19 +27,29 @@
 
 #include "hd-command-thread-pool.h"
 
+/* @id, @priority and @key are only used for the commands pushed with
+ * hd_command_thread_pool_push_full().  @cancelled is set when the
+ * command shouldn't be executed anymore, it's still destroyed in turn. */
 typedef struct
 {
   HDCommandCallback command;
   gpointer data;
   GDestroyNotify destroy_data;
+  guint id;
+  gint priority;
+  gchar *key;
+  gboolean cancelled;
 } ThreadCommand;
 
-static void           thread_command_execute (ThreadCommand *thread_command,
-                                              gpointer       data);
+static void           thread_command_execute (ThreadCommand       *thread_command,
+                                              HDCommandThreadPool *pool);
 static ThreadCommand *thread_command_new     (HDCommandCallback command,
                                               gpointer          data,
                                               GDestroyNotify    destroy_data);
 static void           thread_command_free    (ThreadCommand *thread_command);
+static gint           thread_command_compare (ThreadCommand *a,
+                                              ThreadCommand *b,
+                                              gpointer       data);
 
 typedef struct
 {
@@ -56,9 +66,36 @@ static IdleCommandData *idle_command_data_new  (gint           priority,
 static void             idle_command_execute   (IdleCommandData *command_data);
 static void             idle_command_data_free (IdleCommandData *command_data);
 
+/* Commands which may run in parallel, see hd_command_batch_new(). */
+struct _HDCommandBatch
+{
+  GPtrArray *commands;
+};
+
+static void batch_command_execute (HDCommandBatch *batch);
+static void batch_command_free    (HDCommandBatch *batch);
+
+/*
+ * The commands waiting to be executed are sorted by priority, then in
+ * the order they were pushed.  @queued maps their IDs to them and
+ * @keyed the keys to the latest command pushed with each; both are
+ * protected by @mutex.
+ */
 struct _HDCommandThreadPoolPrivate
 {
   GThreadPool *thread_pool;
+  guint max_threads;
+
+  GMutex mutex;
+  guint last_id;
+  GHashTable *queued;
+  GHashTable *keyed;
+};
+
+enum
+{
+  PROP_0,
+  PROP_MAX_THREADS
 };
 
 G_DEFINE_TYPE_WITH_CODE (HDCommandThreadPool, hd_command_thread_pool, G_TYPE_OBJECT, G_ADD_PRIVATE(HDCommandThreadPool));
@@ -79,13 +116,76 @@ hd_command_thread_pool_dipose (GObject *object)
   G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->dispose (object);
 }
 
+static void
+hd_command_thread_pool_finalize (GObject *object)
+{
+  HDCommandThreadPoolPrivate *priv = HD_COMMAND_THREAD_POOL (object)->priv;
+
+  g_hash_table_destroy (priv->queued);
+  g_hash_table_destroy (priv->keyed);
+  g_mutex_clear (&priv->mutex);
+
+  G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->finalize (object);
+}
+
+static void
+hd_command_thread_pool_constructed (GObject *object)
+{
+  HDCommandThreadPool *pool = HD_COMMAND_THREAD_POOL (object);
+  HDCommandThreadPoolPrivate *priv = pool->priv;
+
+  priv->thread_pool = g_thread_pool_new ((GFunc) thread_command_execute,
+                                         pool,
+                                         priv->max_threads,
+                                         FALSE,
+                                         NULL);
+  g_thread_pool_set_sort_function (priv->thread_pool,
+                                   (GCompareDataFunc) thread_command_compare,
+                                   NULL);
+
+  if (G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->constructed)
+    G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->constructed (object);
+}
+
+static void
+hd_command_thread_pool_set_property (GObject      *object,
+                                     guint         prop_id,
+                                     const GValue *value,
+                                     GParamSpec   *pspec)
+{
+  HDCommandThreadPoolPrivate *priv = HD_COMMAND_THREAD_POOL (object)->priv;
+
+  switch (prop_id)
+    {
+    case PROP_MAX_THREADS:
+      priv->max_threads = g_value_get_uint (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
 static void
 hd_command_thread_pool_class_init (HDCommandThreadPoolClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->dispose = hd_command_thread_pool_dipose;
-
+  object_class->finalize = hd_command_thread_pool_finalize;
+  object_class->constructed = hd_command_thread_pool_constructed;
+  object_class->set_property = hd_command_thread_pool_set_property;
+
+  g_object_class_install_property (object_class,
+                                   PROP_MAX_THREADS,
+                                   g_param_spec_uint ("max-threads",
+                                                      "Max threads",
+                                                      "Number of commands executed at once",
+                                                      1,
+                                                      G_MAXUINT,
+                                                      1,
+                                                      G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
 }
 
 static void
@@ -96,27 +196,57 @@ hd_command_thread_pool_init (HDCommandThreadPool *command_thread_pool)
   priv = hd_command_thread_pool_get_instance_private(command_thread_pool);
   command_thread_pool->priv = priv;
 
-  priv->thread_pool = g_thread_pool_new ((GFunc) thread_command_execute,
-                                         NULL,
-                                         1,
-                                         FALSE,
-                                         NULL);
+  priv->max_threads = 1;
+  g_mutex_init (&priv->mutex);
+  priv->queued = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->keyed = g_hash_table_new (g_str_hash, g_str_equal);
 }
 
+/* @pool is NULL for the commands of a batch */
 static void
-thread_command_execute (ThreadCommand *thread_command,
-                        gpointer       data)
+thread_command_execute (ThreadCommand       *thread_command,
+                        HDCommandThreadPool *pool)
 {
-  thread_command->command (thread_command->data);
+  gboolean cancelled = FALSE;
+
+  if (pool)
+    {
+      HDCommandThreadPoolPrivate *priv = pool->priv;
+
+      g_mutex_lock (&priv->mutex);
+      g_hash_table_remove (priv->queued,
+                           GUINT_TO_POINTER (thread_command->id));
+      if (thread_command->key &&
+          g_hash_table_lookup (priv->keyed,
+                               thread_command->key) == thread_command)
+        g_hash_table_remove (priv->keyed,
+                             thread_command->key);
+      cancelled = thread_command->cancelled;
+      g_mutex_unlock (&priv->mutex);
+    }
+
+  if (!cancelled)
+    thread_command->command (thread_command->data);
   thread_command_free (thread_command);
 }
 
+static gint
+thread_command_compare (ThreadCommand *a,
+                        ThreadCommand *b,
+                        gpointer       data)
+{
+  if (a->priority != b->priority)
+    return a->priority < b->priority ? -1 : 1;
+
+  return a->id < b->id ? -1 : a->id > b->id;
+}
+
 static ThreadCommand *
 thread_command_new (HDCommandCallback command,
                     gpointer          data,
                     GDestroyNotify    destroy_data)
 {
-  ThreadCommand *thread_command = g_slice_new (ThreadCommand);
+  ThreadCommand *thread_command = g_slice_new0 (ThreadCommand);
 
   thread_command->command = command;
   thread_command->data = data;
@@ -134,6 +264,7 @@ thread_command_free (ThreadCommand *thread_command)
   if (thread_command->destroy_data)
     thread_command->destroy_data (thread_command->data);
 
+  g_free (thread_command->key);
   g_slice_free (ThreadCommand, thread_command);
 }
 
@@ -143,22 +274,90 @@ hd_command_thread_pool_new (void)
   return g_object_new (HD_TYPE_COMMAND_THREAD_POOL, NULL);
 }
 
+/* Creates a pool executing up to @max_threads commands at once.  The
+ * commands are then not necessarily done in the order they were
+ * started. */
+HDCommandThreadPool *
+hd_command_thread_pool_new_full (guint max_threads)
+{
+  return g_object_new (HD_TYPE_COMMAND_THREAD_POOL,
+                       "max-threads", MAX (max_threads, 1),
+                       NULL);
+}
+
 void
 hd_command_thread_pool_push (HDCommandThreadPool *pool,
                              HDCommandCallback    command,
                              gpointer             data,
                              GDestroyNotify       destroy_data)
+{
+  hd_command_thread_pool_push_full (pool,
+                                    G_PRIORITY_DEFAULT,
+                                    NULL,
+                                    command,
+                                    data,
+                                    destroy_data);
+}
+
+/*
+ * Pushes @command with @priority: it's executed before the commands
+ * waiting with a lower priority (a higher number, like for main loop
+ * sources).  If @key is not NULL, a command with the same key waiting
+ * to be executed is cancelled, as this one supersedes it.
+ *
+ * Returns the ID of the command for hd_command_thread_pool_cancel().
+ */
+guint
+hd_command_thread_pool_push_full (HDCommandThreadPool *pool,
+                                  gint                 priority,
+                                  const gchar         *key,
+                                  HDCommandCallback    command,
+                                  gpointer             data,
+                                  GDestroyNotify       destroy_data)
 {
   HDCommandThreadPoolPrivate *priv;
+  ThreadCommand *thread_command, *superseded;
   GError *error = NULL;
+  guint id;
 
-  g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
+  g_return_val_if_fail (HD_IS_COMMAND_THREAD_POOL (pool), 0);
 
   priv = pool->priv;
 
-  ThreadCommand *thread_command = thread_command_new (command,
-                                                      data,
-                                                      destroy_data);
+  thread_command = thread_command_new (command,
+                                       data,
+                                       destroy_data);
+  thread_command->priority = priority;
+  thread_command->key = g_strdup (key);
+
+  g_mutex_lock (&priv->mutex);
+
+  if (!++priv->last_id)
+    ++priv->last_id;
+  id = thread_command->id = priv->last_id;
+  g_hash_table_insert (priv->queued,
+                       GUINT_TO_POINTER (id),
+                       thread_command);
+
+  if (key)
+    {
+      superseded = g_hash_table_lookup (priv->keyed,
+                                        key);
+      if (superseded)
+        {
+          superseded->cancelled = TRUE;
+          g_hash_table_remove (priv->queued,
+                               GUINT_TO_POINTER (superseded->id));
+        }
+
+      /* The key of @superseded goes away with it. */
+      g_hash_table_replace (priv->keyed,
+                            thread_command->key,
+                            thread_command);
+    }
+
+  g_mutex_unlock (&priv->mutex);
+
   g_thread_pool_push (priv->thread_pool,
                       thread_command,
                       &error);
@@ -168,6 +367,44 @@ hd_command_thread_pool_push (HDCommandThreadPool *pool,
       g_debug ("%s. Error: %s", __FUNCTION__, error->message);
       g_error_free (error);
     }
+
+  return id;
+}
+
+/*
+ * Cancels the command @id unless it has been started already.  Its
+ * data is destroyed anyway.  Returns whether it was cancelled.
+ */
+gboolean
+hd_command_thread_pool_cancel (HDCommandThreadPool *pool,
+                               guint                id)
+{
+  HDCommandThreadPoolPrivate *priv;
+  ThreadCommand *thread_command;
+
+  g_return_val_if_fail (HD_IS_COMMAND_THREAD_POOL (pool), FALSE);
+
+  priv = pool->priv;
+
+  g_mutex_lock (&priv->mutex);
+
+  thread_command = g_hash_table_lookup (priv->queued,
+                                        GUINT_TO_POINTER (id));
+  if (thread_command)
+    {
+      thread_command->cancelled = TRUE;
+      g_hash_table_remove (priv->queued,
+                           GUINT_TO_POINTER (id));
+      if (thread_command->key &&
+          g_hash_table_lookup (priv->keyed,
+                               thread_command->key) == thread_command)
+        g_hash_table_remove (priv->keyed,
+                             thread_command->key);
+    }
+
+  g_mutex_unlock (&priv->mutex);
+
+  return thread_command != NULL;
 }
 
 void
@@ -176,6 +413,27 @@ hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                   GSourceFunc          function,
                                   gpointer             data,
                                   GDestroyNotify       destroy_data)
+{
+  hd_command_thread_pool_push_idle_full (pool,
+                                         G_PRIORITY_DEFAULT,
+                                         priority,
+                                         function,
+                                         data,
+                                         destroy_data);
+}
+
+/*
+ * Like hd_command_thread_pool_push_idle(), with the idle added once the
+ * commands pushed before with at most @command_priority are done, see
+ * hd_command_thread_pool_push_full().
+ */
+void
+hd_command_thread_pool_push_idle_full (HDCommandThreadPool *pool,
+                                       gint                 command_priority,
+                                       gint                 priority,
+                                       GSourceFunc          function,
+                                       gpointer             data,
+                                       GDestroyNotify       destroy_data)
 {
   IdleCommandData *command_data;
 
@@ -186,10 +444,12 @@ hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                         data,
                                         destroy_data);
 
-  hd_command_thread_pool_push (pool,
-                               (HDCommandCallback) idle_command_execute,
-                               command_data,
-                               (GDestroyNotify) idle_command_data_free);
+  hd_command_thread_pool_push_full (pool,
+                                    command_priority,
+                                    NULL,
+                                    (HDCommandCallback) idle_command_execute,
+                                    command_data,
+                                    (GDestroyNotify) idle_command_data_free);
 }
 
 static IdleCommandData *
@@ -226,3 +486,97 @@ idle_command_data_free (IdleCommandData *command_data)
   g_slice_free (IdleCommandData, command_data);
 }
 
+/* Creates an empty batch for hd_command_thread_pool_push_batch() */
+HDCommandBatch *
+hd_command_batch_new (void)
+{
+  HDCommandBatch *batch = g_slice_new (HDCommandBatch);
+
+  batch->commands = g_ptr_array_new ();
+
+  return batch;
+}
+
+/* The commands of a batch are started in the order they were added */
+void
+hd_command_batch_add (HDCommandBatch    *batch,
+                      HDCommandCallback  command,
+                      gpointer           data,
+                      GDestroyNotify     destroy_data)
+{
+  g_return_if_fail (batch != NULL);
+
+  g_ptr_array_add (batch->commands,
+                   thread_command_new (command,
+                                       data,
+                                       destroy_data));
+}
+
+/*
+ * Executes the commands of @batch in parallel on as many threads as
+ * there are processors, as a single command of @pool: they are executed
+ * after the commands pushed to @pool before and all of them are done
+ * before the commands pushed after are executed.  Takes over @batch.
+ */
+void
+hd_command_thread_pool_push_batch (HDCommandThreadPool *pool,
+                                   HDCommandBatch      *batch)
+{
+  g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
+  g_return_if_fail (batch != NULL);
+
+  hd_command_thread_pool_push (pool,
+                               (HDCommandCallback) batch_command_execute,
+                               batch,
+                               (GDestroyNotify) batch_command_free);
+}
+
+static void
+batch_command_execute (HDCommandBatch *batch)
+{
+  GThreadPool *workers;
+  guint i, n_workers;
+
+  n_workers = MIN (batch->commands->len, g_get_num_processors ());
+  if (n_workers <= 1)
+    {
+      for (i = 0; i < batch->commands->len; i++)
+        thread_command_execute (g_ptr_array_index (batch->commands, i),
+                                NULL);
+      g_ptr_array_set_size (batch->commands, 0);
+      return;
+    }
+
+  workers = g_thread_pool_new ((GFunc) thread_command_execute,
+                               NULL,
+                               n_workers,
+                               FALSE,
+                               NULL);
+
+  for (i = 0; i < batch->commands->len; i++)
+    g_thread_pool_push (workers,
+                        g_ptr_array_index (batch->commands, i),
+                        NULL);
+  g_ptr_array_set_size (batch->commands, 0);
+
+  /* Wait for all of them. */
+  g_thread_pool_free (workers,
+                      FALSE,
+                      TRUE);
+}
+
+static void
+batch_command_free (HDCommandBatch *batch)
+{
+  guint i;
+
+  if (!batch)
+    return;
+
+  /* Not executed if the pool went away before. */
+  for (i = 0; i < batch->commands->len; i++)
+    thread_command_free (g_ptr_array_index (batch->commands, i));
+
+  g_ptr_array_free (batch->commands, TRUE);
+  g_slice_free (HDCommandBatch, batch);
+}
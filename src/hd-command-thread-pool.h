@@ -37,6 +37,7 @@ G_BEGIN_DECLS
 typedef struct _HDCommandThreadPool        HDCommandThreadPool;
 typedef struct _HDCommandThreadPoolClass   HDCommandThreadPoolClass;
 typedef struct _HDCommandThreadPoolPrivate HDCommandThreadPoolPrivate;
+typedef struct _HDCommandBatch             HDCommandBatch;
 
 struct _HDCommandThreadPool 
 {
@@ -55,16 +56,39 @@ typedef void (*HDCommandCallback) (gpointer data);
 GType                hd_command_thread_pool_get_type  (void);
 
 HDCommandThreadPool *hd_command_thread_pool_new       (void);
+HDCommandThreadPool *hd_command_thread_pool_new_full  (guint                max_threads);
 
 void                 hd_command_thread_pool_push      (HDCommandThreadPool *pool,
                                                        HDCommandCallback    command,
                                                        gpointer             data,
                                                        GDestroyNotify       destroy_data);
+guint                hd_command_thread_pool_push_full (HDCommandThreadPool *pool,
+                                                       gint                 priority,
+                                                       const gchar         *key,
+                                                       HDCommandCallback    command,
+                                                       gpointer             data,
+                                                       GDestroyNotify       destroy_data);
+gboolean             hd_command_thread_pool_cancel    (HDCommandThreadPool *pool,
+                                                       guint                id);
 void                 hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                                        gint                 priority,
                                                        GSourceFunc          function,
                                                        gpointer             data,
                                                        GDestroyNotify       destroy_data);
+void                 hd_command_thread_pool_push_idle_full (HDCommandThreadPool *pool,
+                                                            gint                 command_priority,
+                                                            gint                 priority,
+                                                            GSourceFunc          function,
+                                                            gpointer             data,
+                                                            GDestroyNotify       destroy_data);
+void                 hd_command_thread_pool_push_batch (HDCommandThreadPool *pool,
+                                                        HDCommandBatch      *batch);
+
+HDCommandBatch      *hd_command_batch_new             (void);
+void                 hd_command_batch_add             (HDCommandBatch    *batch,
+                                                       HDCommandCallback  command,
+                                                       gpointer           data,
+                                                       GDestroyNotify     destroy_data);
 
 G_END_DECLS
 
@@ -130,13 +130,14 @@ hd_file_background_set_for_view_full (HDFileBackground *background,
                            error_dialogs,
                            update_gconf);
 
-  hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
-                                          priv->image_file,
-                                          data->error_dialogs,
-                                          cancellable,
-                                          (HDCommandCallback) create_cached_image_command,
-                                          data,
-                                          (GDestroyNotify) command_data_free);
+  hd_backgrounds_add_create_cached_image_for_view (hd_backgrounds_get (),
+                                                   current_view,
+                                                   priv->image_file,
+                                                   data->error_dialogs,
+                                                   cancellable,
+                                                   (HDCommandCallback) create_cached_image_command,
+                                                   data,
+                                                   (GDestroyNotify) command_data_free);
 }
 
 static GFile *
@@ -159,6 +160,15 @@ create_cached_image_command (CommandData *data)
   if (g_cancellable_is_cancelled (data->cancellable))
     goto cleanup;
 
+  if (hd_backgrounds_reuse_cached_image (hd_backgrounds_get (),
+                                         data->view,
+                                         0,
+                                         data->file,
+                                         &screen_size,
+                                         data->update_gconf,
+                                         data->cancellable))
+    goto cleanup;
+
   pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (data->file,
                                                     &screen_size,
                                                     &etag,
@@ -190,6 +200,7 @@ create_cached_image_command (CommandData *data)
   hd_backgrounds_save_cached_image (hd_backgrounds_get (),
                                     pixbuf,
                                     data->view,
+                                    0,
                                     data->file,
                                     etag,
                                     data->error_dialogs,
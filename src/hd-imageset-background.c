@@ -141,13 +141,14 @@ hd_imageset_background_set_for_current_view (HDBackground   *background,
                                view,
                                cancellable);
 
-      hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
-                                              image_file,
-                                              error_dialogs,
-                                              cancellable,
-                                              (HDCommandCallback) create_cached_image_command,
-                                              data,
-                                              (GDestroyNotify) command_data_free);
+      hd_backgrounds_add_create_cached_image_for_view (hd_backgrounds_get (),
+                                                       view,
+                                                       image_file,
+                                                       error_dialogs,
+                                                       cancellable,
+                                                       (HDCommandCallback) create_cached_image_command,
+                                                       data,
+                                                       (GDestroyNotify) command_data_free);
     }
 }
 
@@ -164,6 +165,15 @@ create_cached_image_command (CommandData *data)
   if (g_cancellable_is_cancelled (data->cancellable))
     goto cleanup;
 
+  if (hd_backgrounds_reuse_cached_image (hd_backgrounds_get (),
+                                         data->view,
+                                         0,
+                                         data->file,
+                                         &screen_size,
+                                         update_gconf,
+                                         data->cancellable))
+    goto cleanup;
+
   pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (data->file,
                                                     &screen_size,
                                                     &etag,
@@ -195,6 +205,7 @@ create_cached_image_command (CommandData *data)
   hd_backgrounds_save_cached_image (hd_backgrounds_get (),
                                     pixbuf,
                                     data->view,
+                                    0,
                                     data->file,
                                     etag,
                                     error_dialogs,
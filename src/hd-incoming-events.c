@@ -67,6 +67,13 @@
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_NAME  "com.nokia.HildonSVNotificationDaemon" 
 #define HD_SV_NOTIFICATION_DAEMON_DBUS_PATH  "/com/nokia/HildonSVNotificationDaemon"
 
+/* [SoundVibra] of notification.conf and its defaults. */
+#define HD_SV_CONF                    HD_DESKTOP_CONFIG_PATH "/notification.conf"
+#define HD_SV_CONF_GROUP              "SoundVibra"
+#define HD_SV_DEFAULT_WINDOW          1000
+#define HD_SV_DEFAULT_MAX_IN_FLIGHT   2
+#define HD_SV_DEFAULT_MAX_QUEUED      8
+
 typedef struct _Notifications Notifications;
 
 
@@ -95,14 +102,17 @@ typedef struct
   gchar *secondary_text;
   gchar *secondary_text_empty;
   gchar *icon;
-  gchar **dbus_callbacks;
+  /* The D-Bus-Call:s and the Account-Call, compiled.  @call_default
+   * is whether the "default" pseudo-call was among the former. */
+  GPtrArray *dbus_calls;
   gchar *text_domain;
   gchar *account_hint;
-  gchar *account_call;
+  HDNotificationCall *account_call;
   gchar *pattern;
   gchar *group;
   gchar *split_in_threads;
   gboolean no_window : 1;
+  gboolean call_default : 1;
 } CategoryInfo;
 
 typedef void (*NotificationsCallback) (Notifications *ns,
@@ -111,6 +121,12 @@ typedef void (*NotificationsCallback) (Notifications *ns,
 /*
  * Used to group notifications with the same (mapped) category
  * toegther for preview and switcher windows.
+ *
+ * The aggregates the windows show are kept up to date as notifications
+ * come and go, so they needn't walk @notifications: @info is the
+ * CategoryInfo of the latest notification, @amount the sum of the
+ * amount hints, and @accounts counts the notifications by the value of
+ * their @account_hint, @no_account being those without one.
  */
 struct _Notifications
 {
@@ -122,13 +138,24 @@ struct _Notifications
   gpointer               cb_data;
 
   GtkWidget             *window;
+
+  CategoryInfo          *info;
+  guint                  amount;
+  const gchar           *account_hint;
+  GHashTable            *accounts;
+  guint                  no_account;
+
+  GList                 *preview_link; /* in preview_queue */
 };
 
 struct _HDIncomingEventsPrivate
 {
   GHashTable      *categories;
 
-  GList           *preview_list;
+  /* Notifications waiting for the preview window, the grouped ones
+   * are indexed by group in @preview_index. */
+  GQueue          *preview_queue;
+  GHashTable      *preview_index;
   GtkWidget       *preview_window;
 
   GHashTable      *switcher_groups;
@@ -145,6 +172,35 @@ struct _HDIncomingEventsPrivate
   gboolean         task_switcher_shown : 1;
 
   HDMultiMap      *unperceived_notifications;
+
+  /*
+   * PlayEvent dispatch queue.  @sv_queue holds the notifications
+   * waiting to be played, at most one per category, which is indexed
+   * in @sv_pending.  An event of a category is played at most once
+   * every @sv_window milliseconds, later ones replace the waiting one,
+   * and the sound of the previous one is stopped when the next is
+   * played.  At most @sv_max_in_flight PlayEvent calls are waiting
+   * for a reply and at most @sv_max_queued events are queued, the
+   * oldest is dropped beyond that.  @sv_categories maps a category
+   * to its #SvCategory.  @sv_timeout is the #GSource ID of the
+   * dispatcher waiting for a window to close.
+   */
+  GQueue          *sv_queue;
+  GHashTable      *sv_pending;
+  GHashTable      *sv_categories;
+  guint            sv_in_flight;
+  guint            sv_timeout;
+  guint            sv_window;
+  guint            sv_max_in_flight;
+  guint            sv_max_queued;
+  HDIncomingEventsSvStats sv_stats;
+
+  /* Replayed notifications are collected here between the
+   * "replay-begin" and "replay-end" signals of the notification
+   * manager, grouped by category in @replay_groups (in the order
+   * they were first seen) and indexed by group in @replay_index. */
+  GPtrArray       *replay_groups;
+  GHashTable      *replay_index;
 };
 
 enum
@@ -180,15 +236,132 @@ notification_get_group (HDNotification *n)
   return category;
 }
 
+static CategoryInfo *
+notification_get_category_info (HDNotification *n)
+{
+  HDIncomingEvents *ie = hd_incoming_events_get ();
+  const gchar *category;
+
+  category = hd_notification_get_category (n);
+  if (!category)
+    return NULL;
+
+  return g_hash_table_lookup (ie->priv->categories, category);
+}
+
+/* Returns the number of events @n stands for according to its
+ * amount hint */
+static guint
+notification_get_amount (HDNotification *n)
+{
+  GValue *v;
+
+  v = hd_notification_get_hint (n, "amount");
+  if (v && G_VALUE_HOLDS_UINT (v))
+    return MAX (g_value_get_uint (v), 1);
+  else if (v && G_VALUE_HOLDS_INT (v))
+    return MAX (g_value_get_int (v), 1);
+  else
+    return 1;
+}
+
+/* Counts @n in (@delta > 0) or out of the accounts of @ns */
+static void
+notifications_count_account (Notifications  *ns,
+                             HDNotification *n,
+                             gint            delta)
+{
+  GValue *value;
+  const gchar *account;
+  guint count;
+
+  value = hd_notification_get_hint (n, ns->account_hint);
+  if (!value || !G_VALUE_HOLDS_STRING (value))
+    {
+      ns->no_account += delta;
+      return;
+    }
+
+  account = g_value_get_string (value);
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (ns->accounts, account));
+  count += delta;
+  if (count)
+    g_hash_table_insert (ns->accounts, g_strdup (account),
+                         GUINT_TO_POINTER (count));
+  else
+    g_hash_table_remove (ns->accounts, account);
+}
+
+/* Recomputes the aggregates of @ns from scratch.  Only needed when many
+ * notifications went at once.  Updates needn't, the notification
+ * manager only changes the icon, summary and body of a notification,
+ * never its hints or category. */
+static void
+notifications_reindex (Notifications *ns)
+{
+  guint i;
+
+  ns->info = NULL;
+  ns->amount = 0;
+  ns->account_hint = NULL;
+  ns->no_account = 0;
+  if (ns->accounts)
+    g_hash_table_remove_all (ns->accounts);
+
+  for (i = 0; i < ns->notifications->len; i++)
+    ns->amount += notification_get_amount (g_ptr_array_index (ns->notifications,
+                                                              i));
+
+  if (ns->notifications->len)
+    ns->info = notification_get_category_info (g_ptr_array_index (ns->notifications,
+                                                                  ns->notifications->len - 1));
+}
+
+static void notification_closed_cb (HDNotification *n,
+                                    Notifications  *ns);
+
+/* Adds @n as the latest notification of @ns */
+static void
+notifications_add (Notifications  *ns,
+                   HDNotification *n)
+{
+  g_object_ref (n);
+  g_ptr_array_add (ns->notifications, n);
+  g_signal_connect (n, "closed",
+                    G_CALLBACK (notification_closed_cb), ns);
+
+  ns->info = notification_get_category_info (n);
+  ns->amount += notification_get_amount (n);
+  if (ns->account_hint)
+    notifications_count_account (ns, n, 1);
+}
+
+static void
+notifications_unwatch (Notifications  *ns,
+                       HDNotification *n)
+{
+  g_signal_handlers_disconnect_by_func (n,
+                                        G_CALLBACK (notification_closed_cb),
+                                        ns);
+}
+
 static void
 notification_closed_cb (HDNotification *n,
                         Notifications  *ns)
 {
   g_ptr_array_remove (ns->notifications,
                       n);
-  g_signal_handlers_disconnect_by_func (n,
-                                        G_CALLBACK (notification_closed_cb),
-                                        ns);
+  notifications_unwatch (ns, n);
+
+  ns->amount -= notification_get_amount (n);
+  if (ns->account_hint)
+    notifications_count_account (ns, n, -1);
+  if (ns->notifications->len)
+    ns->info = notification_get_category_info (g_ptr_array_index (ns->notifications,
+                                                                  ns->notifications->len - 1));
+  else
+    ns->info = NULL;
+
   g_object_unref (n);
 
   if (ns->cb)
@@ -209,11 +382,7 @@ notifications_new_for_notification (HDNotification *n,
   ns = g_slice_new0 (Notifications);
   ns->notifications = notifications;
 
-  g_object_ref (n);
-  g_ptr_array_add (notifications,
-                   n);
-  g_signal_connect (n, "closed",
-                    G_CALLBACK (notification_closed_cb), ns);
+  notifications_add (ns, n);
   if (hd_notification_is_closed (n))
     {
       notification_closed_cb (n, ns);
@@ -252,13 +421,16 @@ notifications_free (Notifications *ns)
     {
       HDNotification *n = g_ptr_array_index (notifications, i);
 
-      g_signal_handlers_disconnect_by_func (n, G_CALLBACK (notification_closed_cb), ns);
+      notifications_unwatch (ns, n);
 
       g_object_unref (n);
     }
 
   g_ptr_array_free (notifications, TRUE);
 
+  if (ns->accounts)
+    g_hash_table_destroy (ns->accounts);
+
   /* Last notification in this group was closed,
    *  destroy window */
   if (GTK_IS_WIDGET (ns->window))
@@ -293,14 +465,7 @@ notifications_append (Notifications *ns,
   g_return_if_fail (!g_strcmp0 (ns->group, other->group));
 
   for (i = 0; i < other->notifications->len; i++)
-    {
-      HDNotification *n = g_ptr_array_index (other->notifications, i);
-
-      g_object_ref (n);
-      g_ptr_array_add (ns->notifications, n);
-      g_signal_connect (n, "closed",
-                        G_CALLBACK (notification_closed_cb), ns);
-    }
+    notifications_add (ns, g_ptr_array_index (other->notifications, i));
 }
 
 static gboolean
@@ -355,9 +520,7 @@ notifications_close_all (Notifications *ns,
 
       if (close_sticky || !sticky)
         {
-          g_signal_handlers_disconnect_by_func (n,
-                                                notification_closed_cb,
-                                                ns);
+          notifications_unwatch (ns, n);
           hd_notification_manager_close_notification (hd_notification_manager_get (),
                                                       hd_notification_get_id (n),
                                                       NULL);
@@ -367,6 +530,7 @@ notifications_close_all (Notifications *ns,
     }
  
   repack_ptr_array (ns->notifications);
+  notifications_reindex (ns);
 
   if (ns->cb)
     ns->cb (ns, ns->cb_data);
@@ -375,24 +539,7 @@ notifications_close_all (Notifications *ns,
 static CategoryInfo *
 notifications_get_category_info (Notifications *ns)
 {
-  HDIncomingEvents *ie = hd_incoming_events_get ();
-  HDIncomingEventsPrivate *priv = ie->priv;
-  HDNotification *notification;
-  const gchar *category;
-
-  if (notifications_is_empty (ns))
-    return NULL;
-
-  notification = g_ptr_array_index (ns->notifications,
-                                    ns->notifications->len - 1);
-
-  category = hd_notification_get_category (notification);
-
-  if (!category)
-    return NULL;
-
-  return g_hash_table_lookup (priv->categories,
-                              category);
+  return ns->info;
 }
 
 /* If account call is available, check if the account hint is the same for
@@ -402,7 +549,8 @@ static const gchar *
 notifications_get_common_account (Notifications *ns)
 {
   CategoryInfo *info;
-  const gchar *account = NULL;
+  GHashTableIter iter;
+  gpointer account;
   guint i;
 
   info = notifications_get_category_info (ns);
@@ -410,29 +558,32 @@ notifications_get_common_account (Notifications *ns)
   if (!info || !info->account_call || !info->account_hint)
     return NULL;
 
-
-  for (i = 0; i < ns->notifications->len; i++)
+  /* Count the accounts the first time they're asked for or when the
+   * latest notification brought a different account hint. */
+  if (g_strcmp0 (ns->account_hint, info->account_hint))
     {
-      GValue *value;
-      HDNotification *n = g_ptr_array_index (ns->notifications,
-                                             i); 
-
-      value = hd_notification_get_hint (n, info->account_hint);
-
-      if (!value || !G_VALUE_HOLDS_STRING (value))
-        {
-          return NULL;
-        }
+      if (!ns->accounts)
+        ns->accounts = g_hash_table_new_full (g_str_hash,
+                                              g_str_equal,
+                                              (GDestroyNotify) g_free,
+                                              NULL);
       else
-        {
-          if (!account)
-            account = g_value_get_string (value);
-          else if (g_strcmp0 (account,
-                              g_value_get_string (value)))
-            return NULL;
-        }
+        g_hash_table_remove_all (ns->accounts);
+
+      ns->account_hint = info->account_hint;
+      ns->no_account = 0;
+      for (i = 0; i < ns->notifications->len; i++)
+        notifications_count_account (ns,
+                                     g_ptr_array_index (ns->notifications, i),
+                                     1);
     }
 
+  if (ns->no_account || g_hash_table_size (ns->accounts) != 1)
+    return NULL;
+
+  g_hash_table_iter_init (&iter, ns->accounts);
+  g_hash_table_iter_next (&iter, &account, NULL);
+
   return account;
 }
 
@@ -444,24 +595,7 @@ notifications_get_common_account (Notifications *ns)
 static guint
 notifications_get_amount (Notifications *ns)
 {
-  guint i, amount = 0;
-
-  for (i = 0; i < ns->notifications->len; i++)
-    {
-      GValue *v;
-      HDNotification *n = g_ptr_array_index (ns->notifications,
-                                             i);
-
-      v = hd_notification_get_hint (n, "amount");
-      if (v && G_VALUE_HOLDS_UINT (v))
-        amount += MAX (g_value_get_uint (v), 1);
-      else if (v && G_VALUE_HOLDS_INT (v))
-        amount += MAX (g_value_get_int (v), 1);
-      else
-        amount++;
-    }
-
-  return amount;
+  return ns->amount;
 }
 
 /* Activate an array of notifications
@@ -496,9 +630,9 @@ notifications_activate (Notifications *ns)
 
       if (common_account)
         {
-          hd_notification_manager_call_dbus_callback_with_arg (hd_notification_manager_get (),
-                                                               info->account_call,
-                                                               common_account);
+          hd_notification_manager_send_call (hd_notification_manager_get (),
+                                             info->account_call,
+                                             common_account);
           notifications_close_all (ns, FALSE);
           return;
         }
@@ -506,16 +640,13 @@ notifications_activate (Notifications *ns)
       /* Call D-Bus callback if available.  If not or there's a special
        * "default" dbus_call description call the default action on each
        * notification. */
-      if (info && info->dbus_callbacks && !ns->thread)
+      if (info && info->dbus_calls && !ns->thread)
         {
-          gboolean call_default = FALSE;
-          for (i = 0; info->dbus_callbacks[i]; i++)
-            if (!strcmp(info->dbus_callbacks[i], "default"))
-              call_default = TRUE;
-            else
-              hd_notification_manager_call_dbus_callback (hd_notification_manager_get (),
-                                                          info->dbus_callbacks[i]);
-          if (!call_default)
+          for (i = 0; i < info->dbus_calls->len; i++)
+            hd_notification_manager_send_call (hd_notification_manager_get (),
+                                               g_ptr_array_index (info->dbus_calls, i),
+                                               NULL);
+          if (!info->call_default)
             {
               notifications_close_all (ns, FALSE);
               return;
@@ -836,6 +967,32 @@ preview_window_response (HDIncomingEventWindow *window,
 
 static void show_preview_window (HDIncomingEvents *ie);
 
+/* Removes @ns from the preview queue */
+static void
+preview_remove (HDIncomingEventsPrivate *priv,
+                Notifications           *ns)
+{
+  if (!ns->preview_link)
+    return;
+
+  g_queue_delete_link (priv->preview_queue, ns->preview_link);
+  ns->preview_link = NULL;
+
+  if (ns->group
+      && g_hash_table_lookup (priv->preview_index, ns->group) == ns)
+    g_hash_table_remove (priv->preview_index, ns->group);
+}
+
+static Notifications *
+preview_pop (HDIncomingEventsPrivate *priv)
+{
+  Notifications *ns = g_queue_peek_head (priv->preview_queue);
+
+  preview_remove (priv, ns);
+
+  return ns;
+}
+
 static void
 preview_window_destroy_cb (GtkWidget        *window,
                            HDIncomingEvents *ie)
@@ -853,18 +1010,16 @@ show_preview_window (HDIncomingEvents *ie)
   HDIncomingEventsPrivate *priv = ie->priv;
   Notifications *ns;
 
-  if (priv->preview_window || !priv->preview_list)
+  if (priv->preview_window || g_queue_is_empty (priv->preview_queue))
     return;
 
   /* If device is locked do not show preview windows but just add
    * notifications to switcher */
   if (priv->device_locked)
     {
-      while (priv->preview_list)
+      while (!g_queue_is_empty (priv->preview_queue))
         {
-          ns = priv->preview_list->data;
-          priv->preview_list = g_list_delete_link (priv->preview_list,
-                                                   priv->preview_list);
+          ns = preview_pop (priv);
           notifications_add_to_switcher (ns);
         }
 
@@ -872,9 +1027,7 @@ show_preview_window (HDIncomingEvents *ie)
     }
 
   /* Pop first notification from preview ns */
-  ns = priv->preview_list->data;
-  priv->preview_list = g_list_delete_link (priv->preview_list,
-                                           priv->preview_list);
+  ns = preview_pop (priv);
 
   /* Create the notification preview window */
   priv->preview_window = hd_incoming_event_window_new (TRUE,
@@ -909,19 +1062,6 @@ show_preview_window (HDIncomingEvents *ie)
   gtk_widget_show (priv->preview_window);
 }
 
-static gint
-notifications_cmp (gconstpointer a,
-                   gconstpointer b)
-{
-  const Notifications *l_a = a;
-  const Notifications *l_b = b;
-
-  if (!g_strcmp0 (l_a->group, l_b->group))
-    return 0;
-
-  return -1;
-}
-
 static void
 preview_list_notifications_cb (Notifications *ns,
                                gpointer       data)
@@ -930,15 +1070,46 @@ preview_list_notifications_cb (Notifications *ns,
 
   if (notifications_is_empty (ns))
     {
-      priv->preview_list = g_list_remove (priv->preview_list,
-                                          ns);
+      preview_remove (priv, ns);
       notifications_free (ns);
     }
 }
 
+/* The last event played of a category.  @notification is only kept
+ * until it is closed or superseded, @played for as long as the
+ * category is known. */
+typedef struct
+{
+  gint64          played;
+  HDNotification *notification;
+} SvCategory;
+
+static void sv_dispatch (HDIncomingEvents *ie);
+
 static void
-notification_closed_sv_cb (HDNotification   *notification,
-                           HDIncomingEvents *ie)
+sv_category_free (SvCategory *cat)
+{
+  if (cat->notification)
+    g_object_unref (cat->notification);
+  g_slice_free (SvCategory, cat);
+}
+
+static const gchar *
+sv_get_category (HDNotification *notification)
+{
+  const gchar *category = hd_notification_get_category (notification);
+  return category ? category : "";
+}
+
+/*
+ * The qdata of a notification is the ID of its event once PlayEvent
+ * has returned, or 1 if it shouldn't play anymore (it was closed or
+ * superseded).  Stops the event of @notification or makes sure it
+ * will be stopped when PlayEvent returns.
+ */
+static void
+sv_stop (HDIncomingEvents *ie,
+         HDNotification   *notification)
 {
   static GQuark quark_id = 0;
   HDIncomingEventsPrivate *priv = ie->priv;
@@ -949,19 +1120,51 @@ notification_closed_sv_cb (HDNotification   *notification,
 
   id = GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (notification),
                                              quark_id));
-  if (id)
+  if (id == 1)
+    return;
+
+  if (id && priv->sv_daemon_proxy)
     {
       dbus_g_proxy_call_no_reply (priv->sv_daemon_proxy,
                                   "StopEvent",
                                   G_TYPE_INT,
                                   id,
                                   G_TYPE_INVALID);
+      priv->sv_stats.stopped++;
     }
-  else
+
+  g_object_set_qdata (G_OBJECT (notification),
+                      quark_id,
+                      GUINT_TO_POINTER (1));
+}
+
+static void
+notification_closed_sv_cb (HDNotification   *notification,
+                           HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  const gchar *category;
+  SvCategory *cat;
+
+  /* Don't play it if it hasn't been yet. */
+  category = sv_get_category (notification);
+  if (g_hash_table_lookup (priv->sv_pending, category) == notification)
+    {
+      g_hash_table_remove (priv->sv_pending, category);
+      g_queue_remove (priv->sv_queue, notification);
+      g_object_unref (notification);
+      priv->sv_stats.dropped++;
+      return;
+    }
+
+  sv_stop (ie, notification);
+
+  /* Only the time it was played matters to the category now. */
+  cat = g_hash_table_lookup (priv->sv_categories, category);
+  if (cat && cat->notification == notification)
     {
-      g_object_set_qdata (G_OBJECT (notification),
-                          quark_id,
-                          GUINT_TO_POINTER (1));
+      g_object_unref (cat->notification);
+      cat->notification = NULL;
     }
 }
 
@@ -971,6 +1174,7 @@ play_event_notify (DBusGProxy     *proxy,
                    HDNotification *notification)
 {
   static GQuark quark_id = 0;
+  HDIncomingEvents *ie = hd_incoming_events_get ();
   guint id;
   GError *error = NULL;
 
@@ -983,8 +1187,8 @@ play_event_notify (DBusGProxy     *proxy,
                              G_TYPE_INT, &id,
                              G_TYPE_INVALID))
     {
-      /* If the id is set the notification is
-       * already closed else set the id
+      /* If the id is set the notification is already
+       * closed or superseded else set the id
        */
       if (g_object_get_qdata (G_OBJECT (notification),
                               quark_id))
@@ -994,6 +1198,7 @@ play_event_notify (DBusGProxy     *proxy,
                                       G_TYPE_INT,
                                       id,
                                       G_TYPE_INVALID);
+          ie->priv->sv_stats.stopped++;
         }
       else
         {
@@ -1007,6 +1212,183 @@ play_event_notify (DBusGProxy     *proxy,
       g_warning ("Error calling PlayEvent. %s", error->message);
       g_error_free (error);
     }  
+
+  /* Make room for the next one. */
+  ie->priv->sv_in_flight--;
+  sv_dispatch (ie);
+}
+
+static gboolean
+sv_dispatch_timeout (HDIncomingEvents *ie)
+{
+  ie->priv->sv_timeout = 0;
+  sv_dispatch (ie);
+  return FALSE;
+}
+
+/* Plays the queued events whose category's window is over, as long as
+ * there's room for more PlayEvent calls.  Arms @sv_timeout for the
+ * earliest of the others. */
+static void
+sv_dispatch (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  GList *l, *next;
+  gint64 now, wait;
+
+  if (priv->sv_timeout)
+    {
+      g_source_remove (priv->sv_timeout);
+      priv->sv_timeout = 0;
+    }
+
+  now = g_get_monotonic_time ();
+  wait = -1;
+  for (l = priv->sv_queue->head;
+       l && priv->sv_in_flight < priv->sv_max_in_flight;
+       l = next)
+    {
+      HDNotification *notification = l->data;
+      const gchar *category = sv_get_category (notification);
+      SvCategory *cat;
+      gint64 ready;
+
+      next = l->next;
+
+      cat = g_hash_table_lookup (priv->sv_categories, category);
+      ready = cat ? cat->played + priv->sv_window * 1000 : now;
+      if (ready > now)
+        {
+          if (wait < 0 || ready - now < wait)
+            wait = ready - now;
+          continue;
+        }
+
+      g_queue_delete_link (priv->sv_queue, l);
+      g_hash_table_remove (priv->sv_pending, category);
+
+      if (!cat)
+        {
+          cat = g_slice_new0 (SvCategory);
+          g_hash_table_insert (priv->sv_categories, g_strdup (category), cat);
+        }
+      else if (cat->notification)
+        { /* This one supersedes the previous of the category. */
+          sv_stop (ie, cat->notification);
+          g_object_unref (cat->notification);
+        }
+      cat->notification = g_object_ref (notification);
+      cat->played = now;
+
+      priv->sv_in_flight++;
+      priv->sv_stats.played++;
+      dbus_g_proxy_begin_call (priv->sv_daemon_proxy,
+                               "PlayEvent",
+                               (DBusGProxyCallNotify) play_event_notify,
+                               notification,
+                               (GDestroyNotify) g_object_unref,
+                               dbus_g_type_get_map ("GHashTable", G_TYPE_STRING, G_TYPE_VALUE),
+                               hd_notification_get_hints (notification),
+                               G_TYPE_STRING,
+                               hd_notification_get_sender (notification),
+                               G_TYPE_INVALID);
+    }
+
+  if (wait >= 0)
+    priv->sv_timeout = g_timeout_add ((wait + 999) / 1000,
+                                      (GSourceFunc) sv_dispatch_timeout, ie);
+}
+
+/* Queues the sound/vibra event of @notification. */
+static void
+sv_enqueue (HDIncomingEvents *ie,
+            HDNotification   *notification)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  const gchar *category = sv_get_category (notification);
+  HDNotification *pending;
+  GList *l;
+
+  g_signal_connect (notification, "closed",
+                    G_CALLBACK (notification_closed_sv_cb), ie);
+
+  pending = g_hash_table_lookup (priv->sv_pending, category);
+  if (pending)
+    { /* Coalesce with the one waiting in the queue. */
+      l = g_queue_find (priv->sv_queue, pending);
+      l->data = g_object_ref (notification);
+      g_hash_table_insert (priv->sv_pending, g_strdup (category),
+                           notification);
+      g_object_unref (pending);
+      priv->sv_stats.coalesced++;
+    }
+  else
+    {
+      if (g_queue_get_length (priv->sv_queue) >= priv->sv_max_queued)
+        { /* Too much going on, forget the oldest. */
+          pending = g_queue_pop_head (priv->sv_queue);
+          g_hash_table_remove (priv->sv_pending, sv_get_category (pending));
+          g_object_unref (pending);
+          priv->sv_stats.dropped++;
+        }
+
+      g_queue_push_tail (priv->sv_queue, g_object_ref (notification));
+      g_hash_table_insert (priv->sv_pending, g_strdup (category),
+                           notification);
+    }
+
+  sv_dispatch (ie);
+}
+
+/**
+ * hd_incoming_events_get_sv_stats:
+ * @ie: the #HDIncomingEvents
+ * @stats: where to store the counters
+ *
+ * Gets the counters of the sound/vibra event dispatcher.
+ */
+void
+hd_incoming_events_get_sv_stats (HDIncomingEvents        *ie,
+                                 HDIncomingEventsSvStats *stats)
+{
+  g_return_if_fail (HD_IS_INCOMING_EVENTS (ie));
+  g_return_if_fail (stats != NULL);
+
+  *stats = ie->priv->sv_stats;
+}
+
+/* Reads the [SoundVibra] section of notification.conf. */
+static void
+sv_configure (HDIncomingEvents *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  GKeyFile *conf;
+  gint value;
+
+  conf = g_key_file_new ();
+  g_key_file_load_from_file (conf, HD_SV_CONF, G_KEY_FILE_NONE, NULL);
+
+  value = g_key_file_get_integer (conf, HD_SV_CONF_GROUP,
+                                  "coalesce-window", NULL);
+  priv->sv_window = g_key_file_has_key (conf, HD_SV_CONF_GROUP,
+                                        "coalesce-window", NULL)
+    && value >= 0
+    ? value
+    : HD_SV_DEFAULT_WINDOW;
+
+  value = g_key_file_get_integer (conf, HD_SV_CONF_GROUP,
+                                  "max-in-flight", NULL);
+  priv->sv_max_in_flight = value > 0
+    ? value
+    : HD_SV_DEFAULT_MAX_IN_FLIGHT;
+
+  value = g_key_file_get_integer (conf, HD_SV_CONF_GROUP,
+                                  "max-queued", NULL);
+  priv->sv_max_queued = value > 0
+    ? value
+    : HD_SV_DEFAULT_MAX_QUEUED;
+
+  g_key_file_free (conf);
 }
 
 static void
@@ -1060,34 +1442,33 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
   /* Replayed events are just added to the switcher */
   if (replayed_event)
     {
-      notifications_add_to_switcher (ns);
+      Notifications *existing;
+
+      /* Defer the switcher windows until the whole batch is known
+       * so every group is realized only once. */
+      if (priv->replay_groups && info && !notifications_is_empty (ns))
+        {
+          existing = g_hash_table_lookup (priv->replay_index, ns->group);
+          if (existing)
+            {
+              notifications_append (existing, ns);
+              notifications_free (ns);
+            }
+          else
+            {
+              g_ptr_array_add (priv->replay_groups, ns);
+              g_hash_table_insert (priv->replay_index, ns->group, ns);
+            }
+        }
+      else
+        notifications_add_to_switcher (ns);
 
       return;
     }
 
   /* Call sound/vibra daemon */
   if (priv->sv_daemon_proxy)
-    {
-      GHashTable *hints;
-      const gchar *sender;
-
-      hints = hd_notification_get_hints (notification);
-      sender = hd_notification_get_sender (notification);
-
-      g_signal_connect (notification, "closed",
-                        G_CALLBACK (notification_closed_sv_cb), ie);
-
-      dbus_g_proxy_begin_call (priv->sv_daemon_proxy,
-                               "PlayEvent",
-                               (DBusGProxyCallNotify) play_event_notify,
-                               g_object_ref (notification),
-                               (GDestroyNotify) g_object_unref,
-                               dbus_g_type_get_map ("GHashTable", G_TYPE_STRING, G_TYPE_VALUE),
-                               hints,
-                               G_TYPE_STRING,
-                               sender,
-                               G_TYPE_INVALID);
-    }
+    sv_enqueue (ie, notification);
 
   /* Call plugins */
 /*  for (i = 0; i < priv->plugins->len; i++)
@@ -1141,35 +1522,74 @@ hd_incoming_events_notified (HDNotificationManager  *nm,
 
   if (info)
     {
-      GList *l  = g_list_find_custom (priv->preview_list,
-                                      ns,
-                                      notifications_cmp);
+      Notifications *existing = g_hash_table_lookup (priv->preview_index,
+                                                     ns->group);
 
-      if (l)
+      if (existing)
         {
-          Notifications *existing = l->data;
-
           notifications_append (existing,
                                 ns);
           notifications_free (ns);
         }
       else
         {
-          priv->preview_list = g_list_append (priv->preview_list,
-                                              ns);
+          g_queue_push_tail (priv->preview_queue, ns);
+          ns->preview_link = g_queue_peek_tail_link (priv->preview_queue);
+          g_hash_table_insert (priv->preview_index, ns->group, ns);
           ns->cb = preview_list_notifications_cb;
           ns->cb_data = priv;
         }
     }
   else
     {
-      priv->preview_list = g_list_append (priv->preview_list,
-                                          ns);
+      g_queue_push_tail (priv->preview_queue, ns);
+      ns->preview_link = g_queue_peek_tail_link (priv->preview_queue);
     }
 
   show_preview_window (ie);
 }
 
+static void
+hd_incoming_events_replay_begin (HDNotificationManager *nm,
+                                 HDIncomingEvents      *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+
+  g_return_if_fail (priv->replay_groups == NULL);
+
+  priv->replay_groups = g_ptr_array_new ();
+  priv->replay_index = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+static void
+hd_incoming_events_replay_end (HDNotificationManager *nm,
+                               HDIncomingEvents      *ie)
+{
+  HDIncomingEventsPrivate *priv = ie->priv;
+  GPtrArray *groups;
+  guint i;
+
+  if (!priv->replay_groups)
+    return;
+
+  groups = priv->replay_groups;
+  priv->replay_groups = NULL;
+  priv->replay_index = (g_hash_table_destroy (priv->replay_index), NULL);
+
+  for (i = 0; i < groups->len; i++)
+    {
+      Notifications *ns = g_ptr_array_index (groups, i);
+
+      /* All of them may have been closed in the meantime. */
+      if (notifications_is_empty (ns))
+        notifications_free (ns);
+      else
+        notifications_add_to_switcher (ns);
+    }
+
+  g_ptr_array_free (groups, TRUE);
+}
+
 static void
 hd_incoming_events_dispose (GObject *object)
 {
@@ -1181,6 +1601,21 @@ hd_incoming_events_dispose (GObject *object)
   if (priv->mce_proxy)
     priv->mce_proxy = (g_object_unref (priv->mce_proxy), NULL);
 
+  if (priv->sv_timeout)
+    priv->sv_timeout = (g_source_remove (priv->sv_timeout), 0);
+
+  if (priv->sv_queue)
+    {
+      g_queue_foreach (priv->sv_queue, (GFunc) g_object_unref, NULL);
+      priv->sv_queue = (g_queue_free (priv->sv_queue), NULL);
+    }
+
+  if (priv->sv_pending)
+    priv->sv_pending = (g_hash_table_destroy (priv->sv_pending), NULL);
+
+  if (priv->sv_categories)
+    priv->sv_categories = (g_hash_table_destroy (priv->sv_categories), NULL);
+
   if (priv->sv_daemon_proxy)
     priv->sv_daemon_proxy = (g_object_unref (priv->sv_daemon_proxy), NULL);
 
@@ -1198,8 +1633,11 @@ hd_incoming_events_finalize (GObject *object)
   if (priv->categories)
     priv->categories = (g_hash_table_destroy (priv->categories), NULL);
 
-  if (priv->preview_list)
-    priv->preview_list = (g_list_free (priv->preview_list), NULL);
+  if (priv->preview_queue)
+    priv->preview_queue = (g_queue_free (priv->preview_queue), NULL);
+
+  if (priv->preview_index)
+    priv->preview_index = (g_hash_table_destroy (priv->preview_index), NULL);
 
   if (priv->plugins)
     priv->plugins = (g_ptr_array_free (priv->plugins, TRUE), NULL);
@@ -1236,9 +1674,10 @@ category_info_free (CategoryInfo *info)
   g_free (info->secondary_text);
   g_free (info->secondary_text_empty);
   g_free (info->icon);
-  g_strfreev (info->dbus_callbacks);
+  if (info->dbus_calls)
+    g_ptr_array_free (info->dbus_calls, TRUE);
   g_free (info->text_domain);
-  g_free (info->account_call);
+  hd_notification_call_free (info->account_call);
   g_free (info->account_hint);
   g_free (info->pattern);
   g_free (info->group);
@@ -1309,7 +1748,10 @@ load_category_infos (HDIncomingEvents *ie)
   for (i = 0; infos[i]; i++)
     {
       CategoryInfo *info;
+      HDNotificationCall *call;
+      gchar **dbus_callbacks, *account_call;
       GError *error = NULL;
+      guint j;
 
       info = g_new0 (CategoryInfo, 1);
 
@@ -1368,21 +1810,38 @@ load_category_infos (HDIncomingEvents *ie)
                                           NOTIFICATION_GROUP_KEY_ICON,
                                           NULL);
 
-      info->dbus_callbacks = g_key_file_get_string_list (key_file,
-                                                         infos[i],
-                                                         NOTIFICATION_GROUP_KEY_DBUS_CALL,
-                                                         NULL,
-                                                         NULL);
+      dbus_callbacks = g_key_file_get_string_list (key_file,
+                                                   infos[i],
+                                                   NOTIFICATION_GROUP_KEY_DBUS_CALL,
+                                                   NULL,
+                                                   NULL);
+      if (dbus_callbacks)
+        {
+          /* Compile them now so activating a group needn't parse. */
+          info->dbus_calls = g_ptr_array_new_with_free_func (
+                                    (GDestroyNotify) hd_notification_call_free);
+          for (j = 0; dbus_callbacks[j]; j++)
+            if (!strcmp (dbus_callbacks[j], "default"))
+              info->call_default = TRUE;
+            else if ((call = hd_notification_call_new (dbus_callbacks[j])))
+              g_ptr_array_add (info->dbus_calls, call);
+          g_strfreev (dbus_callbacks);
+        }
 
       info->account_hint = g_key_file_get_string (key_file,
                                                   infos[i],
                                                   NOTIFICATION_GROUP_KEY_ACCOUNT_HINT,
                                                   NULL);
 
-      info->account_call = g_key_file_get_string (key_file,
-                                                  infos[i],
-                                                  NOTIFICATION_GROUP_KEY_ACCOUNT_CALL,
-                                                  NULL);
+      account_call = g_key_file_get_string (key_file,
+                                            infos[i],
+                                            NOTIFICATION_GROUP_KEY_ACCOUNT_CALL,
+                                            NULL);
+      if (account_call)
+        {
+          info->account_call = hd_notification_call_new (account_call);
+          g_free (account_call);
+        }
 
       info->pattern = g_key_file_get_string (key_file,
                                              infos[i],
@@ -1658,8 +2117,21 @@ hd_incoming_events_init (HDIncomingEvents *ie)
                                                  g_str_equal,
                                                  (GDestroyNotify) g_free,
                                                  (GDestroyNotify) notifications_free);
+  priv->preview_queue = g_queue_new ();
+  priv->preview_index = g_hash_table_new (g_str_hash, g_str_equal);
   priv->plugins = g_ptr_array_new ();
 
+  priv->sv_queue = g_queue_new ();
+  priv->sv_pending = g_hash_table_new_full (g_str_hash,
+                                            g_str_equal,
+                                            (GDestroyNotify) g_free,
+                                            NULL);
+  priv->sv_categories = g_hash_table_new_full (g_str_hash,
+                                               g_str_equal,
+                                               (GDestroyNotify) g_free,
+                                               (GDestroyNotify) sv_category_free);
+  sv_configure (ie);
+
   priv->plugin_manager = hd_plugin_manager_new (hd_config_file_new_with_defaults ("notification.conf"));
 
   priv->display_on = TRUE;
@@ -1676,6 +2148,10 @@ hd_incoming_events_init (HDIncomingEvents *ie)
   /* Connect to notification manager signals */
   g_signal_connect_object (hd_notification_manager_get (), "notified",
                            G_CALLBACK (hd_incoming_events_notified), ie, 0);
+  g_signal_connect_object (hd_notification_manager_get (), "replay-begin",
+                           G_CALLBACK (hd_incoming_events_replay_begin), ie, 0);
+  g_signal_connect_object (hd_notification_manager_get (), "replay-end",
+                           G_CALLBACK (hd_incoming_events_replay_end), ie, 0);
   load_category_infos (ie);
 
   /* Get D-Bus proxy for mce calls */
@@ -51,12 +51,35 @@ struct _HDIncomingEventsClass
   GObjectClass parent;
 };
 
+/**
+ * HDIncomingEventsSvStats:
+ * @played: number of PlayEvent calls made
+ * @coalesced: number of events replaced by a later one of the same
+ *   category before they were played
+ * @dropped: number of events not played because the queue was full
+ *   or the notification was closed before
+ * @stopped: number of events stopped because they were superseded or
+ *   their notification was closed
+ *
+ * Counters of the sound/vibra event dispatcher.
+ */
+typedef struct
+{
+  guint played;
+  guint coalesced;
+  guint dropped;
+  guint stopped;
+} HDIncomingEventsSvStats;
+
 GType             hd_incoming_events_get_type (void);
 
 HDIncomingEvents *hd_incoming_events_get      (void);
 
 gboolean          hd_incoming_events_get_display_on (void);
 
+void              hd_incoming_events_get_sv_stats   (HDIncomingEvents        *ie,
+                                                     HDIncomingEventsSvStats *stats);
+
 G_END_DECLS
 
 #endif
@@ -36,6 +36,26 @@ struct _HDLedPatternPrivate
   gchar *name;
 };
 
+/* What we last told MCE about a pattern. */
+typedef enum
+{
+  LED_STATE_UNKNOWN,
+  LED_STATE_OFF,
+  LED_STATE_ON,
+} LedState;
+
+/*
+ * Pending change of a pattern.  Activations and deactivations are
+ * only recorded in @wanted and sent to MCE from an idle callback, so
+ * a quick deactivate/activate sequence of the same pattern costs
+ * no call at all and activate/deactivate costs one.
+ */
+typedef struct
+{
+  gboolean wanted;
+  LedState told;
+} LedRequest;
+
 enum
 {
   PROP_0,
@@ -53,10 +73,11 @@ static void hd_led_pattern_set_property (GObject      *object,
                                          GParamSpec   *pspec);
 static void hd_led_pattern_constructed  (GObject *object);
 
-static void            activate_pattern   (HDLedPattern *pattern);
-static void            deactivate_pattern (HDLedPattern *pattern);
+static void            request_pattern    (const gchar  *name,
+                                           gboolean      active);
 
 static GHashTable      *get_pattern_map            (void);
+static GHashTable      *get_request_map            (void);
 static DBusGProxy      *get_mce_proxy              (void);
 
 G_DEFINE_TYPE_WITH_CODE (HDLedPattern, hd_led_pattern, G_TYPE_INITIALLY_UNOWNED, G_ADD_PRIVATE(HDLedPattern));
@@ -98,6 +119,22 @@ get_pattern_map (void)
   return pattern_map;
 }
 
+/* Pattern name -> #LedRequest. */
+static GHashTable *
+get_request_map (void)
+{
+  static GHashTable *request_map = NULL;
+
+  if (G_UNLIKELY (!request_map))
+    {
+      request_map = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           (GDestroyNotify) g_free,
+                                           g_free);
+    }
+
+  return request_map;
+}
+
 static void
 hd_led_pattern_class_init (HDLedPatternClass *klass)
 {
@@ -132,58 +169,102 @@ hd_led_pattern_constructed (GObject *object)
   if (G_OBJECT_CLASS (hd_led_pattern_parent_class)->constructed)
     G_OBJECT_CLASS (hd_led_pattern_parent_class)->constructed (object);
 
-  activate_pattern (pattern);
+  request_pattern (pattern->priv->name, TRUE);
 }
 
 static void
-activate_pattern (HDLedPattern *pattern)
+activate_pattern_reply (DBusGProxy     *proxy,
+                        DBusGProxyCall *call,
+                        gchar          *name)
 {
-  HDLedPatternPrivate *priv = pattern->priv;
+  GError *error = NULL;
+
+  if (!dbus_g_proxy_end_call (proxy, call, &error, G_TYPE_INVALID))
+    {
+      g_debug ("%s. Could not activate LED pattern: %s. %s", __FUNCTION__, name, error->message);
+      g_error_free (error);
+    }
+  else
+    g_debug ("%s. Activated LED pattern: %s", __FUNCTION__, name);
+}
+
+/* Tells MCE about the pending changes, one call per changed pattern
+ * as MCE has no batch method.  Messages on the connection are
+ * delivered in order, so we needn't wait for the replies. */
+static gboolean
+flush_requests (gpointer data)
+{
+  guint *flush_id = data;
   DBusGProxy *mce_proxy;
+  GHashTableIter iter;
+  gpointer key, value;
 
+  *flush_id = 0;
   mce_proxy = get_mce_proxy ();
 
-  if (mce_proxy)
+  g_hash_table_iter_init (&iter, get_request_map ());
+  while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      GError *error = NULL;
-
-      dbus_g_proxy_call (mce_proxy,
-                         MCE_ACTIVATE_LED_PATTERN,
-                         &error,
-                         G_TYPE_STRING,
-                         priv->name,
-                         G_TYPE_INVALID,
-                         G_TYPE_INVALID);
+      const gchar *name = key;
+      LedRequest *request = value;
 
-      if (error)
+      if (request->wanted && request->told != LED_STATE_ON)
+        {
+          if (mce_proxy)
+            dbus_g_proxy_begin_call (mce_proxy,
+                                     MCE_ACTIVATE_LED_PATTERN,
+                                     (DBusGProxyCallNotify) activate_pattern_reply,
+                                     g_strdup (name),
+                                     g_free,
+                                     G_TYPE_STRING,
+                                     name,
+                                     G_TYPE_INVALID);
+          request->told = LED_STATE_ON;
+        }
+      else if (!request->wanted && request->told != LED_STATE_OFF)
         {
-          g_debug ("%s. Could not activate LED pattern: %s. %s", __FUNCTION__, priv->name, error->message);
-          g_error_free (error);
+          g_debug ("%s. Dectivate LED pattern: %s", __FUNCTION__, name);
+
+          if (mce_proxy)
+            dbus_g_proxy_call_no_reply (mce_proxy,
+                                        MCE_DEACTIVATE_LED_PATTERN,
+                                        G_TYPE_STRING,
+                                        name,
+                                        G_TYPE_INVALID,
+                                        G_TYPE_INVALID);
+          request->told = LED_STATE_OFF;
         }
-      else
-        g_debug ("%s. Activated LED pattern: %s", __FUNCTION__, priv->name);
+
+      /* Forget patterns which are off, we'd only keep them to
+       * spare a redundant deactivation. */
+      if (request->told == LED_STATE_OFF)
+        g_hash_table_iter_remove (&iter);
     }
+
+  return FALSE;
 }
 
+/* Records that @name should be (in)@active and schedules telling
+ * MCE about it. */
 static void
-deactivate_pattern (HDLedPattern *pattern)
+request_pattern (const gchar *name,
+                 gboolean     active)
 {
-  HDLedPatternPrivate *priv = pattern->priv;
-  DBusGProxy *mce_proxy;
+  static guint flush_id = 0;
+  GHashTable *request_map = get_request_map ();
+  LedRequest *request;
 
-  mce_proxy = get_mce_proxy ();
-
-  if (mce_proxy)
+  request = g_hash_table_lookup (request_map, name);
+  if (!request)
     {
-      g_debug ("%s. Dectivate LED pattern: %s", __FUNCTION__, priv->name);
-
-      dbus_g_proxy_call_no_reply (mce_proxy,
-                                  MCE_DEACTIVATE_LED_PATTERN,
-                                  G_TYPE_STRING,
-                                  priv->name,
-                                  G_TYPE_INVALID,
-                                  G_TYPE_INVALID);
+      request = g_new (LedRequest, 1);
+      request->told = LED_STATE_UNKNOWN;
+      g_hash_table_insert (request_map, g_strdup (name), request);
     }
+  request->wanted = active;
+
+  if (!flush_id)
+    flush_id = g_idle_add (flush_requests, &flush_id);
 }
 
 static DBusGProxy *
@@ -220,7 +301,7 @@ hd_led_pattern_dispose (GObject *object)
       g_hash_table_remove (pattern_map,
                            priv->name);
 
-      deactivate_pattern (pattern);
+      request_pattern (priv->name, FALSE);
 
       priv->name = (g_free (priv->name), NULL);
     }
@@ -266,28 +347,16 @@ const static char *default_notification_pattern[] =
   NULL
 };
 
+/* MCE has no method to deactivate several patterns at once, so this
+ * still sends one no-reply deactivate_led_pattern call per pattern
+ * that isn't off already.  They are only coalesced: queued until the
+ * next flush_requests() together with any other pending change, each
+ * pattern at most once however many times it's requested. */
 void
 hd_led_pattern_deactivate_all (void)
 {
-  DBusGProxy *mce_proxy;
   guint i;
 
-  mce_proxy = get_mce_proxy ();
-
-  if (mce_proxy)
-    {
-      for (i = 0; default_notification_pattern[i]; i++)
-        {
-          g_debug ("%s. Dectivate LED pattern: %s",
-                   __FUNCTION__,
-                   default_notification_pattern[i]);
-
-          dbus_g_proxy_call_no_reply (mce_proxy,
-                                      MCE_DEACTIVATE_LED_PATTERN,
-                                      G_TYPE_STRING,
-                                      default_notification_pattern[i],
-                                      G_TYPE_INVALID,
-                                      G_TYPE_INVALID);
-        }
-    }
+  for (i = 0; default_notification_pattern[i]; i++)
+    request_pattern (default_notification_pattern[i], FALSE);
 }
@@ -0,0 +1,442 @@
+/*
+ * hd-notification-benchmark.c -- measure the notification manager
+ *
+ * This program starts a private dbus-daemon, creates the notification
+ * manager in-process with its database in a temporary $HOME, then
+ * fires bursts of Notify and CloseNotification calls at it over the
+ * bus.  It reports calls/s, latency percentiles, the memory
+ * allocations per call and how the database writes were batched into
+ * commits.  Build it with `make hd-notification-benchmark'.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <dbus/dbus-glib.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hd-notification-manager.h"
+
+#define BENCH_DBUS_NAME  "org.freedesktop.Notifications"
+#define BENCH_DBUS_PATH  "/org/freedesktop/Notifications"
+#define BENCH_DBUS_IFACE "org.freedesktop.Notifications"
+
+/*
+ * The allocations are counted by replacing malloc() and friends, which
+ * glibc allows.  GLib allocates with them since 2.46, GSlice only when
+ * G_SLICE=always-malloc before 2.76.  All the threads of the process
+ * are counted; the calls made while the benchmark builds its requests
+ * or reads the replies are counted apart, as the client's.
+ */
+static gint allocations = 0;
+
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc  (size_t size);
+extern void *__libc_calloc  (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void  __libc_free    (void *ptr);
+
+void *
+malloc (size_t size)
+{
+  g_atomic_int_inc (&allocations);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size)
+{
+  g_atomic_int_inc (&allocations);
+  return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  g_atomic_int_inc (&allocations);
+  return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+  __libc_free (ptr);
+}
+#endif
+
+static gint     count        = 1000;
+static gint     window       = 16;
+static gint     persistent   = 50;
+static gint     extra_hints  = 4;
+static gboolean keep_open    = FALSE;
+
+static GOptionEntry entries[] =
+{
+  { "count", 'n', 0, G_OPTION_ARG_INT, &count,
+    "Number of notifications to send (1000)", "N" },
+  { "window", 'w', 0, G_OPTION_ARG_INT, &window,
+    "Number of calls in flight at once (16)", "N" },
+  { "persistent", 'p', 0, G_OPTION_ARG_INT, &persistent,
+    "Percentage of persistent notifications (50)", "PERCENT" },
+  { "hints", 'x', 0, G_OPTION_ARG_INT, &extra_hints,
+    "Number of extra hints per notification (4)", "N" },
+  { "keep-open", 'k', 0, G_OPTION_ARG_NONE, &keep_open,
+    "Don't close the notifications", NULL },
+  { NULL }
+};
+
+/* One round of calls of the same method. */
+typedef struct
+{
+  const gchar *method;
+  guint        issued;
+  guint        completed;
+  guint        failed;
+  gint64       started;
+  gint64       finished;
+  gint64      *latencies;
+  gint         allocations;
+  gint         client_allocations;
+} BenchPhase;
+
+/* A call in flight. */
+typedef struct
+{
+  BenchPhase *phase;
+  guint       index;
+  gint64      sent;
+} BenchCall;
+
+static DBusGProxy *proxy;
+static GMainLoop  *loop;
+static guint      *ids;
+static GType       hints_type;
+
+static void bench_issue (BenchPhase *phase);
+
+static void
+bench_value_free (GValue *value)
+{
+  g_value_unset (value);
+  g_free (value);
+}
+
+static void
+bench_reply (DBusGProxy     *proxy,
+             DBusGProxyCall *call,
+             BenchCall      *bc)
+{
+  BenchPhase *phase = bc->phase;
+  GError *error = NULL;
+  gboolean ok;
+  gint before = g_atomic_int_get (&allocations);
+
+  if (!strcmp (phase->method, "Notify"))
+    ok = dbus_g_proxy_end_call (proxy, call, &error,
+                                G_TYPE_UINT, &ids[bc->index],
+                                G_TYPE_INVALID);
+  else
+    ok = dbus_g_proxy_end_call (proxy, call, &error, G_TYPE_INVALID);
+
+  phase->client_allocations += g_atomic_int_get (&allocations) - before;
+
+  if (!ok)
+    {
+      g_warning ("%s: %s", phase->method, error->message);
+      g_error_free (error);
+      phase->failed++;
+    }
+
+  phase->latencies[bc->index] = g_get_monotonic_time () - bc->sent;
+  phase->completed++;
+
+  if (phase->completed == (guint) count)
+    {
+      phase->finished = g_get_monotonic_time ();
+      g_main_loop_quit (loop);
+    }
+  else
+    bench_issue (phase);
+}
+
+static void
+bench_call_free (BenchCall *bc)
+{
+  g_slice_free (BenchCall, bc);
+}
+
+/* Builds the hints of the @i:th notification like a messaging
+ * application would. */
+static GHashTable *
+bench_hints (guint i)
+{
+  GHashTable *hints;
+  GValue *value;
+  guint j;
+
+  hints = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                 (GDestroyNotify) bench_value_free);
+
+  value = g_new0 (GValue, 1);
+  g_value_init (value, G_TYPE_STRING);
+  g_value_set_static_string (value, "sms-message");
+  g_hash_table_insert (hints, g_strdup ("category"), value);
+
+  value = g_new0 (GValue, 1);
+  g_value_init (value, G_TYPE_UCHAR);
+  g_value_set_uchar (value, g_random_int_range (0, 100) < persistent);
+  g_hash_table_insert (hints, g_strdup ("persistent"), value);
+
+  for (j = 0; j < (guint) extra_hints; j++)
+    {
+      value = g_new0 (GValue, 1);
+      if (j % 2)
+        {
+          g_value_init (value, G_TYPE_INT);
+          g_value_set_int (value, i * j);
+        }
+      else
+        {
+          g_value_init (value, G_TYPE_STRING);
+          g_value_take_string (value, g_strdup_printf ("value %u-%u", i, j));
+        }
+      g_hash_table_insert (hints, g_strdup_printf ("x-bench-%u", j), value);
+    }
+
+  return hints;
+}
+
+/* Sends calls of @phase until @window of them are in flight. */
+static void
+bench_issue (BenchPhase *phase)
+{
+  static const gchar *actions[] = { "default", "default", NULL };
+
+  while (phase->issued < (guint) count
+         && phase->issued - phase->completed < (guint) window)
+    {
+      gint before = g_atomic_int_get (&allocations);
+      BenchCall *bc = g_slice_new (BenchCall);
+
+      bc->phase = phase;
+      bc->index = phase->issued++;
+      bc->sent = g_get_monotonic_time ();
+
+      if (!strcmp (phase->method, "Notify"))
+        {
+          GHashTable *hints = bench_hints (bc->index);
+          gchar *summary = g_strdup_printf ("sms-%u", bc->index);
+
+          dbus_g_proxy_begin_call (proxy, "Notify",
+                                   (DBusGProxyCallNotify) bench_reply, bc,
+                                   (GDestroyNotify) bench_call_free,
+                                   G_TYPE_STRING, "hd-notification-benchmark",
+                                   G_TYPE_UINT, 0,
+                                   G_TYPE_STRING, "",
+                                   G_TYPE_STRING, summary,
+                                   G_TYPE_STRING, "Lorem ipsum dolor sit amet",
+                                   G_TYPE_STRV, actions,
+                                   hints_type, hints,
+                                   G_TYPE_INT, 0,
+                                   G_TYPE_INVALID);
+
+          g_hash_table_destroy (hints);
+          g_free (summary);
+        }
+      else
+        dbus_g_proxy_begin_call (proxy, phase->method,
+                                 (DBusGProxyCallNotify) bench_reply, bc,
+                                 (GDestroyNotify) bench_call_free,
+                                 G_TYPE_UINT, ids[bc->index],
+                                 G_TYPE_INVALID);
+
+      phase->client_allocations += g_atomic_int_get (&allocations) - before;
+    }
+}
+
+static gint
+bench_compare_latency (gconstpointer a, gconstpointer b)
+{
+  gint64 la = *(const gint64 *) a, lb = *(const gint64 *) b;
+  return la < lb ? -1 : la > lb;
+}
+
+static void
+bench_run (BenchPhase *phase)
+{
+  gdouble secs;
+
+  phase->latencies = g_new0 (gint64, count);
+  phase->allocations = g_atomic_int_get (&allocations);
+  phase->started = g_get_monotonic_time ();
+  bench_issue (phase);
+  g_main_loop_run (loop);
+  phase->allocations = g_atomic_int_get (&allocations) - phase->allocations;
+
+  qsort (phase->latencies, count, sizeof (gint64), bench_compare_latency);
+  secs = (phase->finished - phase->started) / (gdouble) G_USEC_PER_SEC;
+  g_print ("%-17s %8u calls %6u failed %10.1f calls/s  "
+           "p50 %7.3f ms  p99 %7.3f ms\n",
+           phase->method, phase->completed, phase->failed,
+           secs > 0 ? phase->completed / secs : 0,
+           phase->latencies[count / 2] / 1000.0,
+           phase->latencies[count * 99 / 100] / 1000.0);
+#ifdef BENCH_COUNT_ALLOCATIONS
+  g_print ("%-17s allocations per call: %.1f by the manager and the bus, "
+           "%.1f by the client\n", "",
+           (phase->allocations - phase->client_allocations) / (gdouble) count,
+           phase->client_allocations / (gdouble) count);
+#endif
+
+  g_free (phase->latencies);
+}
+
+/* Starts a dbus-daemon of our own and points both buses to it.
+ * Returns its pid. */
+static GPid
+bench_start_bus (void)
+{
+  gchar *argv[] = { "dbus-daemon", "--session", "--nofork",
+                    "--print-address", NULL };
+  GIOChannel *channel;
+  GError *error = NULL;
+  gchar *address = NULL;
+  GPid pid;
+  gint out;
+
+  if (!g_spawn_async_with_pipes (NULL, argv, NULL, G_SPAWN_SEARCH_PATH,
+                                 NULL, NULL, &pid, NULL, &out, NULL,
+                                 &error))
+    g_error ("Can't start dbus-daemon: %s", error->message);
+
+  channel = g_io_channel_unix_new (out);
+  g_io_channel_read_line (channel, &address, NULL, NULL, NULL);
+  g_io_channel_unref (channel);
+  if (!address)
+    g_error ("dbus-daemon didn't tell its address");
+
+  g_strchomp (address);
+  g_setenv ("DBUS_SESSION_BUS_ADDRESS", address, TRUE);
+  g_setenv ("DBUS_SYSTEM_BUS_ADDRESS", address, TRUE);
+  g_free (address);
+
+  return pid;
+}
+
+/* Removes what the notification manager left in @home. */
+static void
+bench_clean_home (const gchar *home)
+{
+  static const gchar *files[] =
+    { "notifications.db", "notifications.db-wal", "notifications.db-shm",
+      "notifications.db-journal", NULL };
+  gchar *dir, *path;
+  guint i;
+
+  dir = g_build_filename (home, ".config", "hildon-desktop", NULL);
+  for (i = 0; files[i]; i++)
+    {
+      path = g_build_filename (dir, files[i], NULL);
+      g_unlink (path);
+      g_free (path);
+    }
+  g_rmdir (dir);
+  g_free (dir);
+
+  dir = g_build_filename (home, ".config", NULL);
+  g_rmdir (dir);
+  g_free (dir);
+  g_rmdir (home);
+}
+
+int
+main (int argc, char **argv)
+{
+  HDNotificationManager *nm;
+  HDNotificationManagerDbStats stats;
+  GOptionContext *context;
+  DBusGConnection *bus;
+  BenchPhase notify_phase = { "Notify" };
+  BenchPhase close_phase = { "CloseNotification" };
+  GError *error = NULL;
+  gchar *home;
+  GPid daemon;
+
+  context = g_option_context_new ("- benchmark the notification manager");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+  g_option_context_free (context);
+  if (count < 1 || window < 1)
+    {
+      g_printerr ("--count and --window must be positive\n");
+      return 1;
+    }
+
+  /* The database is created under $HOME, don't touch the real one. */
+  home = g_dir_make_tmp ("hd-notification-benchmark-XXXXXX", &error);
+  if (!home)
+    g_error ("%s", error->message);
+  g_setenv ("HOME", home, TRUE);
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+  g_type_init ();
+#endif
+
+  daemon = bench_start_bus ();
+  loop = g_main_loop_new (NULL, FALSE);
+  nm = hd_notification_manager_get ();
+
+  bus = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
+  if (!bus)
+    g_error ("%s", error->message);
+  proxy = dbus_g_proxy_new_for_name (bus, BENCH_DBUS_NAME, BENCH_DBUS_PATH,
+                                     BENCH_DBUS_IFACE);
+  hints_type = dbus_g_type_get_map ("GHashTable", G_TYPE_STRING,
+                                    G_TYPE_VALUE);
+  ids = g_new0 (guint, count);
+
+  g_print ("%d notifications, %d in flight, %d%% persistent, "
+           "%d extra hints\n", count, window, persistent, extra_hints);
+#ifdef BENCH_COUNT_ALLOCATIONS
+  if (glib_check_version (2, 76, 0) &&
+      g_strcmp0 (g_getenv ("G_SLICE"), "always-malloc"))
+    g_print ("Run with G_SLICE=always-malloc to count the GSlice "
+             "allocations too\n");
+#endif
+
+  bench_run (&notify_phase);
+  if (!keep_open)
+    bench_run (&close_phase);
+
+  /* Wait for the writer so the counters are final. */
+  hd_notification_manager_db_flush (nm);
+  hd_notification_manager_db_get_stats (nm, &stats);
+  g_print ("database: %u commits, %u rollbacks, %u units, "
+           "largest batch %u, oldest transaction %.1f ms\n",
+           stats.commits, stats.rollbacks, stats.units,
+           stats.max_batch, stats.max_age / 1000.0);
+
+  g_object_unref (proxy);
+  g_object_unref (nm);
+  g_free (ids);
+  g_main_loop_unref (loop);
+
+  kill (daemon, SIGTERM);
+  g_spawn_close_pid (daemon);
+  bench_clean_home (home);
+  g_free (home);
+
+  return 0;
+}
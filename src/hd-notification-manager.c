@@ -32,8 +32,10 @@
 
 #include "hd-notification-manager.h"
 #include "hd-notification-manager-glue.h"
+#include "hd-command-thread-pool.h"
 #include "hd-marshal.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <gtk/gtk.h>
@@ -62,10 +64,13 @@
 #define DB_BIND_FLOAT(val)              G_TYPE_FLOAT,   val
 #define DB_BIND_UCHAR(val)              G_TYPE_UCHAR,   val
 #define DB_BIND_INT64(val)              G_TYPE_INT64,   val
+#define DB_BIND_VARIANT(val)            G_TYPE_VARIANT, val
 #define DB_BIND_END                     G_TYPE_INVALID
 
 enum {
     NOTIFIED,
+    REPLAY_BEGIN,
+    REPLAY_END,
     N_SIGNALS
 };
 
@@ -76,6 +81,81 @@ static guint signals[N_SIGNALS];
 
 #define HD_NOTIFICATION_MANAGER_ICON_SIZE  48
 
+/* Where the database tuning parameters are read from and their
+ * defaults.  See notification.conf for their meaning. */
+#define HD_NOTIFICATION_MANAGER_CONF       HD_DESKTOP_CONFIG_PATH "/notification.conf"
+#define HD_NOTIFICATION_MANAGER_CONF_GROUP "Database"
+#define HD_NM_DEFAULT_JOURNAL_MODE         "WAL"
+#define HD_NM_DEFAULT_SYNCHRONOUS          "NORMAL"
+#define HD_NM_DEFAULT_COMMIT_LATENCY       10
+#define HD_NM_DEFAULT_COMMIT_IDLE          2
+#define HD_NM_DEFAULT_COMMIT_BATCH         32
+
+/* The most D-Bus callback descriptors we keep compiled. */
+#define HD_NM_MAX_CACHED_CALLS             64
+
+/*
+ * The layout of the database, stored as its user_version.  In version
+ * 0 every action and hint of a notification was a row of its own in
+ * the actions and hints tables.  Since version 1 they are serialized
+ * together into the payload column of the notification, with this
+ * #GVariant type: the flat list of action IDs and labels, then the
+ * hints.
+ */
+#define HD_NM_SCHEMA_VERSION               1
+#define HD_NM_PAYLOAD_TYPE                 "(asa{sv})"
+
+/* Indices of the prepared statements in @statements. */
+enum
+{
+  HD_NM_STMT_BEGIN,
+  HD_NM_STMT_COMMIT,
+  HD_NM_STMT_ROLLBACK,
+  HD_NM_STMT_SAVEPOINT,
+  HD_NM_STMT_RELEASE,
+  HD_NM_STMT_ROLLBACK_TO,
+  HD_NM_STMT_SELECT_NOTIFICATIONS,
+  HD_NM_STMT_INSERT_NOTIFICATION,
+  HD_NM_STMT_UPDATE_NOTIFICATION,
+  HD_NM_STMT_DELETE_NOTIFICATION,
+  HD_NM_N_STATEMENTS
+};
+
+/* The SQL text of the statements above. */
+static const gchar *const statements_sql[HD_NM_N_STATEMENTS] =
+{
+  [HD_NM_STMT_BEGIN]                = "BEGIN",
+  [HD_NM_STMT_COMMIT]               = "COMMIT",
+  [HD_NM_STMT_ROLLBACK]             = "ROLLBACK",
+  [HD_NM_STMT_SAVEPOINT]            = "SAVEPOINT willie",
+  [HD_NM_STMT_RELEASE]              = "RELEASE willie",
+  [HD_NM_STMT_ROLLBACK_TO]          = "ROLLBACK TO willie",
+  [HD_NM_STMT_SELECT_NOTIFICATIONS] =
+    "SELECT id, icon_name, summary, body, timeout, dest, payload "
+    "FROM notifications ORDER BY id",
+  [HD_NM_STMT_INSERT_NOTIFICATION]  =
+    "INSERT INTO notifications "
+    "(id, app_name, icon_name, summary, body, timeout, dest, payload) "
+    "VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+  [HD_NM_STMT_UPDATE_NOTIFICATION]  =
+    "UPDATE notifications SET "
+    "  app_name = ?, icon_name = ?, "
+    "  summary = ?, body = ?, timeout = ?, payload = ? "
+    "WHERE id = ?",
+  [HD_NM_STMT_DELETE_NOTIFICATION]  =
+    "DELETE FROM notifications WHERE id = ?",
+};
+
+/* Statements of schema version 0, only used to migrate from it. */
+#define HD_NM_V0_SELECT_NOTIFICATIONS \
+  "SELECT id FROM notifications ORDER BY id"
+#define HD_NM_V0_SELECT_ACTIONS \
+  "SELECT nid, id, label FROM actions ORDER BY nid, rowid"
+#define HD_NM_V0_SELECT_HINTS \
+  "SELECT nid, id, type, value FROM hints ORDER BY nid"
+#define HD_NM_V0_UPDATE_PAYLOAD \
+  "UPDATE notifications SET payload = ? WHERE id = ?"
+
 struct _HDNotificationManagerPrivate
 {
   DBusGConnection *connection, *sys_conn;
@@ -84,41 +164,82 @@ struct _HDNotificationManagerPrivate
   GHashTable      *notifications;
 
   /*
-   * @prepared_statements is a map between SQL statement strings
-   * and SQLite prepared statements.  Can be %NULL.  Destroying
-   * the hash table destroys all the prepared statements.
-   * @db should be valid as long as the hash table is not empty.
+   * @calls caches the #HDNotificationCall:s compiled from the D-Bus
+   * callback descriptions of the notifications, keyed by the
+   * description.  Descriptions which failed to compile map to %NULL.
+   * Emptied when it reaches %HD_NM_MAX_CACHED_CALLS.
+   */
+  GHashTable      *calls;
+
+  /*
+   * @used_ids is a sorted array of disjoint #HDNotificationIdRange:s
+   * covering every ID which is taken, either by a notification we
+   * manage or by one in the database.  It is seeded by
+   * hd_notification_manager_db_load() and kept up to date as
+   * notifications come and go, so allocating a new ID doesn't need
+   * to consult the database.  Protected by @mutex.
+   */
+  GArray          *used_ids;
+
+  /*
+   * @statements are all the SQL statements we ever execute, compiled
+   * by hd_notification_manager_db_prepare_all() when the database is
+   * opened and indexed by %HD_NM_STMT_*.  They are finalized before
+   * @db is closed.
+   *
+   * Except for hd_notification_manager_db_load() at startup @db is
+   * only used by the @db_writer thread, which executes the
+   * #HDNotificationDbRequest:s queued by the main thread one after
+   * the other, so D-Bus calls never wait for the disk.
    *
-   * Database modifications are done in a common transaction.
-   * After a modification is complete a COMMIT is scheduled
-   * at @commit_timeout.  If there are more modifications until
-   * that time COMMIT is further deferred.  This may lead to
-   * starvation.
+   * Database modifications are done in a common transaction
+   * opened at @txn_opened, which is committed when any of these
+   * happens first:
+   * -- no modification has been made for @commit_idle seconds,
+   * -- the transaction has been open for @commit_latency seconds,
+   * -- @commit_batch units of work have been done in it.
+   * The last one happens right away, the others are timed by a
+   * single one-shot timeout which is re-armed after every unit
+   * of work.  No work stays uncommitted for longer than
+   * @commit_latency, however steady the stream of modifications.
+   * These are maintained by the main thread as it queues the work.
    *
    * @commit_callback is the #GSource ID of the deferred committing
-   * function.  If not 0 a transaction is open.  This case the
-   * function must be called when hildon-home quits.
+   * function.  If not 0 a transaction is open.  This case it must
+   * be committed with hd_notification_manager_db_flush() when
+   * hildon-home quits.
+   *
+   * @writer_in_txn, @writer_opened and @writer_units describe the
+   * transaction as the writer thread sees it and are only touched
+   * by that thread.
+   *
+   * @wal is whether the database is in write-ahead-log mode.
+   * @stats are the counters hd_notification_manager_db_get_stats()
+   * returns.  The writer updates them holding @mutex.
    */
   sqlite3         *db;
-  GHashTable      *prepared_statements;
-  time_t           commit_timeout;
+  sqlite3_stmt    *statements[HD_NM_N_STATEMENTS];
+  HDCommandThreadPool *db_writer;
+  guint            commit_latency;
+  guint            commit_idle;
+  guint            commit_batch;
+  gint64           txn_opened;
+  guint            txn_units;
   gulong           commit_callback;
+  gboolean         writer_in_txn;
+  gint64           writer_opened;
+  guint            writer_units;
+  gboolean         wal : 1;
+
+  HDNotificationManagerDbStats stats;
 
 };
 
 G_DEFINE_TYPE_WITH_CODE (HDNotificationManager, hd_notification_manager, G_TYPE_OBJECT, G_ADD_PRIVATE(HDNotificationManager));
 
 
-/* IPC structure between _insert_hints() and _insert_hint(). */
-typedef struct 
-{
-  /* @stmt is the prepared statement to insert the hint with. */
-  sqlite3_stmt *stmt;
-  gint          id;
-  gint          result;
-} HildonNotificationHintInfo;
-
-/* Notification hint value type codes, as used in the database.
+/* Notification hint value type codes, as used in version 0 of the
+ * database.
  * For upgrade compatibility with ourselves new values should be
  * added at the end and existing ones should not be changed. */
 enum
@@ -138,221 +259,225 @@ hint_value_free (GValue *value)
   g_free (value);
 }
 
-static guint
-hd_notification_manager_next_id (HDNotificationManager *nm)
+/*
+ * The same few hint names are used by every notification rebuilt by
+ * hd_notification_manager_db_load(), so their hint tables share pooled
+ * copies of them rather than having one of each per notification.
+ * @hint_names maps the pooled names to their reference counts.  It is
+ * only used on the main thread, like the notifications themselves.
+ */
+static GHashTable *hint_names = NULL;
+
+static gchar *
+hint_name_ref (const gchar *name)
 {
-  guint next_id;
-  char *sql;
-  gint nrow = 0, ncol;
-  char **results;
-  char *error;
+  gpointer pooled, count;
 
-  g_mutex_lock (nm->priv->mutex);
+  if (G_UNLIKELY (!hint_names))
+    hint_names = g_hash_table_new (g_str_hash, g_str_equal);
 
-  do
+  if (g_hash_table_lookup_extended (hint_names, name, &pooled, &count))
+    g_hash_table_insert (hint_names, pooled,
+                         GUINT_TO_POINTER (GPOINTER_TO_UINT (count) + 1));
+  else
     {
-      next_id = ++nm->priv->current_id;
-
-      if (nm->priv->db)
-        {
-          sql = sqlite3_mprintf ("SELECT id FROM notifications WHERE id=%d",
-                                 next_id);
-
-          error = NULL;
-          sqlite3_get_table (nm->priv->db, sql,
-                             &results, &nrow, &ncol, &error);
-
-          sqlite3_free_table (results);
-          sqlite3_free (sql); 
-          if (error)
-            {
-              g_warning ("%s: SQL error: %s", __func__, error);
-              sqlite3_free (error);
-            }
-        }
+      pooled = g_strdup (name);
+      g_hash_table_insert (hint_names, pooled, GUINT_TO_POINTER (1));
     }
-  while (nrow > 0);
 
-  if (nm->priv->current_id == G_MAXUINT)
-    nm->priv->current_id = 0;
+  return pooled;
+}
 
-  g_mutex_unlock (nm->priv->mutex);
+static void
+hint_name_unref (gchar *pooled)
+{
+  guint count;
 
-  return next_id;
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (hint_names, pooled));
+  g_return_if_fail (count > 0);
+
+  if (count > 1)
+    g_hash_table_insert (hint_names, pooled, GUINT_TO_POINTER (count - 1));
+  else
+    {
+      g_hash_table_remove (hint_names, pooled);
+      g_free (pooled);
+    }
 }
 
-static int 
-hd_notification_manager_load_hint (void *data, 
-                                   gint argc, 
-                                   gchar **argv, 
-                                   gchar **col_name)
+/*
+ * Returns an empty hint table keyed by pooled names.  Its keys must
+ * only ever come from hint_name_ref(): any other string would be
+ * released as a pooled name when it is removed.
+ */
+static GHashTable *
+hd_notification_manager_hints_new (void)
 {
-  GHashTable *hints = (GHashTable *) data;
-  GValue *value;
-  gint type;
+  return g_hash_table_new_full (g_str_hash,
+                                g_str_equal,
+                                (GDestroyNotify) hint_name_unref,
+                                (GDestroyNotify) hint_value_free);
+}
 
-  type = (guint) g_ascii_strtod (argv[1], NULL);
+/* An inclusive range of notification IDs in @used_ids. */
+typedef struct
+{
+  guint first;
+  guint last;
+} HDNotificationIdRange;
 
-  value = g_new0 (GValue, 1);
+/* Returns the index of the first range in @used_ids which ends at
+ * or after @id, or the length of the array if there is no such. */
+static guint
+hd_notification_manager_ids_search (GArray *used_ids,
+                                    guint   id)
+{
+  guint lo, hi, mid;
 
-  switch (type)
+  lo = 0;
+  hi = used_ids->len;
+  while (lo < hi)
     {
-    case HD_NM_HINT_TYPE_STRING:
-      g_value_init (value, G_TYPE_STRING);
-      g_value_set_string (value, argv[2]);
-      break;
+      mid = lo + (hi - lo) / 2;
+      if (g_array_index (used_ids, HDNotificationIdRange, mid).last < id)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
 
-    case HD_NM_HINT_TYPE_INT:
-        {
-          gint value_i;
+  return lo;
+}
 
-          sscanf (argv[2], "%d", &value_i);
-          g_value_init (value, G_TYPE_INT);
-          g_value_set_int (value, value_i);
-          break;
-        }
-    case HD_NM_HINT_TYPE_INT64:
-        {
-          gint64 value_i64;
+/* Marks @id as taken, merging it with the adjacent ranges. */
+static void
+hd_notification_manager_ids_add (GArray *used_ids,
+                                 guint   id)
+{
+  HDNotificationIdRange *range, *prev, new_range;
+  guint i;
 
-          sscanf (argv[2], G_GINT64_FORMAT, &value_i64);
-          g_value_init (value, G_TYPE_INT64);
-          g_value_set_int64 (value, value_i64);
-          break;
-        }
-    case HD_NM_HINT_TYPE_FLOAT:
-        {
-          gfloat value_f;
+  i = hd_notification_manager_ids_search (used_ids, id);
+  prev = i > 0
+    ? &g_array_index (used_ids, HDNotificationIdRange, i - 1)
+    : NULL;
+  range = i < used_ids->len
+    ? &g_array_index (used_ids, HDNotificationIdRange, i)
+    : NULL;
 
-          sscanf (argv[2], "%f", &value_f);
-          g_value_init (value, G_TYPE_FLOAT);
-          g_value_set_float (value, value_f);
-          break;
-        }
-    case HD_NM_HINT_TYPE_UCHAR:
-        {
-          guchar value_c;
+  if (range && range->first <= id)
+    /* Already taken. */
+    return;
 
-          sscanf (argv[2], "%c", &value_c);
-          g_value_init (value, G_TYPE_UCHAR);
-          g_value_set_uchar (value, value_c);
-          break;
+  if (range && range->first == id + 1)
+    { /* Extend @range downwards, maybe joining it with the previous one. */
+      range->first = id;
+      if (prev && prev->last + 1 == id)
+        {
+          prev->last = range->last;
+          g_array_remove_index (used_ids, i);
         }
+      return;
     }
 
-  g_hash_table_insert (hints, g_strdup (argv[0]), value);
+  if (prev && prev->last + 1 == id)
+    { /* Extend the previous range upwards. */
+      prev->last = id;
+      return;
+    }
 
-  return 0;
+  new_range.first = new_range.last = id;
+  g_array_insert_val (used_ids, i, new_range);
 }
 
-static int 
-hd_notification_manager_load_action (void *data, 
-                                     gint argc, 
-                                     gchar **argv, 
-                                     gchar **col_name)
+/* Marks @id as free again, splitting its range if necessary. */
+static void
+hd_notification_manager_ids_remove (GArray *used_ids,
+                                    guint   id)
 {
-  GArray *actions = (GArray *) data;
+  HDNotificationIdRange *range, new_range;
+  guint i;
+
+  i = hd_notification_manager_ids_search (used_ids, id);
+  if (i >= used_ids->len)
+    return;
 
-  g_array_append_val (actions, argv[0]);
-  g_array_append_val (actions, argv[1]);
+  range = &g_array_index (used_ids, HDNotificationIdRange, i);
+  if (range->first > id)
+    /* Not taken. */
+    return;
 
-  return 0;
+  if (range->first == range->last)
+    g_array_remove_index (used_ids, i);
+  else if (range->first == id)
+    range->first++;
+  else if (range->last == id)
+    range->last--;
+  else
+    { /* Split @range in two around @id. */
+      new_range.first = id + 1;
+      new_range.last  = range->last;
+      range->last     = id - 1;
+      g_array_insert_val (used_ids, i + 1, new_range);
+    }
 }
 
-static int 
-hd_notification_manager_load_row (void *data, 
-                                  gint argc, 
-                                  gchar **argv, 
-                                  gchar **col_name)
+static void
+hd_notification_manager_release_id (HDNotificationManager *nm,
+                                    guint                  id)
 {
-  HDNotificationManager *nm;
-  GHashTable *hints;
-  GValue *hint;
-  GArray *actions;
-  gchar *sql;
-  gchar *error = NULL;
-  guint id;
-  HDNotification *notification;
-
-  nm = HD_NOTIFICATION_MANAGER (data);
-
-  id = (guint) g_ascii_strtod (argv[0], NULL);
+  g_mutex_lock (nm->priv->mutex);
+  hd_notification_manager_ids_remove (nm->priv->used_ids, id);
+  g_mutex_unlock (nm->priv->mutex);
+}
 
-  actions = g_array_new (TRUE, FALSE, sizeof (gchar *)); 
+static guint
+hd_notification_manager_next_id (HDNotificationManager *nm)
+{
+  HDNotificationIdRange *range;
+  gboolean wrapped;
+  guint next_id, i;
 
-  sql = sqlite3_mprintf ("SELECT * FROM actions WHERE nid=%d", id);
+  g_mutex_lock (nm->priv->mutex);
 
-  if (sqlite3_exec (nm->priv->db, 
-                    sql,
-                    hd_notification_manager_load_action,
-                    actions,
-                    &error) != SQLITE_OK)
+  /* Take the first free ID after @current_id, skipping whole ranges
+   * of taken ones.  0 is not a valid ID. */
+  wrapped = FALSE;
+  for (;;)
     {
-      g_warning ("Unable to load actions: %s", error);
-      sqlite3_free (error);
-    }
-
-  sqlite3_free (sql);
-
-  hints = g_hash_table_new_full (g_str_hash, 
-                                 g_str_equal,
-                                 (GDestroyNotify) g_free,
-                                 (GDestroyNotify) hint_value_free);
-
-  hint = g_new0 (GValue, 1);
-  hint = g_value_init (hint, G_TYPE_UCHAR);
-  g_value_set_uchar (hint, TRUE);
+      if (nm->priv->current_id == G_MAXUINT)
+        {
+          if (wrapped)
+            { /* Every single ID is taken, which is rather unlikely. */
+              g_critical ("%s: ran out of notification IDs", __func__);
+              nm->priv->current_id = 0;
+              g_mutex_unlock (nm->priv->mutex);
+              return 0;
+            }
+          nm->priv->current_id = 0;
+          wrapped = TRUE;
+        }
 
-  g_hash_table_insert (hints, g_strdup("persistent"), hint);
+      next_id = nm->priv->current_id + 1;
+      i = hd_notification_manager_ids_search (nm->priv->used_ids, next_id);
+      if (i >= nm->priv->used_ids->len)
+        break;
 
-  sql = sqlite3_mprintf ("SELECT * FROM hints WHERE nid=%d", id);
+      range = &g_array_index (nm->priv->used_ids, HDNotificationIdRange, i);
+      if (range->first > next_id)
+        break;
 
-  if (sqlite3_exec (nm->priv->db, 
-                    sql,
-                    hd_notification_manager_load_hint,
-                    hints,
-                    &error) != SQLITE_OK)
-    {
-      g_warning ("Unable to load hints: %s", error);
-      sqlite3_free (error);
+      nm->priv->current_id = range->last;
     }
 
-  sqlite3_free (sql);
-
-  notification = hd_notification_new (id,
-                                      argv[2],
-                                      argv[3],
-                                      argv[4],
-                                      (gchar **) g_array_free (actions, FALSE),
-                                      hints,
-                                      (gint) g_ascii_strtod (argv[5], NULL),
-                                      argv[6]);
-
-  g_hash_table_insert (nm->priv->notifications,
-                       GUINT_TO_POINTER (id),
-                       notification);
-
-  g_signal_emit (nm, signals[NOTIFIED], 0, notification, TRUE);
-
-  return 0;
-}
+  next_id = ++nm->priv->current_id;
+  hd_notification_manager_ids_add (nm->priv->used_ids, next_id);
 
-void 
-hd_notification_manager_db_load (HDNotificationManager *nm)
-{
-  gchar *error = NULL;
+  if (nm->priv->current_id == G_MAXUINT)
+    nm->priv->current_id = 0;
 
-  g_return_if_fail (nm->priv->db != NULL);
+  g_mutex_unlock (nm->priv->mutex);
 
-  if (sqlite3_exec (nm->priv->db, 
-                    "SELECT * FROM notifications",
-                    hd_notification_manager_load_row,
-                    nm,
-                    &error) != SQLITE_OK)
-    {
-      g_warning ("Unable to load notifications: %s", error);
-      sqlite3_free (error);
-    }
+  return next_id;
 }
 
 static gint 
@@ -379,42 +504,62 @@ hd_notification_manager_db_exec (HDNotificationManager *nm,
 }
 
 /*
- * Prepares and caches an SQL query.  You should not finalize the
- * returned statement.  Returns %NULL on error.  Prepared statements
- * can be executed with hd_notification_manager_db_exec_prepared().
- * For the caching to be effective @sql should be a string literal.
+ * Compiles all of %statements_sql.  Must be called after the tables
+ * have been created.  Returns %SQLITE_OK if all of them could be
+ * prepared.
  */
-static sqlite3_stmt *
-hd_notification_manager_db_prepare (HDNotificationManager *nm,
-                                    const gchar           *sql)
+static gint
+hd_notification_manager_db_prepare_all (HDNotificationManager *nm)
 {
+  guint i;
   gint ret;
-  sqlite3_stmt *stmt;
 
-  if (G_UNLIKELY (!nm->priv->prepared_statements))
-    /* We can use `direct' operations on the key because we know
-     * they will be string literals. */
-    nm->priv->prepared_statements = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-                                                           NULL, (GDestroyNotify) sqlite3_finalize);
-  else if ((stmt = g_hash_table_lookup (nm->priv->prepared_statements, sql)))
-    return stmt;
+  g_return_val_if_fail (nm->priv->db != NULL, SQLITE_ERROR);
 
-  g_return_val_if_fail (nm->priv->db != NULL, NULL);
-  if ((ret = sqlite3_prepare_v2 (nm->priv->db, sql, -1,
-                                 &stmt, NULL)) != SQLITE_OK)
-    g_critical ("sqlite3_prepare_v2(%s): %d", sql, ret);
+  for (i = 0; i < HD_NM_N_STATEMENTS; i++)
+    if ((ret = sqlite3_prepare_v2 (nm->priv->db, statements_sql[i], -1,
+                                   &nm->priv->statements[i],
+                                   NULL)) != SQLITE_OK)
+      {
+        g_critical ("sqlite3_prepare_v2(%s): %d", statements_sql[i], ret);
+        return ret;
+      }
 
-  g_hash_table_insert (nm->priv->prepared_statements,
-                       (gpointer) sql,
-                       stmt);
+  return SQLITE_OK;
+}
 
-  return stmt;
+/* Finalizes what hd_notification_manager_db_prepare_all() prepared. */
+static void
+hd_notification_manager_db_finalize_all (HDNotificationManager *nm)
+{
+  guint i;
+
+  for (i = 0; i < HD_NM_N_STATEMENTS; i++)
+    if (nm->priv->statements[i])
+      {
+        sqlite3_finalize (nm->priv->statements[i]);
+        nm->priv->statements[i] = NULL;
+      }
+}
+
+/*
+ * Returns the prepared statement @which (one of %HD_NM_STMT_*).
+ * You should not finalize the returned statement.  Returns %NULL
+ * if the database is not available.  Prepared statements can be
+ * executed with hd_notification_manager_db_exec_prepared().
+ */
+static inline sqlite3_stmt *
+hd_notification_manager_db_prepare (HDNotificationManager *nm,
+                                    guint                  which)
+{
+  return nm->priv->statements[which];
 }
 
 /*
  * Wrapper around sqlite3_bind_*() to bind actual parameters to @stmt.
  * The arguments are %GType--value pairs, terminated by a %G_TYPE_INVALID.
- * Only INT:s, STRING:s, FLOAT:s and UCHAR:s are handled.  Use %DB_BIND_*()
+ * Only INT:s, STRING:s, FLOAT:s, UCHAR:s and VARIANT:s are handled.
+ * #GVariant:s are bound as BLOB:s of their serialized data.  Use %DB_BIND_*()
  * to specify the parameter values.  Returns an sqlite status code.
  */
 static gint
@@ -447,6 +592,13 @@ hd_notification_manager_db_bind_params (sqlite3_stmt *stmt, ...)
     else if (type == G_TYPE_UCHAR)
       /* Same for guchar -> int. */
       ret = sqlite3_bind_int (stmt, i, va_arg (types, gint));
+    else if (type == G_TYPE_VARIANT)
+      {
+        GVariant *variant = va_arg (types, GVariant *);
+        ret = sqlite3_bind_blob (stmt, i, g_variant_get_data (variant),
+                                 g_variant_get_size (variant),
+                                 SQLITE_TRANSIENT);
+      }
     else
       g_assert_not_reached();
   va_end (types);
@@ -474,54 +626,353 @@ hd_notification_manager_db_exec_prepared (sqlite3_stmt *stmt)
   return ret;
 }
 
-/* Prepare, cache and execute @sql. */
+/* Execute the prepared statement @which. */
 static gint
 hd_notification_manager_db_prepare_and_exec (HDNotificationManager *nm,
-                                             const gchar           *sql)
+                                             guint                  which)
 {
   return hd_notification_manager_db_exec_prepared (
-                          hd_notification_manager_db_prepare (nm, sql));
+                          hd_notification_manager_db_prepare (nm, which));
 }
 
-/* #GSourceFunc to COMMIT an active transaction. */
-static gboolean
+/* Returns @value as a #GVariant of the payload, or %NULL if its type
+ * is not one we know how to store. */
+static GVariant *
+hd_notification_manager_hint_to_variant (const GValue *value)
+{
+  const gchar *str;
+
+  switch (G_VALUE_TYPE (value))
+    {
+    case G_TYPE_STRING:
+      str = g_value_get_string (value);
+      return g_variant_new_string (str ? str : "");
+    case G_TYPE_INT:
+      return g_variant_new_int32 (g_value_get_int (value));
+    case G_TYPE_INT64:
+      return g_variant_new_int64 (g_value_get_int64 (value));
+    case G_TYPE_FLOAT:
+      return g_variant_new_double (g_value_get_float (value));
+    case G_TYPE_UCHAR:
+      return g_variant_new_byte (g_value_get_uchar (value));
+    default:
+      return NULL;
+    }
+}
+
+/* The opposite of hd_notification_manager_hint_to_variant(). */
+static GValue *
+hd_notification_manager_hint_from_variant (GVariant *variant)
+{
+  GValue *value;
+
+  value = g_new0 (GValue, 1);
+  switch (g_variant_classify (variant))
+    {
+    case G_VARIANT_CLASS_STRING:
+      g_value_init (value, G_TYPE_STRING);
+      g_value_set_string (value, g_variant_get_string (variant, NULL));
+      break;
+    case G_VARIANT_CLASS_INT32:
+      g_value_init (value, G_TYPE_INT);
+      g_value_set_int (value, g_variant_get_int32 (variant));
+      break;
+    case G_VARIANT_CLASS_INT64:
+      g_value_init (value, G_TYPE_INT64);
+      g_value_set_int64 (value, g_variant_get_int64 (variant));
+      break;
+    case G_VARIANT_CLASS_DOUBLE:
+      g_value_init (value, G_TYPE_FLOAT);
+      g_value_set_float (value, g_variant_get_double (variant));
+      break;
+    case G_VARIANT_CLASS_BYTE:
+      g_value_init (value, G_TYPE_UCHAR);
+      g_value_set_uchar (value, g_variant_get_byte (variant));
+      break;
+    default:
+      g_free (value);
+      return NULL;
+    }
+
+  return value;
+}
+
+/*
+ * Serializes @actions and @hints into a %HD_NM_PAYLOAD_TYPE #GVariant,
+ * to be stored in the payload column of the notification.  Hints of
+ * unknown type are left out.
+ */
+static GVariant *
+hd_notification_manager_db_encode (guint        id,
+                                   gchar      **actions,
+                                   GHashTable  *hints)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+  GVariant *hint;
+  guint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (HD_NM_PAYLOAD_TYPE));
+
+  g_variant_builder_open (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+  for (i = 0; actions && actions[i] != NULL && actions[i+1] != NULL; i += 2)
+    {
+      g_variant_builder_add (&builder, "s", actions[i]);
+      g_variant_builder_add (&builder, "s", actions[i+1]);
+    }
+  g_variant_builder_close (&builder);
+
+  g_variant_builder_open (&builder, G_VARIANT_TYPE_VARDICT);
+  g_hash_table_iter_init (&iter, hints);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    if ((hint = hd_notification_manager_hint_to_variant (value)) != NULL)
+      g_variant_builder_add (&builder, "{sv}", key, hint);
+    else
+      g_warning ("Hint `%s' of notification %u has invalid value type %u",
+                 (const gchar *) key, id,
+                 (unsigned int) G_VALUE_TYPE (value));
+  g_variant_builder_close (&builder);
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/*
+ * Deserializes the payload in @column of the current row of @select.
+ * Adds the hints to @hints, which must be keyed by pooled names, and
+ * returns the actions.  A missing or corrupt payload reads as no
+ * actions and no hints.
+ */
+static gchar **
+hd_notification_manager_db_decode (sqlite3_stmt *select,
+                                   gint          column,
+                                   GHashTable   *hints)
+{
+  GBytes *bytes;
+  GVariant *payload, *dict, *variant;
+  GVariantIter iter;
+  const gchar *key;
+  GValue *value;
+  gchar **actions;
+
+  /* Copy the blob, which is not necessarily aligned suitably. */
+  bytes = g_bytes_new (sqlite3_column_blob (select, column),
+                       sqlite3_column_bytes (select, column));
+  payload = g_variant_ref_sink (g_variant_new_from_bytes (
+                       G_VARIANT_TYPE (HD_NM_PAYLOAD_TYPE), bytes, FALSE));
+  g_bytes_unref (bytes);
+
+  g_variant_get (payload, "(^as@a{sv})", &actions, &dict);
+
+  g_variant_iter_init (&iter, dict);
+  while (g_variant_iter_next (&iter, "{&sv}", &key, &variant))
+    {
+      if ((value = hd_notification_manager_hint_from_variant (variant)))
+        g_hash_table_insert (hints, hint_name_ref (key), value);
+      g_variant_unref (variant);
+    }
+
+  g_variant_unref (dict);
+  g_variant_unref (payload);
+
+  return actions;
+}
+
+/* Adds the hint in the current row of @select to @hints.
+ * The hint's name, type and value are expected in columns 1..3. */
+static void
+hd_notification_manager_db_load_hint (sqlite3_stmt *select,
+                                      GHashTable   *hints)
+{
+  GValue *value;
+
+  value = g_new0 (GValue, 1);
+
+  switch (sqlite3_column_int (select, 2))
+    {
+    case HD_NM_HINT_TYPE_STRING:
+      g_value_init (value, G_TYPE_STRING);
+      g_value_set_string (value,
+                          (const gchar *) sqlite3_column_text (select, 3));
+      break;
+    case HD_NM_HINT_TYPE_INT:
+      g_value_init (value, G_TYPE_INT);
+      g_value_set_int (value, sqlite3_column_int (select, 3));
+      break;
+    case HD_NM_HINT_TYPE_INT64:
+      g_value_init (value, G_TYPE_INT64);
+      g_value_set_int64 (value, sqlite3_column_int64 (select, 3));
+      break;
+    case HD_NM_HINT_TYPE_FLOAT:
+      g_value_init (value, G_TYPE_FLOAT);
+      g_value_set_float (value, sqlite3_column_double (select, 3));
+      break;
+    case HD_NM_HINT_TYPE_UCHAR:
+      g_value_init (value, G_TYPE_UCHAR);
+      g_value_set_uchar (value, sqlite3_column_int (select, 3));
+      break;
+    }
+
+  g_hash_table_insert (hints,
+             g_strdup ((const gchar *) sqlite3_column_text (select, 1)),
+             value);
+}
+
+/*
+ * Steps @select, whose first column is a notification ID, past the rows
+ * of notifications before @id.  Returns the last sqlite3_step() result;
+ * if it is %SQLITE_ROW @select is positioned at the first row with an ID
+ * not less than @id.  @ret is the result of the previous step.
+ */
+static gint
+hd_notification_manager_db_skip_to (sqlite3_stmt *select,
+                                    gint          ret,
+                                    gint          id)
+{
+  while (ret == SQLITE_ROW && sqlite3_column_int (select, 0) < id)
+    ret = sqlite3_step (select);
+  return ret;
+}
+
+/*
+ * Loads all persistent notifications with a single query.  Their
+ * actions and hints come in the payload column.
+ */
+void 
+hd_notification_manager_db_load (HDNotificationManager *nm)
+{
+  sqlite3_stmt *select;
+  GPtrArray *loaded;
+  HDNotification *notification;
+  GHashTable *hints;
+  GValue *hint;
+  gchar **actionv;
+  gint ret;
+  guint i;
+
+  g_return_if_fail (nm->priv->db != NULL);
+
+  select = hd_notification_manager_db_prepare (nm,
+                                     HD_NM_STMT_SELECT_NOTIFICATIONS);
+  g_return_if_fail (select != NULL);
+
+  loaded = g_ptr_array_new ();
+  while ((ret = sqlite3_step (select)) == SQLITE_ROW)
+    {
+      hints = hd_notification_manager_hints_new ();
+      actionv = hd_notification_manager_db_decode (select, 6, hints);
+
+      hint = g_new0 (GValue, 1);
+      hint = g_value_init (hint, G_TYPE_UCHAR);
+      g_value_set_uchar (hint, TRUE);
+
+      g_hash_table_insert (hints, hint_name_ref ("persistent"), hint);
+
+      notification = hd_notification_new (
+                            (guint) sqlite3_column_int (select, 0),
+                            (const gchar *) sqlite3_column_text (select, 1),
+                            (const gchar *) sqlite3_column_text (select, 2),
+                            (const gchar *) sqlite3_column_text (select, 3),
+                            actionv,
+                            hints,
+                            sqlite3_column_int (select, 4),
+                            (const gchar *) sqlite3_column_text (select, 5));
+      g_strfreev (actionv);
+
+      g_ptr_array_add (loaded, notification);
+    }
+
+  if (ret != SQLITE_DONE)
+    g_warning ("Unable to load notifications: %d", ret);
+
+  sqlite3_reset (select);
+
+  /* Now that the database is not busy anymore let the world know. */
+  g_mutex_lock (nm->priv->mutex);
+  for (i = 0; i < loaded->len; i++)
+    hd_notification_manager_ids_add (nm->priv->used_ids,
+               hd_notification_get_id (g_ptr_array_index (loaded, i)));
+  g_mutex_unlock (nm->priv->mutex);
+
+  /* Bracket the replayed notifications so listeners can process
+   * them as a batch rather than one by one. */
+  g_signal_emit (nm, signals[REPLAY_BEGIN], 0);
+  for (i = 0; i < loaded->len; i++)
+    {
+      notification = g_ptr_array_index (loaded, i);
+      g_hash_table_insert (nm->priv->notifications,
+                           GUINT_TO_POINTER (hd_notification_get_id (notification)),
+                           notification);
+      g_signal_emit (nm, signals[NOTIFIED], 0, notification, TRUE);
+    }
+  g_signal_emit (nm, signals[REPLAY_END], 0);
+
+  g_ptr_array_free (loaded, TRUE);
+}
+
+/* COMMITs the active transaction, if any.  Called by the writer. */
+static void
 hd_notification_manager_db_commit (HDNotificationManager *nm)
 {
+  HDNotificationManagerPrivate *priv = nm->priv;
+  HDNotificationManagerDbStats *stats = &priv->stats;
+  gint64 age;
+
   DBDBG(__FUNCTION__);
 
-  if (nm->priv->commit_timeout > time(NULL))
-    /* Not yet. */
-    return TRUE;
+  if (!priv->writer_in_txn)
+    return;
 
-  if (hd_notification_manager_db_prepare_and_exec (nm, "COMMIT")
+  if (hd_notification_manager_db_prepare_and_exec (nm, HD_NM_STMT_COMMIT)
       != SQLITE_OK)
-    /* We can lose more than one notification here but if COMMIT
-     * fails something is very wrong anyway. */
-    hd_notification_manager_db_prepare_and_exec (nm, "ROLLBACK");
+    { /* We can lose more than one notification here but if COMMIT
+       * fails something is very wrong anyway. */
+      hd_notification_manager_db_prepare_and_exec (nm, HD_NM_STMT_ROLLBACK);
+      g_mutex_lock (priv->mutex);
+      stats->rollbacks++;
+      g_mutex_unlock (priv->mutex);
+    }
+  else
+    { /* Account for the transaction. */
+      age = g_get_monotonic_time () - priv->writer_opened;
+
+      g_mutex_lock (priv->mutex);
+      stats->commits++;
+      stats->units += priv->writer_units;
+      stats->last_batch = priv->writer_units;
+      stats->max_batch = MAX (stats->max_batch, priv->writer_units);
+      stats->last_age = age;
+      stats->max_age = MAX (stats->max_age, age);
+      g_mutex_unlock (priv->mutex);
+
+      g_debug ("%s: committed %u units after %lld ms",
+               __FUNCTION__, priv->writer_units, (long long) age / 1000);
+    }
 
-  nm->priv->commit_callback = 0;
-  return FALSE;
+  priv->writer_in_txn = FALSE;
+  priv->writer_units = 0;
 }
 
 /* Like a plain BEGIN but allows you to batch multiple atomic units of work
  * in one transaction.  This is faster because writing back a transaction
- * is slow. */
+ * is slow.  Called by the writer. */
 static int
 hd_notification_manager_db_begin (HDNotificationManager *nm)
 { DBDBG(__FUNCTION__);
 
   /* Open a transaction if it hasn't been. */
-  if (!nm->priv->commit_callback)
+  if (!nm->priv->writer_in_txn)
     {
-      if (hd_notification_manager_db_prepare_and_exec (nm, "BEGIN")
+      if (hd_notification_manager_db_prepare_and_exec (nm, HD_NM_STMT_BEGIN)
           != SQLITE_OK)
         return SQLITE_ERROR;
-      nm->priv->commit_callback = g_timeout_add_seconds (10,
-                      (GSourceFunc)hd_notification_manager_db_commit, nm);
+      nm->priv->writer_in_txn = TRUE;
+      nm->priv->writer_opened = g_get_monotonic_time ();
+      nm->priv->writer_units = 0;
     }
 
   /* Create the savepoint we can revert to on error. */
-  if (hd_notification_manager_db_prepare_and_exec (nm, "SAVEPOINT willie")
+  if (hd_notification_manager_db_prepare_and_exec (nm, HD_NM_STMT_SAVEPOINT)
       != SQLITE_OK)
     /* It's okay to leave the transaction open, it's only that the caller
      * needs to know it shouldn't continue.  But other callers may. */
@@ -535,15 +986,15 @@ hd_notification_manager_db_begin (HDNotificationManager *nm)
 static int
 hd_notification_manager_db_finish (HDNotificationManager *nm)
 { DBDBG(__FUNCTION__);
-  g_assert (nm->priv->commit_callback != 0);
+  g_assert (nm->priv->writer_in_txn);
 
-  if (hd_notification_manager_db_prepare_and_exec (nm, "RELEASE willie")
+  if (hd_notification_manager_db_prepare_and_exec (nm, HD_NM_STMT_RELEASE)
       != SQLITE_OK)
     /* Caller will revert. */
     return SQLITE_ERROR;
 
-  /* Commit in 8 seconds or so. */
-  nm->priv->commit_timeout = time(NULL) + 8;
+  /* The main thread decides when to commit. */
+  nm->priv->writer_units++;
   return SQLITE_OK;
 }
 
@@ -552,14 +1003,289 @@ hd_notification_manager_db_finish (HDNotificationManager *nm)
 static void
 hd_notification_manager_db_revert (HDNotificationManager *nm)
 { DBDBG(__FUNCTION__);
-  g_assert (nm->priv->commit_callback != 0);
-  if (hd_notification_manager_db_prepare_and_exec (nm, "ROLLBACK TO willie")
+  g_assert (nm->priv->writer_in_txn);
+  if (hd_notification_manager_db_prepare_and_exec (nm, HD_NM_STMT_ROLLBACK_TO)
       != SQLITE_OK)
     { /* It is very nasty if ROLLBACK fails but what can we do? */
-      hd_notification_manager_db_prepare_and_exec (nm, "ROLLBACK");
-      g_source_remove (nm->priv->commit_callback);
-      nm->priv->commit_callback = 0;
+      hd_notification_manager_db_prepare_and_exec (nm, HD_NM_STMT_ROLLBACK);
+      nm->priv->writer_in_txn = FALSE;
+      nm->priv->writer_units = 0;
+      g_mutex_lock (nm->priv->mutex);
+      nm->priv->stats.rollbacks++;
+      g_mutex_unlock (nm->priv->mutex);
+    }
+}
+
+/* sqlite3_exec() callback to save the first column of the result. */
+static int
+hd_notification_manager_db_get_string (void   *data,
+                                       gint    argc,
+                                       gchar **argv,
+                                       gchar **col_name)
+{
+  gchar **result = data;
+
+  if (!*result && argc > 0 && argv[0])
+    *result = g_strdup (argv[0]);
+
+  return 0;
+}
+
+/* Returns whether @value is one of the NULL-terminated @allowed
+ * (case-insensitively).  This keeps configuration values we paste
+ * into PRAGMA:s sane. */
+static gboolean
+hd_notification_manager_db_value_allowed (const gchar *value,
+                                          const gchar *const *allowed)
+{
+  for (; *allowed; allowed++)
+    if (!g_ascii_strcasecmp (value, *allowed))
+      return TRUE;
+  return FALSE;
+}
+
+/* Applies the integer PRAGMA @pragma if @key is set in @conf. */
+static void
+hd_notification_manager_db_configure_int (HDNotificationManager *nm,
+                                          GKeyFile              *conf,
+                                          const gchar           *key,
+                                          const gchar           *pragma)
+{
+  GError *error = NULL;
+  gchar *sql;
+  gint value;
+
+  if (!g_key_file_has_key (conf, HD_NOTIFICATION_MANAGER_CONF_GROUP,
+                           key, NULL))
+    return;
+
+  value = g_key_file_get_integer (conf, HD_NOTIFICATION_MANAGER_CONF_GROUP,
+                                  key, &error);
+  if (error)
+    {
+      g_warning ("%s: %s", HD_NOTIFICATION_MANAGER_CONF, error->message);
+      g_error_free (error);
+      return;
     }
+
+  sql = g_strdup_printf ("PRAGMA %s = %d", pragma, value);
+  hd_notification_manager_db_exec (nm, sql);
+  g_free (sql);
+}
+
+/*
+ * Sets up the journaling and durability of the database according
+ * to the [Database] section of notification.conf.  Must be called
+ * before the tables are created for the page size to take effect.
+ */
+static void
+hd_notification_manager_db_configure (HDNotificationManager *nm)
+{
+  static const gchar *const journal_modes[] =
+    { "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF", NULL };
+  static const gchar *const synchronous_levels[] =
+    { "OFF", "NORMAL", "FULL", "EXTRA", "0", "1", "2", "3", NULL };
+  GKeyFile *conf;
+  gchar *journal_mode, *synchronous, *result, *sql;
+  gint value;
+
+  conf = g_key_file_new ();
+  g_key_file_load_from_file (conf, HD_NOTIFICATION_MANAGER_CONF,
+                             G_KEY_FILE_NONE, NULL);
+
+  /* The page size can only be changed before the database has any
+   * content and before switching to WAL. */
+  hd_notification_manager_db_configure_int (nm, conf,
+                                            "page-size", "page_size");
+
+  journal_mode = g_key_file_get_string (conf,
+                                        HD_NOTIFICATION_MANAGER_CONF_GROUP,
+                                        "journal-mode", NULL);
+  if (!journal_mode
+      || !hd_notification_manager_db_value_allowed (journal_mode,
+                                                    journal_modes))
+    {
+      if (journal_mode)
+        g_warning ("%s: invalid journal-mode %s",
+                   HD_NOTIFICATION_MANAGER_CONF, journal_mode);
+      g_free (journal_mode);
+      journal_mode = g_strdup (HD_NM_DEFAULT_JOURNAL_MODE);
+    }
+
+  /* journal_mode returns the mode actually in effect. */
+  result = NULL;
+  sql = g_strdup_printf ("PRAGMA journal_mode = %s", journal_mode);
+  if (sqlite3_exec (nm->priv->db, sql,
+                    hd_notification_manager_db_get_string, &result,
+                    NULL) != SQLITE_OK)
+    g_warning ("Unable to set journal mode %s", journal_mode);
+  nm->priv->wal = result && !g_ascii_strcasecmp (result, "wal");
+  g_free (result);
+  g_free (sql);
+  g_free (journal_mode);
+
+  synchronous = g_key_file_get_string (conf,
+                                       HD_NOTIFICATION_MANAGER_CONF_GROUP,
+                                       "synchronous", NULL);
+  if (!synchronous
+      || !hd_notification_manager_db_value_allowed (synchronous,
+                                                    synchronous_levels))
+    {
+      if (synchronous)
+        g_warning ("%s: invalid synchronous %s",
+                   HD_NOTIFICATION_MANAGER_CONF, synchronous);
+      g_free (synchronous);
+      synchronous = g_strdup (HD_NM_DEFAULT_SYNCHRONOUS);
+    }
+
+  sql = g_strdup_printf ("PRAGMA synchronous = %s", synchronous);
+  hd_notification_manager_db_exec (nm, sql);
+  g_free (sql);
+  g_free (synchronous);
+
+  hd_notification_manager_db_configure_int (nm, conf,
+                                            "cache-size", "cache_size");
+  if (nm->priv->wal)
+    hd_notification_manager_db_configure_int (nm, conf,
+                                              "wal-autocheckpoint",
+                                              "wal_autocheckpoint");
+
+  /* When to commit. */
+  value = g_key_file_get_integer (conf, HD_NOTIFICATION_MANAGER_CONF_GROUP,
+                                  "commit-latency", NULL);
+  nm->priv->commit_latency = value > 0
+    ? value
+    : HD_NM_DEFAULT_COMMIT_LATENCY;
+  value = g_key_file_get_integer (conf, HD_NOTIFICATION_MANAGER_CONF_GROUP,
+                                  "commit-idle", NULL);
+  nm->priv->commit_idle = value > 0
+    ? MIN ((guint) value, nm->priv->commit_latency)
+    : MIN (HD_NM_DEFAULT_COMMIT_IDLE, nm->priv->commit_latency);
+  value = g_key_file_get_integer (conf, HD_NOTIFICATION_MANAGER_CONF_GROUP,
+                                  "commit-batch", NULL);
+  nm->priv->commit_batch = value > 0
+    ? value
+    : HD_NM_DEFAULT_COMMIT_BATCH;
+
+  g_key_file_free (conf);
+}
+
+/*
+ * Converts a version 0 database to the current layout: serializes
+ * the actions and hints of every notification into its payload and
+ * drops the actions and hints tables.  The old rows are merge-joined
+ * by the notification ID, so each is read once.  Either all of it is
+ * done or nothing.
+ */
+static gint
+hd_notification_manager_db_migrate (HDNotificationManager *nm)
+{
+  sqlite3_stmt *select, *select_actions, *select_hints, *update;
+  GPtrArray *actions;
+  GHashTable *hints;
+  GVariant *payload;
+  gchar **actionv, *sql;
+  gint ret, ret_actions, ret_hints, id;
+
+  g_debug ("%s: migrating notifications.db to schema version %d",
+           __func__, HD_NM_SCHEMA_VERSION);
+
+  if (hd_notification_manager_db_exec (nm, "BEGIN") != SQLITE_OK)
+    return SQLITE_ERROR;
+  if (hd_notification_manager_db_exec (nm,
+          "ALTER TABLE notifications ADD COLUMN payload BLOB") != SQLITE_OK)
+    goto rollback;
+
+  select = select_actions = select_hints = update = NULL;
+  if (sqlite3_prepare_v2 (nm->priv->db, HD_NM_V0_SELECT_NOTIFICATIONS, -1,
+                          &select, NULL) != SQLITE_OK
+      || sqlite3_prepare_v2 (nm->priv->db, HD_NM_V0_SELECT_ACTIONS, -1,
+                             &select_actions, NULL) != SQLITE_OK
+      || sqlite3_prepare_v2 (nm->priv->db, HD_NM_V0_SELECT_HINTS, -1,
+                             &select_hints, NULL) != SQLITE_OK
+      || sqlite3_prepare_v2 (nm->priv->db, HD_NM_V0_UPDATE_PAYLOAD, -1,
+                             &update, NULL) != SQLITE_OK)
+    {
+      g_warning ("%s: %s", __func__, sqlite3_errmsg (nm->priv->db));
+      ret = SQLITE_ERROR;
+      goto finalize;
+    }
+
+  ret_actions = sqlite3_step (select_actions);
+  ret_hints = sqlite3_step (select_hints);
+  while ((ret = sqlite3_step (select)) == SQLITE_ROW)
+    {
+      id = sqlite3_column_int (select, 0);
+
+      /* Actions and hints of deleted notifications are skipped. */
+      actions = g_ptr_array_new ();
+      ret_actions = hd_notification_manager_db_skip_to (select_actions,
+                                                        ret_actions, id);
+      for (; ret_actions == SQLITE_ROW
+             && sqlite3_column_int (select_actions, 0) == id;
+           ret_actions = sqlite3_step (select_actions))
+        {
+          g_ptr_array_add (actions, g_strdup ((const gchar *)
+                           sqlite3_column_text (select_actions, 1)));
+          g_ptr_array_add (actions, g_strdup ((const gchar *)
+                           sqlite3_column_text (select_actions, 2)));
+        }
+      g_ptr_array_add (actions, NULL);
+      actionv = (gchar **) g_ptr_array_free (actions, FALSE);
+
+      hints = g_hash_table_new_full (g_str_hash,
+                                     g_str_equal,
+                                     (GDestroyNotify) g_free,
+                                     (GDestroyNotify) hint_value_free);
+      ret_hints = hd_notification_manager_db_skip_to (select_hints,
+                                                      ret_hints, id);
+      for (; ret_hints == SQLITE_ROW
+             && sqlite3_column_int (select_hints, 0) == id;
+           ret_hints = sqlite3_step (select_hints))
+        hd_notification_manager_db_load_hint (select_hints, hints);
+
+      payload = hd_notification_manager_db_encode (id, actionv, hints);
+      ret = hd_notification_manager_db_bind_params (update,
+                 DB_BIND_VARIANT (payload), DB_BIND_INT (id), DB_BIND_END);
+      if (ret == SQLITE_OK)
+        ret = hd_notification_manager_db_exec_prepared (update);
+
+      g_variant_unref (payload);
+      g_hash_table_destroy (hints);
+      g_strfreev (actionv);
+
+      if (ret != SQLITE_OK)
+        goto finalize;
+    }
+
+  if (ret == SQLITE_DONE
+      && (ret_actions == SQLITE_DONE || ret_actions == SQLITE_ROW)
+      && (ret_hints == SQLITE_DONE || ret_hints == SQLITE_ROW))
+    ret = SQLITE_OK;
+  else
+    g_warning ("%s: unable to read the old tables: %d", __func__, ret);
+
+finalize:
+  /* The tables can't be dropped while they're being read. */
+  sqlite3_finalize (select);
+  sqlite3_finalize (select_actions);
+  sqlite3_finalize (select_hints);
+  sqlite3_finalize (update);
+  if (ret != SQLITE_OK)
+    goto rollback;
+
+  sql = g_strdup_printf ("DROP TABLE actions;\n"
+                         "DROP TABLE hints;\n"
+                         "PRAGMA user_version = %d;\n"
+                         "COMMIT", HD_NM_SCHEMA_VERSION);
+  ret = hd_notification_manager_db_exec (nm, sql);
+  g_free (sql);
+  if (ret == SQLITE_OK)
+    return SQLITE_OK;
+
+rollback:
+  hd_notification_manager_db_exec (nm, "ROLLBACK");
+  return SQLITE_ERROR;
 }
 
 static gint
@@ -568,9 +1294,10 @@ hd_notification_manager_db_create (HDNotificationManager *nm)
   gchar **results;
   gint nrow, ncol;
   gchar *error = NULL;
+  gchar *sql, *version = NULL;
   gint result = SQLITE_OK;
 
-  sqlite3_get_table (nm->priv->db, 
+  sqlite3_get_table (nm->priv->db,
                      "SELECT tbl_name FROM sqlite_master WHERE type='table' ORDER BY tbl_name",
                      &results, &nrow, &ncol, &error);
 
@@ -584,132 +1311,34 @@ hd_notification_manager_db_create (HDNotificationManager *nm)
                                                 "    summary   VARCHAR(100) NOT NULL,\n"
                                                 "    body      VARCHAR(100) NOT NULL,\n"
                                                 "    timeout   INTEGER DEFAULT 0,\n"
-                                                "    dest      VARCHAR(100) NOT NULL\n"
-                                                ")");
-
-      result = hd_notification_manager_db_exec (nm,
-                                                "CREATE TABLE hints (\n"
-                                                "    id        VARCHAR(50),\n"
-                                                "    type      INTEGER,\n"
-                                                "    value     VARCHAR(200) NOT NULL,\n"
-                                                "    nid       INTEGER,\n"
-                                                "    PRIMARY KEY (id, nid)\n"
+                                                "    dest      VARCHAR(100) NOT NULL,\n"
+                                                "    payload   BLOB\n"
                                                 ")");
 
-      result = hd_notification_manager_db_exec (nm,
-                                                "CREATE TABLE actions (\n"
-                                                "    id        VARCHAR(50),\n"
-                                                "    label     VARCHAR(100) NOT NULL,\n"
-                                                "    nid       INTEGER,\n"
-                                                "    PRIMARY KEY (id, nid)\n"
-                                                ")");
+      sql = g_strdup_printf ("PRAGMA user_version = %d",
+                             HD_NM_SCHEMA_VERSION);
+      if (result == SQLITE_OK)
+        result = hd_notification_manager_db_exec (nm, sql);
+      g_free (sql);
     }
-
-  sqlite3_free_table (results);
-  if (error)
-    {
-      g_warning ("%s: SQL error: %s", __func__, error);
-      sqlite3_free (error);
-    }
-
-  return result; 
-}
-
-static int
-hd_notification_manager_db_insert_actions (HDNotificationManager  *nm,
-                                           guint                  id,
-                                           gchar                 **actions)
-{
-  guint i;
-  sqlite3_stmt *insert;
-
-  /* Insert the actions. */
-  insert = hd_notification_manager_db_prepare (nm,
-             "INSERT INTO actions (id, label, nid) VALUES (?, ?, ?)");
-  for (i = 0; actions && actions[i] != NULL; i += 2)
+  else
     {
-      if (hd_notification_manager_db_bind_params (insert,
-                 DB_BIND_STR(actions[i]), DB_BIND_STR(actions[i+1]),
-                 DB_BIND_INT(id), DB_BIND_END) != SQLITE_OK)
-        return SQLITE_ERROR;
-      if (hd_notification_manager_db_exec_prepared (insert) != SQLITE_OK)
-        return SQLITE_ERROR;
+      /* Upgrade from the layout of an older version of ourselves. */
+      sqlite3_exec (nm->priv->db, "PRAGMA user_version",
+                    hd_notification_manager_db_get_string, &version, NULL);
+      if (!version || atoi (version) < HD_NM_SCHEMA_VERSION)
+        result = hd_notification_manager_db_migrate (nm);
+      g_free (version);
     }
 
-  return SQLITE_OK;
-}
-
-static void 
-hd_notification_manager_db_insert_hint (gpointer key, gpointer value,
-                                        gpointer data)
-{
-  HildonNotificationHintInfo *hinfo = (HildonNotificationHintInfo *) data;
-  GValue *hvalue = (GValue *) value;
-  gchar *hkey = (gchar *) key;
-
-  /* Don't bother if we have an error already. */
-  if (hinfo->result != SQLITE_OK)
-    return;
-
-  /* Compile the statement. */
-  switch (G_VALUE_TYPE (hvalue))
+  sqlite3_free_table (results);
+  if (error)
     {
-    case G_TYPE_STRING:
-      hinfo->result = hd_notification_manager_db_bind_params (hinfo->stmt,
-             DB_BIND_STR (hkey), DB_BIND_INT (HD_NM_HINT_TYPE_STRING),
-             DB_BIND_STR (g_value_get_string (hvalue)),
-             DB_BIND_INT (hinfo->id), DB_BIND_END);
-      break;
-    case G_TYPE_INT:
-      hinfo->result = hd_notification_manager_db_bind_params (hinfo->stmt,
-             DB_BIND_STR (hkey), DB_BIND_INT (HD_NM_HINT_TYPE_INT),
-             DB_BIND_INT (g_value_get_int (hvalue)),
-             DB_BIND_INT (hinfo->id), DB_BIND_END);
-      break;
-    case G_TYPE_INT64:
-      hinfo->result = hd_notification_manager_db_bind_params (hinfo->stmt,
-             DB_BIND_STR (hkey), DB_BIND_INT (HD_NM_HINT_TYPE_INT64),
-             DB_BIND_INT64 (g_value_get_int64 (hvalue)),
-             DB_BIND_INT (hinfo->id), DB_BIND_END);
-      break;
-    case G_TYPE_FLOAT:
-      hinfo->result = hd_notification_manager_db_bind_params (hinfo->stmt,
-             DB_BIND_STR (hkey), DB_BIND_INT (HD_NM_HINT_TYPE_FLOAT),
-             DB_BIND_FLOAT (g_value_get_float (hvalue)),
-             DB_BIND_INT (hinfo->id), DB_BIND_END);
-      break;
-    case G_TYPE_UCHAR:
-      hinfo->result = hd_notification_manager_db_bind_params (hinfo->stmt,
-             DB_BIND_STR (hkey), DB_BIND_INT (HD_NM_HINT_TYPE_UCHAR),
-             DB_BIND_UCHAR (g_value_get_uchar (hvalue)),
-             DB_BIND_INT (hinfo->id), DB_BIND_END);
-      break;
-    default:
-      g_warning ("Hint `%s' of notification %d has invalid value type %u",
-                 hkey, hinfo->id, (unsigned int)G_VALUE_TYPE (hvalue));
-      hinfo->result = SQLITE_ERROR;
-      return;
+      g_warning ("%s: SQL error: %s", __func__, error);
+      sqlite3_free (error);
     }
 
-  if (hinfo->result == SQLITE_OK)
-    hinfo->result = hd_notification_manager_db_exec_prepared (hinfo->stmt);
-}
-
-static int
-hd_notification_manager_db_insert_hints (HDNotificationManager *nm,
-                                         guint                  id,
-                                         GHashTable            *hints)
-{
-  HildonNotificationHintInfo hinfo;
-
-  /* Insert the notification hints. */
-  hinfo.id = id;
-  hinfo.result = SQLITE_OK; 
-  hinfo.stmt = hd_notification_manager_db_prepare (nm,
-             "INSERT INTO hints (id, type, value, nid) "
-             "VALUES (?, ?, ?, ?)");
-  g_hash_table_foreach (hints, hd_notification_manager_db_insert_hint, &hinfo);
-  return hinfo.result;
+  return result;
 }
 
 static gint 
@@ -719,8 +1348,7 @@ hd_notification_manager_db_insert (HDNotificationManager *nm,
                                    const gchar           *icon,
                                    const gchar           *summary,
                                    const gchar           *body,
-                                   gchar                **actions,
-                                   GHashTable            *hints,
+                                   GVariant              *payload,
                                    gint                   timeout,
                                    const gchar           *dest)
 {
@@ -728,25 +1356,20 @@ hd_notification_manager_db_insert (HDNotificationManager *nm,
 
   /* Prepare and begin.  We needn't begin before prepare. */
   insert = hd_notification_manager_db_prepare (nm,
-             "INSERT INTO notifications "
-             "(id, app_name, icon_name, summary, body, timeout, dest) " 
-             "VALUES (?, ?, ?, ?, ?, ?, ?)");
+                                          HD_NM_STMT_INSERT_NOTIFICATION);
   if (hd_notification_manager_db_bind_params (insert,
              DB_BIND_INT(id), DB_BIND_STR(app_name), DB_BIND_STR(icon),
              DB_BIND_STR(summary), DB_BIND_STR(body), DB_BIND_INT(timeout),
-             DB_BIND_STR(dest), DB_BIND_END) != SQLITE_OK)
+             DB_BIND_STR(dest), DB_BIND_VARIANT(payload),
+             DB_BIND_END) != SQLITE_OK)
     return SQLITE_ERROR;
 
   if (hd_notification_manager_db_begin (nm) != SQLITE_OK)
     return SQLITE_ERROR;
 
-  /* Insert the notification, its actions and hints. */
+  /* Insert the notification with its actions and hints. */
   if (hd_notification_manager_db_exec_prepared (insert) != SQLITE_OK)
     goto rollback;
-  if (hd_notification_manager_db_insert_actions (nm, id, actions) != SQLITE_OK)
-    goto rollback;
-  if (hd_notification_manager_db_insert_hints (nm, id, hints) != SQLITE_OK)
-    goto rollback;
 
   /* Finish. */
   if (hd_notification_manager_db_finish(nm) == SQLITE_OK)
@@ -757,34 +1380,6 @@ rollback:
   return SQLITE_ERROR;
 }
 
-static gint
-hd_notification_manager_db_delete_actions_and_hints (
-                                    HDNotificationManager *nm,
-                                    guint                  id)
-{
-  sqlite3_stmt *delete;
-
-  /* Delete actions. */
-  delete = hd_notification_manager_db_prepare (nm,
-             "DELETE FROM actions WHERE nid = ?");
-  if (hd_notification_manager_db_bind_params (delete,
-             DB_BIND_INT (id), DB_BIND_END) != SQLITE_OK)
-    return SQLITE_ERROR;
-  if (hd_notification_manager_db_exec_prepared (delete) != SQLITE_OK)
-    return SQLITE_ERROR;
-
-  /* Delete hints. */
-  delete = hd_notification_manager_db_prepare (nm,
-             "DELETE FROM hints WHERE nid = ?");
-  if (hd_notification_manager_db_bind_params (delete,
-             DB_BIND_INT (id), DB_BIND_END) != SQLITE_OK)
-    return SQLITE_ERROR;
-  if (hd_notification_manager_db_exec_prepared (delete) != SQLITE_OK)
-    return SQLITE_ERROR;
-
-  return SQLITE_OK;
-}
-
 static gint
 hd_notification_manager_db_delete (HDNotificationManager *nm,
                                    guint                  id)
@@ -793,7 +1388,7 @@ hd_notification_manager_db_delete (HDNotificationManager *nm,
 
   /* Prepare and begin. */
   delete = hd_notification_manager_db_prepare (nm,
-             "DELETE FROM notifications WHERE id = ?");
+                                          HD_NM_STMT_DELETE_NOTIFICATION);
   if (hd_notification_manager_db_bind_params (delete,
              DB_BIND_INT (id), DB_BIND_END) != SQLITE_OK)
     return SQLITE_ERROR;
@@ -802,9 +1397,6 @@ hd_notification_manager_db_delete (HDNotificationManager *nm,
     return SQLITE_ERROR;
 
   /* Delete. */
-  if (hd_notification_manager_db_delete_actions_and_hints (nm, id)
-      != SQLITE_OK)
-    goto rollback;
   if (hd_notification_manager_db_exec_prepared (delete)
       != SQLITE_OK)
     goto rollback;
@@ -825,37 +1417,27 @@ hd_notification_manager_db_update (HDNotificationManager *nm,
                                    const gchar           *icon,
                                    const gchar           *summary,
                                    const gchar           *body,
-                                   gchar                **actions,
-                                   GHashTable            *hints,
+                                   GVariant              *payload,
                                    gint                   timeout)
 {
   sqlite3_stmt *update;
 
   /* Prepare and begin. */
   update = hd_notification_manager_db_prepare (nm,
-             "UPDATE notifications SET "
-             "  app_name = ?, icon_name = ?, "
-             "  summary = ?, body = ?, timeout = ? " 
-             "WHERE id = ?");
+                                          HD_NM_STMT_UPDATE_NOTIFICATION);
   if (hd_notification_manager_db_bind_params (update,
              DB_BIND_STR(app_name), DB_BIND_STR(icon), DB_BIND_STR(summary),
-             DB_BIND_STR(body), DB_BIND_INT(timeout), DB_BIND_INT(id),
+             DB_BIND_STR(body), DB_BIND_INT(timeout),
+             DB_BIND_VARIANT(payload), DB_BIND_INT(id),
              DB_BIND_END) != SQLITE_OK)
     return SQLITE_ERROR;
 
   if (hd_notification_manager_db_begin (nm) != SQLITE_OK)
     return SQLITE_ERROR;
 
-  /* Update the notification, then wipe out and re-add its actions
-   * and hints. */
+  /* Update the notification with its actions and hints. */
   if (hd_notification_manager_db_exec_prepared (update) != SQLITE_OK)
     goto rollback;
-  if (hd_notification_manager_db_delete_actions_and_hints (nm, id) != SQLITE_OK)
-    goto rollback;
-  if (hd_notification_manager_db_insert_actions (nm, id, actions) != SQLITE_OK)
-    goto rollback;
-  if (hd_notification_manager_db_insert_hints (nm, id, hints) != SQLITE_OK)
-    goto rollback;
 
   /* Finish. */
   if (hd_notification_manager_db_finish (nm) == SQLITE_OK)
@@ -866,16 +1448,296 @@ rollback:
   return SQLITE_ERROR;
 }
 
-void
-hd_notification_manager_db_commit_now (HDNotificationManager *nm)
+/* What the writer thread should do. */
+typedef enum
+{
+  HD_NM_DB_REQUEST_INSERT,
+  HD_NM_DB_REQUEST_UPDATE,
+  HD_NM_DB_REQUEST_DELETE,
+  HD_NM_DB_REQUEST_COMMIT,
+  HD_NM_DB_REQUEST_CHECKPOINT,
+  HD_NM_DB_REQUEST_BARRIER,
+} HDNotificationDbRequestType;
+
+/* Lets the main thread wait until the writer has got this far. */
+typedef struct
+{
+  GMutex   mutex;
+  GCond    cond;
+  gboolean reached;
+} HDNotificationDbBarrier;
+
+/*
+ * A unit of work for the writer thread.  It owns copies of everything
+ * it refers to because the notification may be gone by the time it
+ * is executed.  The actions and hints are serialized into @payload
+ * by the main thread, which is cheaper than copying them one by one
+ * and leaves nothing mutable to share with the writer.
+ */
+typedef struct
+{
+  HDNotificationManager       *nm;
+  HDNotificationDbRequestType  type;
+  guint                        id;
+  gchar                       *app_name;
+  gchar                       *icon;
+  gchar                       *summary;
+  gchar                       *body;
+  gchar                       *dest;
+  GVariant                    *payload;
+  gint                         timeout;
+  HDNotificationDbBarrier     *barrier;
+} HDNotificationDbRequest;
+
+static HDNotificationDbRequest *
+hd_notification_db_request_new (HDNotificationManager       *nm,
+                                HDNotificationDbRequestType  type,
+                                guint                        id)
+{
+  HDNotificationDbRequest *request = g_slice_new0 (HDNotificationDbRequest);
+
+  request->nm = nm;
+  request->type = type;
+  request->id = id;
+
+  return request;
+}
+
+static void
+hd_notification_db_request_free (HDNotificationDbRequest *request)
+{
+  g_free (request->app_name);
+  g_free (request->icon);
+  g_free (request->summary);
+  g_free (request->body);
+  g_free (request->dest);
+  if (request->payload)
+    g_variant_unref (request->payload);
+  g_slice_free (HDNotificationDbRequest, request);
+}
+
+/* #HDCommandCallback of the writer thread. */
+static void
+hd_notification_db_request_execute (HDNotificationDbRequest *request)
+{
+  HDNotificationManager *nm = request->nm;
+
+  switch (request->type)
+    {
+    case HD_NM_DB_REQUEST_INSERT:
+      hd_notification_manager_db_insert (nm,
+                                         request->app_name,
+                                         request->id,
+                                         request->icon,
+                                         request->summary,
+                                         request->body,
+                                         request->payload,
+                                         request->timeout,
+                                         request->dest);
+      break;
+    case HD_NM_DB_REQUEST_UPDATE:
+      hd_notification_manager_db_update (nm,
+                                         request->app_name,
+                                         request->id,
+                                         request->icon,
+                                         request->summary,
+                                         request->body,
+                                         request->payload,
+                                         request->timeout);
+      break;
+    case HD_NM_DB_REQUEST_DELETE:
+      hd_notification_manager_db_delete (nm, request->id);
+      break;
+    case HD_NM_DB_REQUEST_COMMIT:
+      hd_notification_manager_db_commit (nm);
+      break;
+    case HD_NM_DB_REQUEST_CHECKPOINT:
+      hd_notification_manager_db_commit (nm);
+      /* Fold the log back into the database. */
+      if (nm->priv->wal)
+        sqlite3_wal_checkpoint (nm->priv->db, NULL);
+      break;
+    case HD_NM_DB_REQUEST_BARRIER:
+      g_mutex_lock (&request->barrier->mutex);
+      request->barrier->reached = TRUE;
+      g_cond_signal (&request->barrier->cond);
+      g_mutex_unlock (&request->barrier->mutex);
+      break;
+    }
+}
+
+/* Hands @request over to the writer thread. */
+static void
+hd_notification_manager_db_push (HDNotificationManager   *nm,
+                                 HDNotificationDbRequest *request)
+{
+  hd_command_thread_pool_push (nm->priv->db_writer,
+                       (HDCommandCallback) hd_notification_db_request_execute,
+                       request,
+                       (GDestroyNotify) hd_notification_db_request_free);
+}
+
+/* Asks the writer to COMMIT (and checkpoint if @checkpoint) now. */
+static void
+hd_notification_manager_db_push_commit (HDNotificationManager *nm,
+                                        gboolean               checkpoint)
 {
   HDNotificationManagerPrivate *priv = nm->priv;
 
   if (priv->commit_callback)
-    { /* Remove the source first because _commit() clears it. */
-      priv->commit_timeout = 0;
+    {
       g_source_remove (priv->commit_callback);
-      hd_notification_manager_db_commit (nm);
+      priv->commit_callback = 0;
+    }
+  priv->txn_units = 0;
+
+  hd_notification_manager_db_push (nm,
+            hd_notification_db_request_new (nm,
+                                            checkpoint
+                                            ? HD_NM_DB_REQUEST_CHECKPOINT
+                                            : HD_NM_DB_REQUEST_COMMIT,
+                                            0));
+}
+
+/* #GSourceFunc to COMMIT the active transaction. */
+static gboolean
+hd_notification_manager_db_commit_timeout (HDNotificationManager *nm)
+{
+  nm->priv->commit_callback = 0;
+  hd_notification_manager_db_push_commit (nm, FALSE);
+  return FALSE;
+}
+
+/* Queues the modification @request and (re)arms the one-shot COMMIT
+ * timeout for the transaction it will be part of. */
+static void
+hd_notification_manager_db_push_work (HDNotificationManager   *nm,
+                                      HDNotificationDbRequest *request)
+{
+  HDNotificationManagerPrivate *priv = nm->priv;
+  gint64 now, deadline;
+  guint delay;
+
+  hd_notification_manager_db_push (nm, request);
+
+  now = g_get_monotonic_time ();
+  if (!priv->commit_callback)
+    { /* This starts a new transaction. */
+      priv->txn_opened = now;
+      priv->txn_units = 0;
+    }
+
+  /* Commit now if the transaction is big enough already,
+   * otherwise when we're idle or it is getting old. */
+  if (++priv->txn_units >= priv->commit_batch)
+    {
+      hd_notification_manager_db_push_commit (nm, FALSE);
+      return;
+    }
+
+  /* Whichever comes first, the end of the idle window or the
+   * maximal age of the transaction. */
+  deadline = MIN (now + (gint64) priv->commit_idle * G_USEC_PER_SEC,
+                  priv->txn_opened
+                  + (gint64) priv->commit_latency * G_USEC_PER_SEC);
+  delay = deadline > now
+    ? (deadline - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC
+    : 0;
+
+  if (priv->commit_callback)
+    g_source_remove (priv->commit_callback);
+  priv->commit_callback = delay > 0
+    ? g_timeout_add_seconds (delay,
+                  (GSourceFunc)hd_notification_manager_db_commit_timeout, nm)
+    : g_idle_add ((GSourceFunc)hd_notification_manager_db_commit_timeout, nm);
+}
+
+/* Waits until the writer has executed everything queued so far. */
+static void
+hd_notification_manager_db_wait (HDNotificationManager *nm)
+{
+  HDNotificationDbBarrier barrier;
+  HDNotificationDbRequest *request;
+
+  g_mutex_init (&barrier.mutex);
+  g_cond_init (&barrier.cond);
+  barrier.reached = FALSE;
+
+  request = hd_notification_db_request_new (nm, HD_NM_DB_REQUEST_BARRIER, 0);
+  request->barrier = &barrier;
+  hd_notification_manager_db_push (nm, request);
+
+  g_mutex_lock (&barrier.mutex);
+  while (!barrier.reached)
+    g_cond_wait (&barrier.cond, &barrier.mutex);
+  g_mutex_unlock (&barrier.mutex);
+
+  g_mutex_clear (&barrier.mutex);
+  g_cond_clear (&barrier.cond);
+}
+
+void
+hd_notification_manager_db_commit_now (HDNotificationManager *nm)
+{
+  /* This is called when the device is about to idle, a good time
+   * to fold the log back into the database too.  Don't wait for
+   * it to happen though. */
+  if (nm->priv->db)
+    hd_notification_manager_db_push_commit (nm, TRUE);
+}
+
+/**
+ * hd_notification_manager_db_flush:
+ * @nm: a #HDNotificationManager
+ *
+ * Commits all pending modifications of the notification database
+ * and waits until they are on the disk.  To be called before
+ * hildon-home quits.
+ */
+void
+hd_notification_manager_db_flush (HDNotificationManager *nm)
+{
+  g_return_if_fail (HD_IS_NOTIFICATION_MANAGER (nm));
+
+  if (!nm->priv->db)
+    return;
+
+  hd_notification_manager_db_push_commit (nm, FALSE);
+  hd_notification_manager_db_wait (nm);
+}
+
+/**
+ * hd_notification_manager_db_get_stats:
+ * @nm: a #HDNotificationManager
+ * @stats: where to store the counters
+ *
+ * Fills @stats with the statistics of the database transactions
+ * committed so far and of the one currently open, if any.
+ */
+void
+hd_notification_manager_db_get_stats (HDNotificationManager        *nm,
+                                      HDNotificationManagerDbStats *stats)
+{
+  HDNotificationManagerPrivate *priv;
+
+  g_return_if_fail (HD_IS_NOTIFICATION_MANAGER (nm));
+  g_return_if_fail (stats != NULL);
+
+  priv = nm->priv;
+
+  g_mutex_lock (priv->mutex);
+  *stats = priv->stats;
+  g_mutex_unlock (priv->mutex);
+
+  if (priv->commit_callback)
+    {
+      stats->open_units = priv->txn_units;
+      stats->open_age = g_get_monotonic_time () - priv->txn_opened;
+    }
+  else
+    {
+      stats->open_units = 0;
+      stats->open_age = 0;
     }
 }
 
@@ -941,11 +1803,20 @@ hd_notification_manager_init (HDNotificationManager *nm)
   g_mutex_init (nm->priv->mutex);
 
   nm->priv->current_id = 0;
+  nm->priv->commit_latency = HD_NM_DEFAULT_COMMIT_LATENCY;
+  nm->priv->commit_idle = HD_NM_DEFAULT_COMMIT_IDLE;
+  nm->priv->commit_batch = HD_NM_DEFAULT_COMMIT_BATCH;
+  nm->priv->used_ids = g_array_new (FALSE, FALSE,
+                                    sizeof (HDNotificationIdRange));
 
   nm->priv->notifications = g_hash_table_new_full (g_direct_hash,
                                                    g_direct_equal,
                                                    NULL,
                                                    (GDestroyNotify) g_object_unref);
+  nm->priv->calls = g_hash_table_new_full (g_str_hash,
+                                           g_str_equal,
+                                           g_free,
+                                           (GDestroyNotify) hd_notification_call_free);
 
   nm->priv->connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
   if (error != NULL)
@@ -1003,12 +1874,24 @@ hd_notification_manager_init (HDNotificationManager *nm)
           sqlite3_close (nm->priv->db);
           nm->priv->db = NULL;
         } else {
+            hd_notification_manager_db_configure (nm);
             result = hd_notification_manager_db_create (nm);
 
             if (result != SQLITE_OK)
               {
                 g_warning ("Can't create database: %s", sqlite3_errmsg (nm->priv->db));
+                sqlite3_close (nm->priv->db);
+                nm->priv->db = NULL;
+              }
+            else if (hd_notification_manager_db_prepare_all (nm) != SQLITE_OK)
+              {
+                g_warning ("Can't prepare statements: %s", sqlite3_errmsg (nm->priv->db));
+                hd_notification_manager_db_finalize_all (nm);
+                sqlite3_close (nm->priv->db);
+                nm->priv->db = NULL;
               }
+            else
+              nm->priv->db_writer = hd_command_thread_pool_new ();
         }
     }
   else
@@ -1038,24 +1921,15 @@ hd_notification_manager_finalize (GObject *object)
 {
   HDNotificationManagerPrivate *priv = HD_NOTIFICATION_MANAGER (object)->priv;
 
-  if (priv->mutex)
-    {
-      g_mutex_clear (priv->mutex);
-      g_free (priv->mutex);
-      priv->mutex = NULL;
-    }
-
   if (priv->db)
     {
-      /* Save uncommitted work. */
-      hd_notification_manager_db_commit_now (HD_NOTIFICATION_MANAGER (object));
+      /* Save uncommitted work and stop the writer once it's done. */
+      hd_notification_manager_db_push_commit (HD_NOTIFICATION_MANAGER (object),
+                                              FALSE);
+      priv->db_writer = (g_object_unref (priv->db_writer), NULL);
 
-      /* Release the prepared statements we know about. */
-      if (priv->prepared_statements)
-        {
-          g_hash_table_destroy (priv->prepared_statements);
-          priv->prepared_statements = NULL;
-        }
+      /* Release the prepared statements. */
+      hd_notification_manager_db_finalize_all (HD_NOTIFICATION_MANAGER (object));
 
       /* Now we can close the shop. */
       priv->db = (sqlite3_close (priv->db), NULL);
@@ -1063,6 +1937,18 @@ hd_notification_manager_finalize (GObject *object)
 
   if (priv->notifications)
     priv->notifications = (g_hash_table_destroy (priv->notifications), NULL);
+  if (priv->calls)
+    priv->calls = (g_hash_table_destroy (priv->calls), NULL);
+
+  if (priv->used_ids)
+    priv->used_ids = (g_array_free (priv->used_ids, TRUE), NULL);
+
+  if (priv->mutex)
+    {
+      g_mutex_clear (priv->mutex);
+      g_free (priv->mutex);
+      priv->mutex = NULL;
+    }
 
   G_OBJECT_CLASS (hd_notification_manager_parent_class)->finalize (object);
 }
@@ -1085,6 +1971,25 @@ hd_notification_manager_class_init (HDNotificationManagerClass *class)
                   G_TYPE_NONE, 2,
                   HD_TYPE_NOTIFICATION, G_TYPE_BOOLEAN);
 
+  /* Emitted around the "notified" signals of the notifications
+   * replayed by hd_notification_manager_db_load(). */
+  signals[REPLAY_BEGIN] =
+    g_signal_new ("replay-begin",
+                  G_OBJECT_CLASS_TYPE (g_object_class),
+                  G_SIGNAL_RUN_FIRST,
+                  0,
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
+  signals[REPLAY_END] =
+    g_signal_new ("replay-end",
+                  G_OBJECT_CLASS_TYPE (g_object_class),
+                  G_SIGNAL_RUN_FIRST,
+                  0,
+                  NULL, NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE, 0);
+
 }
 
 static DBusMessage *
@@ -1123,8 +2028,12 @@ hd_notification_manager_notification_closed (HDNotificationManager *nm,
 
   dbus_message_unref (message);
 
-  if (hd_notification_get_persistent (notification))
-    hd_notification_manager_db_delete (nm, hd_notification_get_id (notification));
+  if (hd_notification_get_persistent (notification) && nm->priv->db)
+    hd_notification_manager_db_push_work (nm,
+              hd_notification_db_request_new (nm, HD_NM_DB_REQUEST_DELETE,
+                                  hd_notification_get_id (notification)));
+
+  hd_notification_manager_release_id (nm, hd_notification_get_id (notification));
 }
 
 static gboolean 
@@ -1174,18 +2083,6 @@ hd_notification_manager_get (void)
   return nm;
 }
 
-static void 
-copy_hash_table_item (gchar *key, GValue *value, GHashTable *new_hash_table)
-{
-  GValue *value_copy = g_new0 (GValue, 1);
-
-  value_copy = g_value_init (value_copy, G_VALUE_TYPE (value));
-
-  g_value_copy (value, value_copy);
-
-  g_hash_table_insert (new_hash_table, g_strdup (key), value_copy);
-}
-
 static gboolean
 idle_emit (gpointer data)
 {
@@ -1220,9 +2117,7 @@ hd_notification_manager_notify (HDNotificationManager *nm,
                                 gint                   timeout, 
                                 DBusGMethodInvocation *context)
 {
-  GHashTable *hints_copy;
   GValue *hint;
-  gchar **actions_copy;
   gboolean valid_actions = TRUE;
   gboolean persistent = FALSE;
   gint i;
@@ -1276,24 +2171,19 @@ hd_notification_manager_notify (HDNotificationManager *nm,
             }
         }
 
-      if (valid_actions)
-        {
-          actions_copy = g_strdupv (actions);
-        }
-      else
-        {
-          actions_copy = NULL;
-        }
-
-      hints_copy = g_hash_table_new_full (g_str_hash, 
-                                          g_str_equal,
-                                          (GDestroyNotify) g_free,
-                                          (GDestroyNotify) hint_value_free);
+      if (!valid_actions)
+        actions = NULL;
 
-      g_hash_table_foreach (hints, (GHFunc) copy_hash_table_item, hints_copy);
+      /*
+       * Take over @hints rather than copying them.  dbus-glib only
+       * drops its reference when we return and its table frees the
+       * keys and values like ours would, so the notification can
+       * own it from now on.
+       */
+      g_hash_table_ref (hints);
 
       /* If there is no time hint use the current time */
-      if (!g_hash_table_lookup (hints_copy, "time"))
+      if (!g_hash_table_lookup (hints, "time"))
         {
           GValue *value = g_new0 (GValue, 1);
           time_t t;
@@ -1302,7 +2192,7 @@ hd_notification_manager_notify (HDNotificationManager *nm,
 
           g_value_init (value, G_TYPE_INT64);
           g_value_set_int64 (value, (gint64) t);
-          g_hash_table_insert (hints_copy, g_strdup ("time"), value);
+          g_hash_table_insert (hints, g_strdup ("time"), value);
         }
 
       sender = dbus_g_method_get_sender (context);
@@ -1313,8 +2203,8 @@ hd_notification_manager_notify (HDNotificationManager *nm,
                                           icon,
                                           summary,
                                           body,
-                                          actions_copy,
-                                          hints_copy,
+                                          actions,
+                                          hints,
                                           timeout,
                                           sender);
 
@@ -1328,21 +2218,25 @@ hd_notification_manager_notify (HDNotificationManager *nm,
 
       if (persistent && nm->priv->db)
         {
-          hd_notification_manager_db_insert (nm, 
-                                             app_name,
-                                             id, 
-                                             icon,
-                                             summary,
-                                             body,
-                                             actions_copy,
-                                             hints_copy,
-                                             timeout,
-                                             sender);
+          HDNotificationDbRequest *request;
+
+          request = hd_notification_db_request_new (nm,
+                                                    HD_NM_DB_REQUEST_INSERT,
+                                                    id);
+          request->app_name = g_strdup (app_name);
+          request->icon = g_strdup (icon);
+          request->summary = g_strdup (summary);
+          request->body = g_strdup (body);
+          request->dest = sender;
+          request->payload = hd_notification_manager_db_encode (id, actions,
+                                                                hints);
+          request->timeout = timeout;
+          hd_notification_manager_db_push_work (nm, request);
         }
+      else
+        g_free (sender);
 
-      g_strfreev (actions_copy);
       g_object_unref (notification);
-      g_free (sender);
     }
   else 
     {
@@ -1355,17 +2249,21 @@ hd_notification_manager_notify (HDNotificationManager *nm,
 
       gdk_threads_add_idle (idle_update, g_object_ref (notification));
 
-      if (persistent)
+      if (persistent && nm->priv->db)
         {
-          hd_notification_manager_db_update (nm, 
-                                             app_name,
-                                             id, 
-                                             icon,
-                                             summary,
-                                             body,
-                                             actions,
-                                             hints,
-                                             timeout);
+          HDNotificationDbRequest *request;
+
+          request = hd_notification_db_request_new (nm,
+                                                    HD_NM_DB_REQUEST_UPDATE,
+                                                    id);
+          request->app_name = g_strdup (app_name);
+          request->icon = g_strdup (icon);
+          request->summary = g_strdup (summary);
+          request->body = g_strdup (body);
+          request->payload = hd_notification_manager_db_encode (id, actions,
+                                                                hints);
+          request->timeout = timeout;
+          hd_notification_manager_db_push_work (nm, request);
         }
     }
 
@@ -1389,16 +2287,18 @@ hd_notification_manager_system_note_infoprint (HDNotificationManager *nm,
   GHashTable *hints;
   GValue *hint;
 
+  /* hd_notification_manager_notify() may keep @hints,
+   * so it must free its keys like dbus-glib's tables do. */
   hints = g_hash_table_new_full (g_str_hash, 
                                  g_str_equal,
-                                 NULL,
+                                 (GDestroyNotify) g_free,
                                  (GDestroyNotify) hint_value_free);
 
   hint = g_new0 (GValue, 1);
   hint = g_value_init (hint, G_TYPE_STRING);
   g_value_set_string (hint, "system.note.infoprint");
 
-  g_hash_table_insert (hints, "category", hint);
+  g_hash_table_insert (hints, g_strdup ("category"), hint);
 
   hd_notification_manager_notify (nm,
                                   "hildon-desktop",
@@ -1411,7 +2311,7 @@ hd_notification_manager_system_note_infoprint (HDNotificationManager *nm,
                                   3000,
                                   context);
 
-  g_hash_table_destroy (hints);
+  g_hash_table_unref (hints);
 
   return TRUE;
 }
@@ -1437,22 +2337,24 @@ hd_notification_manager_system_note_dialog (HDNotificationManager *nm,
       "qgn_note_gene_wait"        /* OSSO_GN_PROGRESS */
   };
 
+  /* hd_notification_manager_notify() may keep @hints,
+   * so it must free its keys like dbus-glib's tables do. */
   hints = g_hash_table_new_full (g_str_hash, 
                                  g_str_equal,
-                                 NULL,
+                                 (GDestroyNotify) g_free,
                                  (GDestroyNotify) hint_value_free);
 
   hint = g_new0 (GValue, 1);
   hint = g_value_init (hint, G_TYPE_STRING);
   g_value_set_string (hint, "system.note.dialog");
 
-  g_hash_table_insert (hints, "category", hint);
+  g_hash_table_insert (hints, g_strdup ("category"), hint);
 
   hint = g_new0 (GValue, 1);
   hint = g_value_init (hint, G_TYPE_UINT);
   g_value_set_uint (hint, type);
 
-  g_hash_table_insert (hints, "dialog-type", hint);
+  g_hash_table_insert (hints, g_strdup ("dialog-type"), hint);
 
   if (!g_str_equal (label, ""))
     {
@@ -1485,7 +2387,7 @@ hd_notification_manager_system_note_dialog (HDNotificationManager *nm,
                                   0,
                                   context);
 
-  g_hash_table_destroy (hints);
+  g_hash_table_unref (hints);
   g_strfreev (actions);
 
   return TRUE;
@@ -1558,10 +2460,37 @@ hd_notification_manager_close_notification (HDNotificationManager *nm,
     return FALSE;
 }
 
+/* A constant parameter of a #HDNotificationCall. */
+typedef struct
+{
+  gint type;
+  union
+  {
+    gchar        *v_string;
+    dbus_int32_t  v_int;
+    gdouble       v_double;
+  } value;
+} HDNotificationCallArg;
+
+/*
+ * A D-Bus method call description like
+ * "com.nokia.foo /com/nokia/foo com.nokia.foo method string:"bar" int:1"
+ * compiled so that it can be turned into a #DBusMessage without parsing.
+ */
+struct _HDNotificationCall
+{
+  gchar  *destination;
+  gchar  *path;
+  gchar  *interface;
+  gchar  *method;
+  GArray *args;
+};
+
 static guint
-parse_parameter (GScanner *scanner, DBusMessage *message)
+parse_parameter (GScanner *scanner, GArray *args)
 {
   GTokenType value_token;
+  HDNotificationCallArg arg;
 
   g_scanner_get_next_token (scanner);
 
@@ -1605,36 +2534,45 @@ parse_parameter (GScanner *scanner, DBusMessage *message)
       switch (value_token)
         {
         case G_TOKEN_STRING:
-          dbus_message_append_args (message,
-                                    DBUS_TYPE_STRING, &scanner->value.v_string,
-                                    DBUS_TYPE_INVALID);
+          arg.type = DBUS_TYPE_STRING;
+          arg.value.v_string = g_strdup (scanner->value.v_string);
           break;
         case G_TOKEN_INT:
-          dbus_message_append_args (message,
-                                    DBUS_TYPE_INT32, &scanner->value.v_int,
-                                    DBUS_TYPE_INVALID);
+          arg.type = DBUS_TYPE_INT32;
+          arg.value.v_int = (dbus_int32_t) scanner->value.v_int;
           break;
         case G_TOKEN_FLOAT:
-          dbus_message_append_args (message,
-                                    DBUS_TYPE_DOUBLE, &scanner->value.v_float,
-                                    DBUS_TYPE_INVALID);
+          arg.type = DBUS_TYPE_DOUBLE;
+          arg.value.v_double = scanner->value.v_float;
           break;
         default:
           return value_token;
         }
+      g_array_append_val (args, arg);
     }
 
   return G_TOKEN_NONE;
 }
 
-static DBusMessage *
-hd_notification_manager_message_from_desc (HDNotificationManager *nm,
-                                           const gchar *desc)
+/**
+ * hd_notification_call_new:
+ * @desc: a D-Bus callback description
+ *
+ * Compiles @desc, "destination path interface method [parameters]"
+ * where the parameters are space-separated "string:", "int:" and
+ * "double:" prefixed constants.
+ *
+ * Returns: a new #HDNotificationCall or %NULL if @desc is invalid.
+ */
+HDNotificationCall *
+hd_notification_call_new (const gchar *desc)
 {
-  DBusMessage *message;
+  HDNotificationCall *call;
   gchar **message_elements;
   gint n_elements;
 
+  g_return_val_if_fail (desc != NULL, NULL);
+
   message_elements = g_strsplit (desc, " ", 5);
 
   n_elements = g_strv_length (message_elements);
@@ -1642,14 +2580,17 @@ hd_notification_manager_message_from_desc (HDNotificationManager *nm,
   if (n_elements < 4)
     {
       g_warning ("Invalid notification D-Bus callback description.");
+      g_strfreev (message_elements);
 
       return NULL;
     } 
 
-  message = dbus_message_new_method_call (message_elements[0], 
-                                          message_elements[1], 
-                                          message_elements[2], 
-                                          message_elements[3]);
+  call = g_slice_new (HDNotificationCall);
+  call->destination = message_elements[0];
+  call->path = message_elements[1];
+  call->interface = message_elements[2];
+  call->method = message_elements[3];
+  call->args = g_array_new (FALSE, FALSE, sizeof (HDNotificationCallArg));
 
   if (n_elements > 4)
     {
@@ -1664,7 +2605,7 @@ hd_notification_manager_message_from_desc (HDNotificationManager *nm,
 
       do
         {
-          expected_token = parse_parameter (scanner, message);
+          expected_token = parse_parameter (scanner, call->args);
 
           g_scanner_peek_next_token (scanner);
         }
@@ -1672,22 +2613,118 @@ hd_notification_manager_message_from_desc (HDNotificationManager *nm,
              scanner->next_token != G_TOKEN_EOF &&
              scanner->next_token != G_TOKEN_ERROR);
 
+      g_scanner_destroy (scanner);
+      g_free (message_elements[4]);
+
       if (expected_token != G_TOKEN_NONE)
         {
           g_warning ("Invalid list of parameters for the notification"
                      " D-Bus callback.");
-          g_scanner_destroy (scanner);
+          g_free (message_elements);
+          hd_notification_call_free (call);
           return NULL;
         }
+    }
 
-      g_scanner_destroy (scanner);
+  /* The elements themselves are owned by @call now. */
+  g_free (message_elements);
+
+  return call;
+}
+
+void
+hd_notification_call_free (HDNotificationCall *call)
+{
+  guint i;
+
+  if (!call)
+    return;
+
+  for (i = 0; i < call->args->len; i++)
+    {
+      HDNotificationCallArg *arg = &g_array_index (call->args,
+                                                   HDNotificationCallArg, i);
+      if (arg->type == DBUS_TYPE_STRING)
+        g_free (arg->value.v_string);
     }
+  g_array_free (call->args, TRUE);
+
+  g_free (call->destination);
+  g_free (call->path);
+  g_free (call->interface);
+  g_free (call->method);
+  g_slice_free (HDNotificationCall, call);
+}
+
+/**
+ * hd_notification_call_build:
+ * @call: a #HDNotificationCall
+ * @arg: an extra string parameter to append or %NULL
+ *
+ * Returns: a new method call #DBusMessage as described by @call.
+ */
+DBusMessage *
+hd_notification_call_build (const HDNotificationCall *call,
+                            const gchar              *arg)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+  guint i;
+
+  g_return_val_if_fail (call != NULL, NULL);
 
-  g_strfreev (message_elements);
+  message = dbus_message_new_method_call (call->destination,
+                                          call->path,
+                                          call->interface,
+                                          call->method);
+  if (!message)
+    return NULL;
+
+  dbus_message_iter_init_append (message, &iter);
+  for (i = 0; i < call->args->len; i++)
+    {
+      HDNotificationCallArg *carg = &g_array_index (call->args,
+                                                    HDNotificationCallArg, i);
+      dbus_message_iter_append_basic (&iter, carg->type, &carg->value);
+    }
+  if (arg)
+    dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &arg);
 
   return message;
 }
 
+/* Returns the compiled @desc from the cache, compiling it if needed.
+ * Returns %NULL if @desc is invalid. */
+static HDNotificationCall *
+hd_notification_manager_lookup_call (HDNotificationManager *nm,
+                                     const gchar           *desc)
+{
+  HDNotificationCall *call;
+  gpointer cached;
+
+  if (g_hash_table_lookup_extended (nm->priv->calls, desc, NULL, &cached))
+    return cached;
+
+  if (g_hash_table_size (nm->priv->calls) >= HD_NM_MAX_CACHED_CALLS)
+    g_hash_table_remove_all (nm->priv->calls);
+
+  call = hd_notification_call_new (desc);
+  g_hash_table_insert (nm->priv->calls, g_strdup (desc), call);
+
+  return call;
+}
+
+static DBusMessage *
+hd_notification_manager_message_from_desc (HDNotificationManager *nm,
+                                           const gchar *desc,
+                                           const gchar *arg)
+{
+  HDNotificationCall *call;
+
+  call = hd_notification_manager_lookup_call (nm, desc);
+  return call ? hd_notification_call_build (call, arg) : NULL;
+}
+
 void
 hd_notification_manager_call_action (HDNotificationManager *nm,
                                      HDNotification        *notification,
@@ -1704,7 +2741,8 @@ hd_notification_manager_call_action (HDNotificationManager *nm,
   if (dbus_cb != NULL)
     {
       message = hd_notification_manager_message_from_desc (nm, 
-                                                           dbus_cb);
+                                                           dbus_cb,
+                                                           NULL);
     }
 
   if (message != NULL)
@@ -1763,7 +2801,7 @@ hd_notification_manager_call_dbus_callback (HDNotificationManager *nm,
   g_return_if_fail (HD_IS_NOTIFICATION_MANAGER (nm));
   g_return_if_fail (dbus_call != NULL);
 
-  message = hd_notification_manager_message_from_desc (nm, dbus_call); 
+  message = hd_notification_manager_message_from_desc (nm, dbus_call, NULL);
 
   if (message != NULL)
     {
@@ -1784,13 +2822,10 @@ hd_notification_manager_call_dbus_callback_with_arg (HDNotificationManager *nm,
   g_return_if_fail (HD_IS_NOTIFICATION_MANAGER (nm));
   g_return_if_fail (dbus_call != NULL);
 
-  message = hd_notification_manager_message_from_desc (nm, dbus_call); 
+  message = hd_notification_manager_message_from_desc (nm, dbus_call, arg);
 
   if (message != NULL)
     {
-      dbus_message_append_args (message,
-                                DBUS_TYPE_STRING, &arg,
-                                DBUS_TYPE_INVALID);
       dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection), 
                             message, 
                             NULL);
@@ -1808,4 +2843,27 @@ hd_notification_manager_call_message (HDNotificationManager *nm,
     dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection), 
                           message, 
                           NULL);
+}
+
+/* Like hd_notification_manager_call_dbus_callback_with_arg() but with
+ * a description compiled in advance.  @arg may be %NULL. */
+void
+hd_notification_manager_send_call (HDNotificationManager    *nm,
+                                   const HDNotificationCall *call,
+                                   const gchar              *arg)
+{ ACTION(__FUNCTION__);
+  DBusMessage *message;
+
+  g_return_if_fail (HD_IS_NOTIFICATION_MANAGER (nm));
+  g_return_if_fail (call != NULL);
+
+  message = hd_notification_call_build (call, arg);
+
+  if (message != NULL)
+    {
+      dbus_connection_send (dbus_g_connection_get_connection (nm->priv->connection), 
+                            message, 
+                            NULL);
+      dbus_message_unref (message);
+    }
 } 
@@ -41,6 +41,7 @@ G_BEGIN_DECLS
 typedef struct _HDNotificationManager        HDNotificationManager;
 typedef struct _HDNotificationManagerClass   HDNotificationManagerClass;
 typedef struct _HDNotificationManagerPrivate HDNotificationManagerPrivate;
+typedef struct _HDNotificationCall           HDNotificationCall;
 
 #define HD_TYPE_NOTIFICATION_MANAGER            (hd_notification_manager_get_type ())
 #define HD_NOTIFICATION_MANAGER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), HD_TYPE_NOTIFICATION_MANAGER, HDNotificationManager))
@@ -56,6 +57,33 @@ struct _HDNotificationManager
   HDNotificationManagerPrivate *priv;
 };
 
+/**
+ * HDNotificationManagerDbStats:
+ * @commits: number of transactions committed
+ * @rollbacks: number of transactions rolled back entirely
+ * @units: number of modifications committed
+ * @last_batch: number of modifications in the last committed transaction
+ * @max_batch: the most modifications committed in a single transaction
+ * @last_age: how long the last committed transaction was open, in µs
+ * @max_age: the longest a committed transaction was open, in µs
+ * @open_units: number of modifications in the open transaction
+ * @open_age: how long the open transaction has been open, in µs
+ *
+ * Counters of the notification database transactions.
+ */
+typedef struct
+{
+  guint  commits;
+  guint  rollbacks;
+  guint  units;
+  guint  last_batch;
+  guint  max_batch;
+  gint64 last_age;
+  gint64 max_age;
+  guint  open_units;
+  gint64 open_age;
+} HDNotificationManagerDbStats;
+
 struct _HDNotificationManagerClass 
 {
   GObjectClass parent_class;
@@ -70,6 +98,9 @@ HDNotificationManager *hd_notification_manager_get                   (void);
 
 void                  hd_notification_manager_db_load                (HDNotificationManager *nm);
 void                  hd_notification_manager_db_commit_now          (HDNotificationManager *nm);
+void                  hd_notification_manager_db_flush               (HDNotificationManager *nm);
+void                  hd_notification_manager_db_get_stats           (HDNotificationManager        *nm,
+                                                                      HDNotificationManagerDbStats *stats);
 
 gboolean               hd_notification_manager_notify                (HDNotificationManager *nm,
                                                                       const gchar           *app_name,
@@ -118,6 +149,14 @@ void                   hd_notification_manager_call_dbus_callback_with_arg (HDNo
                                                                             const gchar           *arg);
 void                   hd_notification_manager_call_message          (HDNotificationManager *nm,
                                                                       DBusMessage           *message);
+void                   hd_notification_manager_send_call             (HDNotificationManager    *nm,
+                                                                      const HDNotificationCall *call,
+                                                                      const gchar              *arg);
+
+HDNotificationCall    *hd_notification_call_new                      (const gchar              *desc);
+void                   hd_notification_call_free                     (HDNotificationCall       *call);
+DBusMessage           *hd_notification_call_build                    (const HDNotificationCall *call,
+                                                                      const gchar              *arg);
 
 G_END_DECLS
 
@@ -0,0 +1,284 @@
+/*
+ * hd-pixbuf-benchmark.c -- measure the background scaler
+ *
+ * This program loads the images given on the command line and scales
+ * and crops each of them to the background size, once with
+ * gdk_pixbuf_apply_embedded_orientation() and gdk_pixbuf_scale() the
+ * way it used to be done and once with hd_pixbuf_utils_scale_and_crop().
+ * It reports the time per image of both, with and without decoding the
+ * file, and how much the results differ.  For the comparison without
+ * decoding, the image is first shrunk to the size the JPEG loader
+ * would decode it at, within twice the size needed, as the bilinear
+ * filter of hd_pixbuf_utils_scale_and_crop() is meant for that.  Build
+ * it with `make hd-pixbuf-benchmark'.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "hd-pixbuf-utils.h"
+
+static gint iterations = 10;
+static gint width      = 800;
+static gint height     = 480;
+
+static GOptionEntry entries[] =
+{
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+    "Number of times to scale each image (10)", "N" },
+  { "width", 'W', 0, G_OPTION_ARG_INT, &width,
+    "Width of the result (800)", "PIXELS" },
+  { "height", 'H', 0, G_OPTION_ARG_INT, &height,
+    "Height of the result (480)", "PIXELS" },
+  { NULL }
+};
+
+/* What hildon-home did before hd_pixbuf_utils_scale_and_crop(). */
+static GdkPixbuf *
+bench_scale_gdk (GdkPixbuf   *source,
+                 HDImageSize *size)
+{
+  GdkPixbuf *rotated, *pixbuf;
+  double scale, destination_ratio, ratio;
+  gint image_width, image_height;
+
+  rotated = gdk_pixbuf_apply_embedded_orientation (source);
+  image_width = gdk_pixbuf_get_width (rotated);
+  image_height = gdk_pixbuf_get_height (rotated);
+
+  destination_ratio = (1. * size->width) / size->height;
+  ratio = (1. * image_width) / image_height;
+  if (ratio > destination_ratio)
+    scale = ((double) size->height) / image_height;
+  else
+    scale = ((double) size->width) / image_width;
+
+  pixbuf = gdk_pixbuf_new (gdk_pixbuf_get_colorspace (rotated),
+                           gdk_pixbuf_get_has_alpha (rotated),
+                           gdk_pixbuf_get_bits_per_sample (rotated),
+                           size->width,
+                           size->height);
+  gdk_pixbuf_scale (rotated,
+                    pixbuf,
+                    0, 0,
+                    size->width,
+                    size->height,
+                    - (image_width * scale - size->width) / 2,
+                    - (image_height * scale - size->height) / 2,
+                    scale,
+                    scale,
+                    GDK_INTERP_BILINEAR);
+  g_object_unref (rotated);
+
+  return pixbuf;
+}
+
+static GdkPixbuf *
+bench_scale_hd (GdkPixbuf   *source,
+                HDImageSize *size)
+{
+  const gchar *option = gdk_pixbuf_get_option (source, "orientation");
+  guint orientation = 1;
+
+  if (option)
+    orientation = g_ascii_strtoull (option, NULL, 10);
+
+  return hd_pixbuf_utils_scale_and_crop (source, orientation, size);
+}
+
+/* Shrinks @source by the largest power of two, up to 8, which leaves it
+ * covering @size, like load_jpeg_scaled() does with libjpeg. */
+static GdkPixbuf *
+bench_prepare (GdkPixbuf   *source,
+               HDImageSize *size)
+{
+  const gchar *option = gdk_pixbuf_get_option (source, "orientation");
+  GdkPixbuf *prepared;
+  gint width = gdk_pixbuf_get_width (source);
+  gint height = gdk_pixbuf_get_height (source);
+  gint image_width, image_height, denom;
+  double scale;
+
+  if (option && g_ascii_strtoull (option, NULL, 10) >= 5)
+    {
+      image_width = height;
+      image_height = width;
+    }
+  else
+    {
+      image_width = width;
+      image_height = height;
+    }
+
+  if ((1. * image_width) / image_height > (1. * size->width) / size->height)
+    scale = ((double) size->height) / image_height;
+  else
+    scale = ((double) size->width) / image_width;
+
+  for (denom = 8; denom > 1 && scale * denom > 1.; denom /= 2);
+  if (denom == 1)
+    return g_object_ref (source);
+
+  prepared = gdk_pixbuf_scale_simple (source,
+                                      (width + denom - 1) / denom,
+                                      (height + denom - 1) / denom,
+                                      GDK_INTERP_BILINEAR);
+  if (option)
+    gdk_pixbuf_set_option (prepared, "orientation", option);
+
+  return prepared;
+}
+
+/* Mean absolute difference of the samples of @a and @b. */
+static double
+bench_difference (GdkPixbuf *a,
+                  GdkPixbuf *b)
+{
+  gint n_channels = gdk_pixbuf_get_n_channels (a);
+  guint64 sum = 0;
+  gint x, y;
+
+  if (gdk_pixbuf_get_n_channels (b) != n_channels)
+    return -1;
+
+  for (y = 0; y < height; y++)
+    {
+      const guchar *p = gdk_pixbuf_get_pixels (a) +
+                        y * gdk_pixbuf_get_rowstride (a);
+      const guchar *q = gdk_pixbuf_get_pixels (b) +
+                        y * gdk_pixbuf_get_rowstride (b);
+
+      for (x = 0; x < width * n_channels; x++)
+        sum += ABS (p[x] - q[x]);
+    }
+
+  return (double) sum / ((double) width * height * n_channels);
+}
+
+static void
+bench_file (const gchar *filename)
+{
+  HDImageSize size = { width, height };
+  GdkPixbuf *source, *prepared, *old = NULL, *new = NULL;
+  GFile *file;
+  GTimer *timer;
+  GError *error = NULL;
+  double old_time, new_time, old_load, new_load;
+  gint i;
+
+  source = gdk_pixbuf_new_from_file (filename, &error);
+  if (!source)
+    {
+      g_printerr ("%s: %s\n", filename, error->message);
+      g_error_free (error);
+      return;
+    }
+
+  timer = g_timer_new ();
+
+  /* Scaling only, from what the loaders hand over */
+  prepared = bench_prepare (source, &size);
+  g_timer_start (timer);
+  for (i = 0; i < iterations; i++)
+    {
+      if (old)
+        g_object_unref (old);
+      old = bench_scale_gdk (prepared, &size);
+    }
+  old_time = g_timer_elapsed (timer, NULL) / iterations;
+
+  g_timer_start (timer);
+  for (i = 0; i < iterations; i++)
+    {
+      if (new)
+        g_object_unref (new);
+      new = bench_scale_hd (prepared, &size);
+    }
+  new_time = g_timer_elapsed (timer, NULL) / iterations;
+
+  g_print ("%s: %dx%d, orientation %s, scaled from %dx%d\n", filename,
+           gdk_pixbuf_get_width (source), gdk_pixbuf_get_height (source),
+           gdk_pixbuf_get_option (source, "orientation") ?: "1",
+           gdk_pixbuf_get_width (prepared), gdk_pixbuf_get_height (prepared));
+  g_print ("  scale     gdk %8.2f ms  hd %8.2f ms  %5.2fx  "
+           "difference %.2f\n",
+           old_time * 1000, new_time * 1000, old_time / new_time,
+           bench_difference (old, new));
+
+  g_object_unref (old);
+  g_object_unref (new);
+  g_object_unref (prepared);
+  g_object_unref (source);
+
+  /* Decoding and scaling */
+  g_timer_start (timer);
+  for (i = 0; i < iterations; i++)
+    {
+      source = gdk_pixbuf_new_from_file (filename, NULL);
+      old = bench_scale_gdk (source, &size);
+      g_object_unref (source);
+      g_object_unref (old);
+    }
+  old_load = g_timer_elapsed (timer, NULL) / iterations;
+
+  file = g_file_new_for_commandline_arg (filename);
+  g_timer_start (timer);
+  for (i = 0; i < iterations; i++)
+    {
+      new = hd_pixbuf_utils_load_scaled_and_cropped (file, &size, NULL,
+                                                     NULL, &error);
+      if (!new)
+        {
+          g_printerr ("%s: %s\n", filename, error->message);
+          g_clear_error (&error);
+          break;
+        }
+      g_object_unref (new);
+    }
+  new_load = g_timer_elapsed (timer, NULL) / iterations;
+  g_object_unref (file);
+
+  g_print ("  load      gdk %8.2f ms  hd %8.2f ms  %5.2fx\n",
+           old_load * 1000, new_load * 1000, old_load / new_load);
+
+  g_timer_destroy (timer);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  gint i;
+
+  context = g_option_context_new ("IMAGE... - benchmark the background "
+                                  "scaler");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+  g_option_context_free (context);
+  if (argc < 2 || iterations < 1 || width < 1 || height < 1)
+    {
+      g_printerr ("Give at least one image, and positive --iterations, "
+                  "--width and --height\n");
+      return 1;
+    }
+
+#if !GLIB_CHECK_VERSION(2,35,0)
+  g_type_init ();
+#endif
+
+  g_print ("%d iterations, %dx%d\n", iterations, width, height);
+
+  for (i = 1; i < argc; i++)
+    bench_file (argv[i]);
+
+  return 0;
+}
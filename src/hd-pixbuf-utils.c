@@ -24,6 +24,20 @@
 #include <config.h>
 #endif
 
+#include <string.h>
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#ifdef HAVE_LIBJPEG
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
 #include "hd-pixbuf-utils.h"
 
 /*
@@ -73,35 +87,344 @@ size_prepared_cb (GdkPixbufLoader *loader,
   gdk_pixbuf_loader_set_size (loader, image_size.width, image_size.height);
 }
 
+/*
+ * Blends the @n bytes of @line0 and @line1 into @dest, @weight / 256 of
+ * @line1.  This is where most of the time of the resampling goes, so
+ * there are vector versions of it.
+ */
+static void
+blend_lines (guchar       *dest,
+             const guchar *line0,
+             const guchar *line1,
+             gint          n,
+             gint          weight)
+{
+  gint i = 0;
+
+#if defined (__SSE2__)
+  const __m128i w0 = _mm_set1_epi16 (256 - weight);
+  const __m128i w1 = _mm_set1_epi16 (weight);
+  const __m128i half = _mm_set1_epi16 (128);
+  const __m128i zero = _mm_setzero_si128 ();
+
+  for (; i + 16 <= n; i += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (line0 + i));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (line1 + i));
+      __m128i lo, hi;
+
+      lo = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpacklo_epi8 (a, zero), w0),
+                          _mm_mullo_epi16 (_mm_unpacklo_epi8 (b, zero), w1));
+      hi = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpackhi_epi8 (a, zero), w0),
+                          _mm_mullo_epi16 (_mm_unpackhi_epi8 (b, zero), w1));
+      lo = _mm_srli_epi16 (_mm_add_epi16 (lo, half), 8);
+      hi = _mm_srli_epi16 (_mm_add_epi16 (hi, half), 8);
+
+      _mm_storeu_si128 ((__m128i *) (dest + i), _mm_packus_epi16 (lo, hi));
+    }
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+  const uint16x8_t w0 = vdupq_n_u16 (256 - weight);
+  const uint16x8_t w1 = vdupq_n_u16 (weight);
+
+  for (; i + 8 <= n; i += 8)
+    {
+      uint16x8_t sum;
+
+      sum = vmulq_u16 (vmovl_u8 (vld1_u8 (line0 + i)), w0);
+      sum = vmlaq_u16 (sum, vmovl_u8 (vld1_u8 (line1 + i)), w1);
+
+      vst1_u8 (dest + i, vrshrn_n_u16 (sum, 8));
+    }
+#endif
+
+  for (; i < n; i++)
+    dest[i] = (line0[i] * (256 - weight) + line1[i] * weight + 128) >> 8;
+}
+
+/* Copies the oriented row @row of @source, from the oriented column
+ * @first on, into @dest */
+static void
+gather_line (guchar       *dest,
+             const guchar *source,
+             gint          row,
+             gint          first,
+             gint          n,
+             gint          bpp,
+             gint          step_x,
+             gint          step_y)
+{
+  const guchar *p = source + row * step_y + first * step_x;
+  gint i, c;
+
+  for (i = 0; i < n; i++, p += step_x, dest += bpp)
+    for (c = 0; c < bpp; c++)
+      dest[c] = p[c];
+}
+
+/*
+ * The single pass of hd_pixbuf_utils_scale_and_crop().  Only the
+ * source rows and columns which end up in the result are read, each
+ * source row at most once.  The two taps of the filter only cover the
+ * source for scales above 1/2.
+ */
 static GdkPixbuf *
-scale_and_crop_pixbuf (const GdkPixbuf *source,
-                       HDImageSize     *destination_size)
+scale_and_crop_bilinear (const GdkPixbuf *source,
+                         guint            orientation,
+                         HDImageSize     *destination_size)
 {
   HDImageSize image_size;
-  double scale;
   GdkPixbuf *pixbuf;
+  const guchar *pixels, *line0, *line1;
+  guchar *buffers[3], *dest;
+  gint width, height, rowstride, bpp;
+  gint step_x, step_y, base;
+  gint first, last, span, row0, row1;
+  gint *columns, *weights;
+  gint x, y, c;
+  double scale, offset_x, offset_y, f;
 
-  image_size.width = gdk_pixbuf_get_width (source);
-  image_size.height = gdk_pixbuf_get_height (source);
+  width = gdk_pixbuf_get_width (source);
+  height = gdk_pixbuf_get_height (source);
+  rowstride = gdk_pixbuf_get_rowstride (source);
+  bpp = gdk_pixbuf_get_n_channels (source);
+  pixels = gdk_pixbuf_get_pixels (source);
+
+  /* Where oriented (0, 0) is in @source and how many bytes there are
+   * between oriented columns and rows */
+  switch (orientation)
+    {
+    case 2: /* Mirrored */
+      base = (width - 1) * bpp;
+      step_x = -bpp;
+      step_y = rowstride;
+      break;
+    case 3: /* Rotated 180 */
+      base = (height - 1) * rowstride + (width - 1) * bpp;
+      step_x = -bpp;
+      step_y = -rowstride;
+      break;
+    case 4: /* Flipped */
+      base = (height - 1) * rowstride;
+      step_x = bpp;
+      step_y = -rowstride;
+      break;
+    case 5: /* Transposed */
+      base = 0;
+      step_x = rowstride;
+      step_y = bpp;
+      break;
+    case 6: /* Rotated 90 clockwise */
+      base = (height - 1) * rowstride;
+      step_x = -rowstride;
+      step_y = bpp;
+      break;
+    case 7: /* Transversed */
+      base = (height - 1) * rowstride + (width - 1) * bpp;
+      step_x = -rowstride;
+      step_y = -bpp;
+      break;
+    case 8: /* Rotated 90 counterclockwise */
+      base = (width - 1) * bpp;
+      step_x = rowstride;
+      step_y = -bpp;
+      break;
+    default:
+      orientation = 1;
+      base = 0;
+      step_x = bpp;
+      step_y = rowstride;
+      break;
+    }
+  pixels += base;
+
+  /* Size of the image the way it's shown */
+  if (orientation >= 5)
+    {
+      image_size.width = height;
+      image_size.height = width;
+    }
+  else
+    {
+      image_size.width = width;
+      image_size.height = height;
+    }
 
   scale = get_scale_for_aspect_ratio (&image_size, destination_size);
+  offset_x = (image_size.width * scale - destination_size->width) / 2;
+  offset_y = (image_size.height * scale - destination_size->height) / 2;
 
-  pixbuf = gdk_pixbuf_new (gdk_pixbuf_get_colorspace (source),
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
                            gdk_pixbuf_get_has_alpha (source),
-                           gdk_pixbuf_get_bits_per_sample (source),
+                           8,
                            destination_size->width,
                            destination_size->height);
+  if (!pixbuf)
+    return NULL;
+
+  /* The oriented column and weight of each destination column */
+  columns = g_new (gint, destination_size->width);
+  weights = g_new (gint, destination_size->width);
+  for (x = 0; x < destination_size->width; x++)
+    {
+      f = (x + .5 + offset_x) / scale - .5;
+      f = CLAMP (f, 0, image_size.width - 1);
+      columns[x] = (gint) f;
+      weights[x] = (gint) ((f - columns[x]) * 256);
+    }
+
+  /* The oriented columns which are needed at all */
+  first = columns[0];
+  last = MIN (columns[destination_size->width - 1] + 1,
+              image_size.width - 1);
+  span = last - first + 1;
+  for (x = 0; x < destination_size->width; x++)
+    {
+      if (columns[x] == last)
+        weights[x] = 0;
+      columns[x] = (columns[x] - first) * bpp;
+    }
+
+  /* Two gathered lines and a blended one */
+  buffers[0] = g_malloc (span * bpp);
+  buffers[1] = g_malloc (span * bpp);
+  buffers[2] = g_malloc (span * bpp);
+  line0 = line1 = NULL;
+  row0 = row1 = -1;
 
-  gdk_pixbuf_scale (source,
-                    pixbuf,
-                    0, 0,
-                    destination_size->width,
-                    destination_size->height,
-                    - (image_size.width * scale - destination_size->width) / 2,
-                    - (image_size.height * scale - destination_size->height) / 2,
-                    scale,
-                    scale,
-                    GDK_INTERP_BILINEAR);
+  for (y = 0; y < destination_size->height; y++)
+    {
+      const guchar *line;
+      gint row, next_row, weight;
+
+      f = (y + .5 + offset_y) / scale - .5;
+      f = CLAMP (f, 0, image_size.height - 1);
+      row = (gint) f;
+      weight = (gint) ((f - row) * 256);
+      next_row = MIN (row + 1, image_size.height - 1);
+
+      /* Rows go down, so the second line is often the next first one */
+      if (row != row0 && row == row1)
+        {
+          guchar *swap = buffers[0];
+
+          buffers[0] = buffers[1];
+          buffers[1] = swap;
+          line0 = line1;
+          row0 = row1;
+          row1 = -1;
+        }
+
+      if (row != row0)
+        {
+          if (step_x == bpp)
+            line0 = pixels + row * step_y + first * step_x;
+          else
+            {
+              gather_line (buffers[0], pixels, row, first, span,
+                           bpp, step_x, step_y);
+              line0 = buffers[0];
+            }
+          row0 = row;
+        }
+
+      if (weight && next_row != row1)
+        {
+          if (step_x == bpp)
+            line1 = pixels + next_row * step_y + first * step_x;
+          else
+            {
+              gather_line (buffers[1], pixels, next_row, first, span,
+                           bpp, step_x, step_y);
+              line1 = buffers[1];
+            }
+          row1 = next_row;
+        }
+
+      if (weight)
+        {
+          blend_lines (buffers[2], line0, line1, span * bpp, weight);
+          line = buffers[2];
+        }
+      else
+        line = line0;
+
+      dest = gdk_pixbuf_get_pixels (pixbuf) + y * gdk_pixbuf_get_rowstride (pixbuf);
+      for (x = 0; x < destination_size->width; x++, dest += bpp)
+        {
+          const guchar *p = line + columns[x];
+          const guchar *q = p;
+          gint w = weights[x];
+
+          if (w)
+            q += bpp;
+
+          for (c = 0; c < bpp; c++)
+            dest[c] = (p[c] * (256 - w) + q[c] * w + 128) >> 8;
+        }
+    }
+
+  g_free (buffers[0]);
+  g_free (buffers[1]);
+  g_free (buffers[2]);
+  g_free (columns);
+  g_free (weights);
+
+  return pixbuf;
+}
+
+/*
+ * Scales, crops and orients @source.  @orientation is the EXIF
+ * orientation of @source (1..8).  The oriented image is scaled with
+ * bilinear filtering to cover @destination_size while keeping its
+ * aspect ratio, and centered.  This is done in a single pass for the
+ * scales above 1/2 both loaders produce.  A larger @source is first
+ * shrunk with gdk_pixbuf_scale_simple(), which averages all its pixels,
+ * so that it isn't aliased.
+ */
+GdkPixbuf *
+hd_pixbuf_utils_scale_and_crop (const GdkPixbuf *source,
+                                guint            orientation,
+                                HDImageSize     *destination_size)
+{
+  HDImageSize image_size;
+  GdkPixbuf *shrunk, *pixbuf;
+  gint width, height;
+  double scale;
+
+  g_return_val_if_fail (GDK_IS_PIXBUF (source), NULL);
+  g_return_val_if_fail (destination_size != NULL, NULL);
+  g_return_val_if_fail (destination_size->width > 0 &&
+                        destination_size->height > 0, NULL);
+
+  width = gdk_pixbuf_get_width (source);
+  height = gdk_pixbuf_get_height (source);
+
+  if (orientation >= 5 && orientation <= 8)
+    {
+      image_size.width = height;
+      image_size.height = width;
+    }
+  else
+    {
+      image_size.width = width;
+      image_size.height = height;
+    }
+
+  scale = get_scale_for_aspect_ratio (&image_size, destination_size);
+  if (scale >= .5)
+    return scale_and_crop_bilinear (source, orientation, destination_size);
+
+  /* About twice the size needed, rounded down so that the scale left
+   * is at least 1/2 */
+  shrunk = gdk_pixbuf_scale_simple (source,
+                                    MAX (1, (gint) (width * scale * 2)),
+                                    MAX (1, (gint) (height * scale * 2)),
+                                    GDK_INTERP_BILINEAR);
+  if (!shrunk)
+    return NULL;
+
+  pixbuf = scale_and_crop_bilinear (shrunk, orientation, destination_size);
+  g_object_unref (shrunk);
 
   return pixbuf;
 }
@@ -173,6 +496,323 @@ get_etag_from_file_input_stream (GFileInputStream  *stream,
   return TRUE;
 }
 
+#ifdef HAVE_LIBJPEG
+/*
+ * JPEG images are decoded with libjpeg directly rather than through
+ * GdkPixbufLoader, so the DCT can scale them down by 1/2, 1/4 or 1/8
+ * while decoding, which is much faster and takes much less memory than
+ * decoding camera photos at full size.  The EXIF orientation is left
+ * to hd_pixbuf_utils_scale_and_crop().
+ */
+
+typedef struct
+{
+  struct jpeg_source_mgr  pub;
+  GInputStream           *stream;
+  GCancellable           *cancellable;
+  GError                 *error;
+  JOCTET                  buffer[8192];
+} HDJpegSource;
+
+typedef struct
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf               setjmp_buffer;
+} HDJpegError;
+
+static void
+jpeg_source_init (j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+jpeg_source_fill (j_decompress_ptr cinfo)
+{
+  HDJpegSource *src = (HDJpegSource *) cinfo->src;
+  gssize read_bytes = -1;
+
+  if (!src->error)
+    read_bytes = g_input_stream_read (src->stream,
+                                      src->buffer,
+                                      sizeof (src->buffer),
+                                      src->cancellable,
+                                      &src->error);
+
+  if (read_bytes <= 0)
+    {
+      /* Insert a fake EOI marker, the decoder copes with that */
+      src->buffer[0] = (JOCTET) 0xFF;
+      src->buffer[1] = (JOCTET) JPEG_EOI;
+      read_bytes = 2;
+    }
+
+  src->pub.next_input_byte = src->buffer;
+  src->pub.bytes_in_buffer = read_bytes;
+
+  return TRUE;
+}
+
+static void
+jpeg_source_skip (j_decompress_ptr cinfo,
+                  long             num_bytes)
+{
+  HDJpegSource *src = (HDJpegSource *) cinfo->src;
+
+  if (num_bytes <= 0)
+    return;
+
+  while (num_bytes > (long) src->pub.bytes_in_buffer)
+    {
+      num_bytes -= (long) src->pub.bytes_in_buffer;
+      jpeg_source_fill (cinfo);
+    }
+
+  src->pub.next_input_byte += num_bytes;
+  src->pub.bytes_in_buffer -= num_bytes;
+}
+
+static void
+jpeg_source_term (j_decompress_ptr cinfo)
+{
+}
+
+static void
+jpeg_error_exit (j_common_ptr cinfo)
+{
+  HDJpegError *err = (HDJpegError *) cinfo->err;
+
+  longjmp (err->setjmp_buffer, 1);
+}
+
+static void
+jpeg_output_message (j_common_ptr cinfo)
+{
+  /* Corrupt data warnings are not interesting */
+}
+
+static guint
+jpeg_get_exif_uint (const JOCTET *data,
+                    gboolean      big_endian,
+                    guint         size)
+{
+  guint value = 0, i;
+
+  for (i = 0; i < size; i++)
+    value |= (guint) data[i] << 8 * (big_endian ? size - 1 - i : i);
+
+  return value;
+}
+
+/* Returns the EXIF orientation tag (1..8) of the image, 1 if there is
+ * none */
+static guint
+jpeg_get_orientation (j_decompress_ptr cinfo)
+{
+  jpeg_saved_marker_ptr marker;
+
+  for (marker = cinfo->marker_list; marker; marker = marker->next)
+    {
+      const JOCTET *tiff = marker->data + 6;
+      guint length, offset, entries, entry, i;
+      gboolean big_endian;
+
+      if (marker->marker != JPEG_APP0 + 1 ||
+          marker->data_length < 6 + 8 ||
+          memcmp (marker->data, "Exif\0\0", 6))
+        continue;
+
+      length = marker->data_length - 6;
+      if (tiff[0] != tiff[1] || (tiff[0] != 'I' && tiff[0] != 'M'))
+        continue;
+      big_endian = tiff[0] == 'M';
+
+      /* The first IFD */
+      offset = jpeg_get_exif_uint (tiff + 4, big_endian, 4);
+      if (offset > length - 2)
+        continue;
+
+      entries = jpeg_get_exif_uint (tiff + offset, big_endian, 2);
+      for (i = 0; i < entries; i++)
+        {
+          entry = offset + 2 + i * 12;
+          if (entry + 12 > length)
+            break;
+
+          /* Orientation, a SHORT */
+          if (jpeg_get_exif_uint (tiff + entry, big_endian, 2) == 0x0112 &&
+              jpeg_get_exif_uint (tiff + entry + 2, big_endian, 2) == 3)
+            {
+              guint orientation = jpeg_get_exif_uint (tiff + entry + 8,
+                                                      big_endian, 2);
+
+              return orientation >= 1 && orientation <= 8 ? orientation : 1;
+            }
+        }
+    }
+
+  return 1;
+}
+
+/*
+ * Decodes the JPEG image in @stream at the smallest DCT scale which is
+ * still at least as big as it has to be to be scaled and cropped to
+ * @size.  The image is not rotated, its EXIF orientation is returned in
+ * @orientation.
+ *
+ * Returns FALSE if @stream is not a JPEG image this can decode, so the
+ * caller should use GdkPixbufLoader instead, TRUE otherwise, with the
+ * pixbuf in @pixbuf or an error set.
+ */
+static gboolean
+load_jpeg_scaled (GInputStream  *stream,
+                  HDImageSize   *size,
+                  GdkPixbuf    **pixbuf,
+                  guint         *orientation,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  struct jpeg_decompress_struct cinfo;
+  HDJpegError jerr;
+  HDJpegSource *src;
+  HDImageSize image_size;
+  GdkPixbuf * volatile decoded = NULL;
+  volatile gboolean header_read = FALSE;
+  guint denom;
+  gint rowstride;
+  guchar *pixels;
+  double scale;
+
+  *pixbuf = NULL;
+  *orientation = 1;
+
+  cinfo.err = jpeg_std_error (&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
+  jerr.pub.output_message = jpeg_output_message;
+
+  jpeg_create_decompress (&cinfo);
+
+  src = g_new0 (HDJpegSource, 1);
+  src->pub.init_source = jpeg_source_init;
+  src->pub.fill_input_buffer = jpeg_source_fill;
+  src->pub.skip_input_data = jpeg_source_skip;
+  src->pub.resync_to_restart = jpeg_resync_to_restart;
+  src->pub.term_source = jpeg_source_term;
+  src->stream = stream;
+  src->cancellable = cancellable;
+  cinfo.src = &src->pub;
+
+  if (setjmp (jerr.setjmp_buffer))
+    {
+      gchar message[JMSG_LENGTH_MAX];
+
+      if (header_read)
+        {
+          cinfo.err->format_message ((j_common_ptr) &cinfo, message);
+          if (src->error)
+            g_propagate_error (error, src->error);
+          else
+            g_set_error (error,
+                         GDK_PIXBUF_ERROR,
+                         GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                         "Error interpreting JPEG image file (%s)",
+                         message);
+          src->error = NULL;
+        }
+      else
+        g_clear_error (&src->error);
+
+      if (decoded)
+        g_object_unref (decoded);
+      g_free (src);
+      jpeg_destroy_decompress (&cinfo);
+
+      return header_read;
+    }
+
+  jpeg_save_markers (&cinfo, JPEG_APP0 + 1, 0xffff);
+  jpeg_read_header (&cinfo, TRUE);
+  header_read = TRUE;
+
+  /* GdkPixbufLoader knows how to convert these */
+  if (cinfo.jpeg_color_space == JCS_CMYK ||
+      cinfo.jpeg_color_space == JCS_YCCK)
+    {
+      g_clear_error (&src->error);
+      g_free (src);
+      jpeg_destroy_decompress (&cinfo);
+      return FALSE;
+    }
+
+  *orientation = jpeg_get_orientation (&cinfo);
+
+  /* Size of the image the way it's shown */
+  if (*orientation >= 5)
+    {
+      image_size.width = cinfo.image_height;
+      image_size.height = cinfo.image_width;
+    }
+  else
+    {
+      image_size.width = cinfo.image_width;
+      image_size.height = cinfo.image_height;
+    }
+
+  scale = get_scale_for_aspect_ratio (&image_size, size);
+  for (denom = 8; denom > 1 && scale * denom > 1.; denom /= 2);
+
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.dct_method = JDCT_IFAST;
+
+  jpeg_start_decompress (&cinfo);
+
+  decoded = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8,
+                            cinfo.output_width, cinfo.output_height);
+  if (!decoded)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                           "Not enough memory to load JPEG image");
+      jpeg_abort_decompress (&cinfo);
+      g_clear_error (&src->error);
+      g_free (src);
+      jpeg_destroy_decompress (&cinfo);
+      return TRUE;
+    }
+
+  pixels = gdk_pixbuf_get_pixels (decoded);
+  rowstride = gdk_pixbuf_get_rowstride (decoded);
+
+  while (cinfo.output_scanline < cinfo.output_height)
+    {
+      JSAMPROW rows[1];
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, &src->error))
+        longjmp (jerr.setjmp_buffer, 1);
+
+      rows[0] = pixels + cinfo.output_scanline * rowstride;
+      jpeg_read_scanlines (&cinfo, rows, 1);
+    }
+
+  jpeg_finish_decompress (&cinfo);
+
+  if (src->error)
+    {
+      g_propagate_error (error, src->error);
+      g_object_unref (decoded);
+    }
+  else
+    *pixbuf = decoded;
+
+  g_free (src);
+  jpeg_destroy_decompress (&cinfo);
+
+  return TRUE;
+}
+#endif
+
 GdkPixbuf *
 hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
                                          HDImageSize   *size,
@@ -202,6 +842,37 @@ hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
                                         error))
     goto cleanup;
 
+#ifdef HAVE_LIBJPEG
+  /* Try the fast path, it needs to start over if it's not a JPEG */
+  if (g_seekable_can_seek (G_SEEKABLE (stream)))
+    {
+      GdkPixbuf *jpeg;
+      guint orientation;
+
+      if (load_jpeg_scaled (G_INPUT_STREAM (stream),
+                            size,
+                            &jpeg,
+                            &orientation,
+                            cancellable,
+                            error))
+        {
+          if (jpeg)
+            {
+              pixbuf = hd_pixbuf_utils_scale_and_crop (jpeg, orientation, size);
+              g_object_unref (jpeg);
+            }
+          goto cleanup;
+        }
+
+      if (!g_seekable_seek (G_SEEKABLE (stream),
+                            0,
+                            G_SEEK_SET,
+                            cancellable,
+                            error))
+        goto cleanup;
+    }
+#endif
+
   if (!read_from_input_stream_into_pixbuf_loader (G_INPUT_STREAM (stream),
                                                   loader,
                                                   cancellable,
@@ -212,9 +883,13 @@ hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
   pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
   if (pixbuf)
     {
-      GdkPixbuf *rotated = gdk_pixbuf_apply_embedded_orientation (pixbuf);
-      pixbuf = scale_and_crop_pixbuf (rotated, size);
-      g_object_unref (rotated);
+      const gchar *option = gdk_pixbuf_get_option (pixbuf, "orientation");
+      guint orientation = 1;
+
+      if (option)
+        orientation = g_ascii_strtoull (option, NULL, 10);
+
+      pixbuf = hd_pixbuf_utils_scale_and_crop (pixbuf, orientation, size);
     }
   else
     g_set_error_literal (error,
@@ -231,40 +906,286 @@ cleanup:
   return pixbuf;
 }
 
+typedef struct
+{
+  GOutputStream *stream;
+  GCancellable  *cancellable;
+} SaveData;
+
+static gboolean
+save_to_stream_cb (const gchar  *buffer,
+                   gsize         count,
+                   GError      **error,
+                   gpointer      user_data)
+{
+  SaveData *data = user_data;
+
+  return g_output_stream_write_all (data->stream,
+                                    buffer,
+                                    count,
+                                    NULL,
+                                    data->cancellable,
+                                    error);
+}
+
+/* Premultiplies @c by @a, rounding the way cairo does */
+#define PREMULTIPLY(c, a, t) ((t) = (c) * (a) + 0x80, ((t) + ((t) >> 8)) >> 8)
+
+/* Writes @pixbuf to @stream in one of the raw formats, a row at a time */
+static gboolean
+save_raw (GOutputStream             *stream,
+          GdkPixbuf                 *pixbuf,
+          HDPixbufUtilsRawFormat     format,
+          GCancellable              *cancellable,
+          GError                   **error)
+{
+  HDPixbufUtilsRawHeader header;
+  const guchar *pixels;
+  guchar *row;
+  gint width, height, rowstride, n_channels, x, y;
+  gboolean result = TRUE;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+
+  memset (&header, 0, sizeof (header));
+  header.magic = HD_PIXBUF_UTILS_RAW_MAGIC;
+  header.version = HD_PIXBUF_UTILS_RAW_VERSION;
+  header.format = format;
+  header.width = width;
+  header.height = height;
+  if (format == HD_PIXBUF_UTILS_RAW_RGB565)
+    header.stride = (width * 2 + 3) & ~3;
+  else
+    header.stride = width * 4;
+  header.offset = sizeof (header);
+
+  if (!g_output_stream_write_all (stream, &header, sizeof (header),
+                                  NULL, cancellable, error))
+    return FALSE;
+
+  row = g_malloc0 (header.stride);
+
+  for (y = 0; y < height && result; y++)
+    {
+      pixels = gdk_pixbuf_get_pixels (pixbuf) + y * rowstride;
+
+      if (format == HD_PIXBUF_UTILS_RAW_RGB565)
+        {
+          guint16 *dest = (guint16 *) row;
+
+          for (x = 0; x < width; x++, pixels += n_channels)
+            dest[x] = ((pixels[0] >> 3) << 11) |
+                      ((pixels[1] >> 2) << 5) |
+                      (pixels[2] >> 3);
+        }
+      else
+        {
+          guint32 *dest = (guint32 *) row;
+
+          for (x = 0; x < width; x++, pixels += n_channels)
+            {
+              guint a = n_channels == 4 ? pixels[3] : 0xff;
+              guint r, g, b, t;
+
+              if (a == 0xff)
+                {
+                  r = pixels[0];
+                  g = pixels[1];
+                  b = pixels[2];
+                }
+              else
+                {
+                  r = PREMULTIPLY (pixels[0], a, t);
+                  g = PREMULTIPLY (pixels[1], a, t);
+                  b = PREMULTIPLY (pixels[2], a, t);
+                }
+
+              dest[x] = (a << 24) | (r << 16) | (g << 8) | b;
+            }
+        }
+
+      result = g_output_stream_write_all (stream, row, header.stride,
+                                          NULL, cancellable, error);
+    }
+
+  g_free (row);
+
+  return result;
+}
+
+/*
+ * Saves @pixbuf to @file as @type, which is "argb32" or "rgb565" for
+ * the raw formats described in hd-pixbuf-utils.h or any format
+ * GdkPixbuf can save, with the options in @option_keys and
+ * @option_values as for gdk_pixbuf_savev().
+ *
+ * The image is encoded straight into the file rather than into memory
+ * first.  Like g_file_replace_contents(), the file is only replaced
+ * once the whole image has been written.
+ */
 gboolean
 hd_pixbuf_utils_save (GFile         *file,
                       GdkPixbuf     *pixbuf,
                       const gchar   *type,
+                      gchar        **option_keys,
+                      gchar        **option_values,
                       GCancellable  *cancellable,
                       GError       **error)
 {
-  gchar *buffer = NULL;
-  gsize buffer_size;
+  GFileOutputStream *stream;
+  SaveData data;
   gboolean result;
 
-  if (!gdk_pixbuf_save_to_buffer (pixbuf,
-                                  &buffer,
-                                  &buffer_size,
-                                  type,
-                                  error,
-                                  NULL))
+  stream = g_file_replace (file,
+                           NULL,
+                           FALSE,
+                           G_FILE_CREATE_NONE,
+                           cancellable,
+                           error);
+  if (!stream)
     return FALSE;
 
-  result = g_file_replace_contents (file,
-                                    buffer,
-                                    buffer_size,
-                                    NULL,
-                                    FALSE,
-                                    G_FILE_CREATE_NONE,
-                                    NULL,
+  if (!g_strcmp0 (type, "argb32"))
+    result = save_raw (G_OUTPUT_STREAM (stream), pixbuf,
+                       HD_PIXBUF_UTILS_RAW_ARGB32, cancellable, error);
+  else if (!g_strcmp0 (type, "rgb565"))
+    result = save_raw (G_OUTPUT_STREAM (stream), pixbuf,
+                       HD_PIXBUF_UTILS_RAW_RGB565, cancellable, error);
+  else
+    {
+      data.stream = G_OUTPUT_STREAM (stream);
+      data.cancellable = cancellable;
+      result = gdk_pixbuf_save_to_callbackv (pixbuf,
+                                             save_to_stream_cb,
+                                             &data,
+                                             type,
+                                             option_keys,
+                                             option_values,
+                                             error);
+    }
+
+  if (result)
+    result = g_output_stream_close (G_OUTPUT_STREAM (stream),
                                     cancellable,
                                     error);
+  else
+    {
+      /* Closing with a cancelled cancellable keeps the old file */
+      GCancellable *abort = g_cancellable_new ();
 
-  g_free (buffer);
+      g_cancellable_cancel (abort);
+      g_output_stream_close (G_OUTPUT_STREAM (stream), abort, NULL);
+      g_object_unref (abort);
+    }
+
+  g_object_unref (stream);
 
   return result;
 }
 
+/*
+ * Loads an image saved in one of the raw formats.  The file is mapped
+ * rather than read.
+ */
+GdkPixbuf *
+hd_pixbuf_utils_load_raw (const gchar  *filename,
+                          GError      **error)
+{
+  const HDPixbufUtilsRawHeader *header;
+  GMappedFile *mapped;
+  GdkPixbuf *pixbuf = NULL;
+  const guchar *contents;
+  gsize length;
+  guint x, y;
+
+  mapped = g_mapped_file_new (filename, FALSE, error);
+  if (!mapped)
+    return NULL;
+
+  contents = (const guchar *) g_mapped_file_get_contents (mapped);
+  length = g_mapped_file_get_length (mapped);
+  header = (const HDPixbufUtilsRawHeader *) contents;
+
+  if (length < sizeof (*header) ||
+      header->magic != HD_PIXBUF_UTILS_RAW_MAGIC ||
+      header->version != HD_PIXBUF_UTILS_RAW_VERSION ||
+      (header->format != HD_PIXBUF_UTILS_RAW_ARGB32 &&
+       header->format != HD_PIXBUF_UTILS_RAW_RGB565) ||
+      header->width == 0 || header->height == 0 ||
+      header->stride < header->width *
+                       (header->format == HD_PIXBUF_UTILS_RAW_RGB565 ? 2 : 4) ||
+      header->offset < sizeof (*header) ||
+      header->offset > length ||
+      (length - header->offset) / header->stride < header->height)
+    {
+      g_set_error (error,
+                   GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                   "Not a raw background image: %s",
+                   filename);
+      goto cleanup;
+    }
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+                           header->format == HD_PIXBUF_UTILS_RAW_ARGB32,
+                           8,
+                           header->width,
+                           header->height);
+  if (!pixbuf)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                           "Not enough memory to load raw image");
+      goto cleanup;
+    }
+
+  for (y = 0; y < header->height; y++)
+    {
+      const guchar *src = contents + header->offset + y * header->stride;
+      guchar *dest = gdk_pixbuf_get_pixels (pixbuf) +
+                     y * gdk_pixbuf_get_rowstride (pixbuf);
+
+      if (header->format == HD_PIXBUF_UTILS_RAW_RGB565)
+        for (x = 0; x < header->width; x++, dest += 3)
+          {
+            guint16 p = ((const guint16 *) src)[x];
+
+            dest[0] = ((p >> 11) << 3) | (p >> 13);
+            dest[1] = (((p >> 5) & 0x3f) << 2) | ((p >> 9) & 0x3);
+            dest[2] = ((p & 0x1f) << 3) | ((p >> 2) & 0x7);
+          }
+      else
+        for (x = 0; x < header->width; x++, dest += 4)
+          {
+            guint32 p = ((const guint32 *) src)[x];
+            guint a = p >> 24;
+
+            dest[3] = a;
+            if (a == 0xff || a == 0)
+              {
+                dest[0] = (p >> 16) & 0xff;
+                dest[1] = (p >> 8) & 0xff;
+                dest[2] = p & 0xff;
+              }
+            else
+              {
+                dest[0] = (((p >> 16) & 0xff) * 0xff + a / 2) / a;
+                dest[1] = (((p >> 8) & 0xff) * 0xff + a / 2) / a;
+                dest[2] = ((p & 0xff) * 0xff + a / 2) / a;
+              }
+          }
+    }
+
+cleanup:
+  g_mapped_file_unref (mapped);
+
+  return pixbuf;
+}
+
 static void
 size_prepared_exact_cb (GdkPixbufLoader *loader,
                         gint             width,
@@ -23,7 +23,8 @@
 #ifndef __HD_BACKGROUND_UTILS_H__
 #define __HD_BACKGROUND_UTILS_H__
 
-#include <gdk/gdk.h>
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
 
 G_BEGIN_DECLS
 
@@ -33,6 +34,35 @@ typedef struct
   int height;
 } HDImageSize;
 
+/*
+ * The raw formats store the pixels the way the compositor uploads them,
+ * so the image can be mapped and used without decoding it.  The file
+ * starts with this header, in the byte order of the device, which the
+ * magic number tells.  The rows start at @offset, @stride bytes apart.
+ * ARGB32 pixels are 32-bit words with premultiplied alpha, like
+ * CAIRO_FORMAT_ARGB32, RGB565 pixels are 16-bit words.
+ */
+#define HD_PIXBUF_UTILS_RAW_MAGIC   0x48444247 /* "HDBG" */
+#define HD_PIXBUF_UTILS_RAW_VERSION 1
+
+typedef enum
+{
+  HD_PIXBUF_UTILS_RAW_ARGB32 = 1,
+  HD_PIXBUF_UTILS_RAW_RGB565 = 2
+} HDPixbufUtilsRawFormat;
+
+typedef struct
+{
+  guint32 magic;
+  guint32 version;
+  guint32 format;
+  guint32 width;
+  guint32 height;
+  guint32 stride;
+  guint32 offset;
+  guint32 reserved;
+} HDPixbufUtilsRawHeader;
+
 GdkPixbuf *hd_pixbuf_utils_load_at_size (GFile         *file,
                                          HDImageSize   *size,
                                          char         **etag,
@@ -45,11 +75,20 @@ GdkPixbuf *hd_pixbuf_utils_load_scaled_and_cropped  (GFile         *file,
                                                      GCancellable  *cancellable,
                                                      GError       **error);
 
+GdkPixbuf *hd_pixbuf_utils_scale_and_crop           (const GdkPixbuf *source,
+                                                     guint            orientation,
+                                                     HDImageSize     *destination_size);
+
 gboolean   hd_pixbuf_utils_save                     (GFile         *file,
                                                      GdkPixbuf     *pixbuf,
                                                      const gchar   *type,
+                                                     gchar        **option_keys,
+                                                     gchar        **option_values,
                                                      GCancellable  *cancellable,
                                                      GError       **error);
+
+GdkPixbuf *hd_pixbuf_utils_load_raw                 (const gchar   *filename,
+                                                     GError       **error);
 G_END_DECLS
 
 #endif
@@ -142,6 +142,23 @@ create_cached_image_command (CommandData *data)
 
   gboolean error_dialogs = TRUE, update_gconf = TRUE;
 
+  /* Nothing to do if the images of all views are still there */
+  for (view = 0; view < HD_DESKTOP_VIEWS; view++)
+    {
+      HDImageSize screen_size = {HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT};
+
+      if (!hd_backgrounds_reuse_cached_image (hd_backgrounds_get (),
+                                              view,
+                                              view + 1,
+                                              data->file,
+                                              &screen_size,
+                                              update_gconf,
+                                              data->cancellable))
+        break;
+    }
+  if (view == HD_DESKTOP_VIEWS)
+    return;
+
   pixbuf = hd_pixbuf_utils_load_at_size (data->file,
                                          &wallpaper_size,
                                          &etag,
@@ -162,6 +179,7 @@ create_cached_image_command (CommandData *data)
       hd_backgrounds_save_cached_image (hd_backgrounds_get (),
                                         sub,
                                         view,
+                                        view + 1,
                                         data->file,
                                         etag,
                                         error_dialogs,
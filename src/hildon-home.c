@@ -419,8 +419,12 @@ main (int argc, char **argv)
   
   g_rename (HD_HOME_STAMP_FILE, HD_HOME_STAMP_FILE".sav");
 
+  /* The cache info is written behind, make sure it's on disk. */
+  hd_backgrounds_flush (hd_backgrounds_get ());
+
   /* We got a signal, flush the database.  How we do it breaks
    * if somebody has taken reference of the nm, but we don't. */
+  hd_notification_manager_db_flush (hd_notification_manager_get ());
   g_object_unref (hd_notification_manager_get ());
 
   return 0;